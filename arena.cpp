@@ -0,0 +1,14 @@
+#include "arena.h"
+
+SceneArena::SceneArena(size_t initial_block_size):memory(initial_block_size){}
+
+SceneArena::~SceneArena(){
+    for(auto it = destructors.rbegin(); it != destructors.rend(); it++){
+        it->second(it->first);
+    }
+    // memory releases every block when it is destroyed
+}
+
+std::shared_ptr<SceneArena> SceneArena::create(size_t initial_block_size){
+    return std::shared_ptr<SceneArena>(new SceneArena(initial_block_size));
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <memory>
+#include <memory_resource>
+#include <vector>
+#include <utility>
+#include <type_traits>
+
+// Bump allocator for scene objects and materials.
+// Everything made from it sits back to back in a few large blocks instead of one heap allocation each,
+// so a mesh's triangles end up next to each other in memory. The shared_ptrs it hands out all alias the
+// arena's own control block, so there is no per object control block either, and once the last of them
+// goes away every object is destroyed and all of the blocks are freed in one go.
+// That makes every one of those shared_ptrs an owner of the whole arena, so objects made in an arena must never
+// hold one to another object of the same arena - the arena would keep itself alive and never be freed. They
+// refer to each other by raw pointer or id instead (shapes keep a MaterialId, not the Material).
+// Not thread safe - a scene is built from one thread.
+class SceneArena:public std::enable_shared_from_this<SceneArena>{
+    std::pmr::monotonic_buffer_resource memory;
+    std::vector<std::pair<void*, void(*)(void*)>> destructors; // run newest first when the arena goes away
+    explicit SceneArena(size_t initial_block_size);
+
+    public:
+    SceneArena(const SceneArena& other) = delete;
+    ~SceneArena();
+    static std::shared_ptr<SceneArena> create(size_t initial_block_size = 1<<16);
+
+    template<typename T, typename... Args>
+    std::shared_ptr<T> make(Args&&... args){
+        T* object = new(memory.allocate(sizeof(T),alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            destructors.emplace_back(object, [](void* p){ static_cast<T*>(p)->~T(); });
+        return std::shared_ptr<T>(shared_from_this(), object);
+    }
+};
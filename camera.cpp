@@ -1,10 +1,14 @@
 #include "camera.h"
+#include "sampler.h"
+#include "model.h"
 #include <thread>
 #include <random>
 #include <algorithm>
 #include <execution>
 #include <ranges>
 #include <atomic>
+#include <mutex>
+#include <shared_mutex>
 
 using std::thread;
 
@@ -14,6 +18,7 @@ Camera::Camera(int px_width, int px_height, double focal_length, double viewport
 
 Camera::~Camera(){
     delete pixels;
+    delete aovs;
     image_save_threads.clear(); // will join each thread as it gets cleared
 }
 
@@ -23,17 +28,17 @@ void Camera::look_at(const Vector3 &point){
 }
 
 void Camera::write_to_png(std::string filename)const{
-    pixels->write_to_png(filename);
+    pixels->write_to_png(filename,png_compression_level);
 }
 void Camera::threaded_write_to_png(std::string filename){
     int px_width = pixels->width();
     int px_height = pixels->height();
     image_save_threads.emplace_back(
-        std::jthread([](Image* img,std::string filename){
-            img->write_to_png(filename);
+        std::jthread([](Image* img,std::string filename,int compression_level){
+            img->write_to_png(filename,compression_level);
             delete img;
         },
-        pixels,filename
+        pixels,filename,png_compression_level
     ));
     pixels = new Image(px_width,px_height);
 }
@@ -83,48 +88,158 @@ void Camera::render(const Hittable& scene){
     auto screen_origin = _calculate_screen_origin();
     auto pixel_delta_x = _calculate_pixel_delta_x();
     auto pixel_delta_y = _calculate_pixel_delta_y();
+    pixel_angle = pixel_delta_y.length() / focal_length;
+    bool want_aovs = capture_aovs || denoise_iterations > 0;
+    if(want_aovs && (!aovs || aovs->albedo.width() != pixels->width() || aovs->albedo.height() != pixels->height())){
+        delete aovs;
+        aovs = new AOVBuffers(pixels->width(),pixels->height());
+    }
+    if(!frame.resize(pixels->width(),pixels->height())) return;
+    photon_time = std::chrono::milliseconds(0);
+    photon_maps.clear();
+    if(photon_passes > 0){
+        Stopwatch timer;
+        _trace_photons(scene);
+        photon_time = timer.duration();
+    }
+    radiance_cache_time = std::chrono::milliseconds(0);
+    if(radiance_cache_depth > 0){
+        Stopwatch timer;
+        _fill_radiance_cache(scene,screen_origin,pixel_delta_x,pixel_delta_y);
+        radiance_cache_time = timer.duration();
+    }
 
     // Spawns multiple threads to saturate a CPU
-    // Each thread will grab the mutex to figure out what pixel they are working on
-    // there is no lock on the pixel array since each thread works on a different pixel and should not step on each other
-    std::atomic<int> next_x = 0;
-    std::atomic<int> next_y = 0;
-    std::mutex pixel_progress_lock;
-    auto capture = [this, &scene, &next_y,&next_x, &pixel_progress_lock, &screen_origin,&pixel_delta_x,&pixel_delta_y](){
-            int our_claimed_y, our_claimed_x;
-            Color accum = Black;
-            goto init_pixel_loop;
-            do {
-                accum = Black;
-                for(int sample=0; sample<sampling_per_pixel; sample++){
-                    Ray ray = _initial_pixel_ray(our_claimed_x,our_claimed_y,screen_origin,pixel_delta_x,pixel_delta_y, random_neg_pos_one(gen)/2.0, random_neg_pos_one(gen)/2.0);
-                    accum += _cast_ray_for_color(ray,scene);
+    // Each thread takes the next tile off of the counter and renders it into a tile of its own, so the threads
+    // never write next to each other until a finished tile is copied into the frame
+    std::atomic<int> next_tile = 0;
+    std::shared_mutex frame_mutex; // flushes share it, copying out the whole frame for the ongoing export does not
+    std::mutex export_mutex;
+    auto capture = [this, want_aovs, &scene, &next_tile, &frame_mutex, &export_mutex, &screen_origin,&pixel_delta_x,&pixel_delta_y](){
+            // The samples are always summed in double, even when the geometry is running in single precision
+            // Adding thousands of small samples into a float would otherwise lose the later ones
+            double accum[3];
+            // The AOVs and the spread of the samples' luminance for the variance
+            Color albedo_sum, normal_sum;
+            double depth_sum, luminance_sum, luminance_squared_sum;
+            int depth_count;
+            FirstHit first_hit;
+            std::unique_ptr<FrameBuffer::Tile> tile = std::make_unique<FrameBuffer::Tile>();
+            std::unique_ptr<Sampler> sampler = make_sampler(sampler_type);
+            current_sampler = sampler.get();
+            LazyMesh::TracingThread tracing;
+            for(int tile_index=next_tile++; tile_index<frame.tile_count(); tile_index=next_tile++){
+                frame.start_tile(tile_index,*tile);
+                for(int y=tile->y0; y<tile->y0+tile->height; y++){
+                    for(int x=tile->x0; x<tile->x0+tile->width; x++){
+                        accum[0] = accum[1] = accum[2] = 0.0;
+                        albedo_sum = normal_sum = Black;
+                        depth_sum = luminance_sum = luminance_squared_sum = 0.0;
+                        depth_count = 0;
+                        for(int sample=0; sample<sampling_per_pixel; sample++){
+                            tracing.quiescent(); // between paths nothing points into the scene
+                            sampler->start_pixel_sample(x,y,sample);
+                            Real jitter_x, jitter_y;
+                            sample_2d(jitter_x,jitter_y);
+                            Ray ray = _initial_pixel_ray(x,y,screen_origin,pixel_delta_x,pixel_delta_y, jitter_x-0.5, jitter_y-0.5);
+                            const PhotonMap* caustics = photon_maps.empty() ? nullptr : &photon_maps[sample % photon_maps.size()];
+                            Color sample_color = _cast_ray_for_color(ray,scene,want_aovs ? &first_hit : nullptr,false,caustics);
+                            accum[0] += sample_color.red;
+                            accum[1] += sample_color.green;
+                            accum[2] += sample_color.blue;
+                            if(want_aovs){
+                                albedo_sum += first_hit.albedo;
+                                normal_sum += first_hit.normal;
+                                if(first_hit.depth > 0){
+                                    depth_sum += first_hit.depth;
+                                    depth_count++;
+                                }
+                                double luminance = 0.2126*sample_color.red + 0.7152*sample_color.green + 0.0722*sample_color.blue;
+                                luminance_sum += luminance;
+                                luminance_squared_sum += luminance*luminance;
+                            }
+                        }
+                        if(want_aovs){
+                            FramePixelAOV& aov = tile->aov_at(x,y);
+                            aov.albedo = albedo_sum / (Real)sampling_per_pixel;
+                            // Left as the average, shorter than 1 where the samples disagree (edges, escaped rays)
+                            aov.normal = normal_sum / (Real)sampling_per_pixel;
+                            aov.depth = depth_count ? Real(depth_sum / depth_count) : 0;
+                            // Of the mean, so it shrinks as samples are added
+                            double mean = luminance_sum / sampling_per_pixel;
+                            double sample_variance = std::max(0.0, luminance_squared_sum / sampling_per_pixel - mean*mean);
+                            aov.variance = sample_variance / std::max(1, sampling_per_pixel-1);
+                        }
+                        tile->at(x,y) = FramePixel{{
+                            float(accum[0] / sampling_per_pixel),
+                            float(accum[1] / sampling_per_pixel),
+                            float(accum[2] / sampling_per_pixel)},
+                            float(sampling_per_pixel)
+                        };
+                    }
                 }
-                pixels->get_px(our_claimed_x,our_claimed_y) = accum / sampling_per_pixel;
-
-                if(ongoing_image_export && !our_claimed_x && our_claimed_y %ongoing_image_export == 0)
-                    write_to_png("ongoing.png");
-
-                // To be actually C complient, we cannot have an infinite while loop
-                // Also it just makes sense to have the loop conditional be in the right place
-                // So we have this label to jump to the bookkeeping code for the loop at the end which also serves to initialize the loop conditionals
-                // otherwise, i would be forced to duplicate code that does the setup before the loop
-                init_pixel_loop:
-                pixel_progress_lock.lock();
-                our_claimed_x = next_x++;
-                our_claimed_y = next_y;
-                if ( our_claimed_x >= pixels->width() ) {
-                    next_x = our_claimed_x = 0;
-                    our_claimed_y = next_y++;
+                {
+                    std::shared_lock<std::shared_mutex> guard(frame_mutex);
+                    frame.flush(*tile,want_aovs ? aovs : nullptr);
                 }
-                pixel_progress_lock.unlock();
-            } while( our_claimed_y < this->pixels->height() );
+
+                // The frame so far, each time a row of tiles starts past another ongoing_image_export rows.
+                // Only one thread exports at a time, the others skip it rather than wait.
+                if(ongoing_image_export && tile->x0 == 0 && tile->y0 % ongoing_image_export < FrameBuffer::tile_size){
+                    std::unique_lock<std::mutex> exporting(export_mutex, std::try_to_lock);
+                    if(exporting.owns_lock()){
+                        Image ongoing(frame.width(),frame.height());
+                        {
+                            std::unique_lock<std::shared_mutex> guard(frame_mutex);
+                            frame.to_image(ongoing);
+                        }
+                        ongoing.write_to_png("ongoing.png",png_compression_level);
+                    }
+                }
+            }
+            current_sampler = nullptr;
         };
     int max_threads = thread::hardware_concurrency();
     std::vector<std::jthread> threads(max_threads);
     for(int t=0; t<max_threads; t++){
         threads.emplace_back( std::jthread(capture) );
     }
+    threads.clear(); // waits for every pixel to be done
+    frame.to_image(*pixels);
+
+    denoise_time = std::chrono::milliseconds(0);
+    if(denoise_iterations > 0){
+        Stopwatch timer;
+        denoise(*pixels,*aovs,denoise_iterations);
+        denoise_time = timer.duration();
+    }
+}
+
+// One sample in every pixel for each fill pass, with independent random numbers and rows handed out to the
+// threads as they finish the last one
+void Camera::_fill_radiance_cache(const Hittable& scene, Vector3& screen_origin, Vector3& pixel_delta_x, Vector3& pixel_delta_y){
+    radiance_cache.reset(origin,pixel_angle);
+    std::atomic<int> next_row = 0;
+    int rows = pixels->height() * radiance_cache.fill_passes;
+    auto fill = [&](){
+        LazyMesh::TracingThread tracing;
+        for(int row=next_row++; row<rows; row=next_row++){
+            int y = row % pixels->height();
+            const PhotonMap* caustics = photon_maps.empty() ? nullptr : &photon_maps[row % photon_maps.size()];
+            for(int x=0; x<pixels->width(); x++){
+                tracing.quiescent();
+                Real jitter_x, jitter_y;
+                sample_2d(jitter_x,jitter_y); // no sampler on these threads, so straight from gen
+                Ray ray = _initial_pixel_ray(x,y,screen_origin,pixel_delta_x,pixel_delta_y, jitter_x-0.5, jitter_y-0.5);
+                _cast_ray_for_color(ray,scene,nullptr,true,caustics);
+            }
+        }
+    };
+    int max_threads = std::max(1u,thread::hardware_concurrency());
+    std::vector<std::jthread> threads;
+    for(int t=0; t<max_threads; t++){
+        threads.emplace_back( std::jthread(fill) );
+    }
 }
 
 static inline Color simulated_skybox(const Ray& ray) {
@@ -142,27 +257,323 @@ static inline Color simulated_skybox(const Ray& ray) {
     }
 }
 
-Color Camera::_cast_ray_for_color(Ray& ray, const Hittable& scene){
+// Multiple importance sampling weight for a sample from the technique with pdf a, when b could have made it too
+static inline double power_heuristic(double a, double b){
+    return (a*a) / (a*a + b*b);
+}
+
+// Light arriving at the hit straight from a light picked from the list, weighed against the chance that
+// the bounce would have found the same light by itself (which _cast_ray_for_color weighs the other way)
+Color Camera::_sample_direct_light(const Ray& ray, const HitRecord& rec, const Hittable& scene)const{
+    LightSample light;
+    if(!lights.sample(rec.intersection_point,rec.normal,light) || light.light == rec.object) return Black;
+    // Nothing reflects light that arrives from behind the surface
+    if(light.direction.dot(rec.normal) <= 0.0) return Black;
+    double bounce_pdf = scatter_pdf(rec.material,ray,rec,light.direction);
+    if(bounce_pdf <= 0.0) return Black;
+
+    Ray shadow_ray{offset_ray_origin(rec.intersection_point,rec.normal,light.direction), light.direction};
+    // Stopping just short of the light so the light itself does not count as in the way
+    if(scene.occluded(shadow_ray, RealRange(0.0001, light.distance*(Real)(1.0-1e-4)))) return Black;
+
+    Color bounced = scatter_eval(rec.material,ray,rec,light.direction);
+    return bounced * light.emitted * (Real)(power_heuristic(light.pdf,bounce_pdf) / light.pdf);
+}
+
+// Photons start from the shapes of the light list and from the sky (through a disk just outside everything
+// bounded, facing it), picked between by how much light each gives off. They are only kept once they land on
+// a diffuse surface having gone through nothing but glass and mirrors, and the first diffuse bounce ends
+// them - light that has been through one is left to the camera paths.
+void Camera::_trace_photons(const Hittable& scene){
+    // The sky shines onto the scene through a disk as wide as the sphere around the bounded objects
+    BBox bounds = scene.bounded_bbox();
+    bool sky_photons = bounds.is_finite();
+    Point3 scene_center = sky_photons ? bounds.center() : Point3{0,0,0};
+    Real scene_radius = sky_photons ? (bounds.max - bounds.min).length() * (Real)0.5 : 0;
+    const EnvironmentMap* environment = lights.environment();
+    auto sky_radiance = [&](const Vector3& to_sky){
+        return environment ? lights.environment_radiance(to_sky) : simulated_skybox(Ray{scene_center, to_sky});
+    };
+    auto luminance = [](const Color& c){ return 0.2126*c.red + 0.7152*c.green + 0.0722*c.blue; };
+    // The disk is outside of every bounded object, but an infinite plane can still be between it and the sky
+    auto sky_blocked = [&](const Point3& point, const Vector3& to_sky){
+        return scene.occluded(Ray{point,to_sky}, RealRange(0.0001,Infinity));
+    };
+    double sky_power = 0.0;
+    if(sky_photons){
+        LazyMesh::TracingThread tracing;
+        // Averaged over a spiral of evenly spread directions, leaving out the ones the sky cannot shine from
+        constexpr int directions = 1024;
+        for(int i=0; i<directions; i++){
+            double z = 1.0 - (2.0*i + 1.0)/directions;
+            double r = std::sqrt(std::max(0.0, 1.0 - z*z));
+            double angle = i * PI*(3.0 - std::sqrt(5.0));
+            Vector3 to_sky{Real(r*std::cos(angle)), Real(z), Real(r*std::sin(angle))};
+            if(!sky_blocked(scene_center + to_sky*scene_radius, to_sky))
+                sky_power += luminance(sky_radiance(to_sky));
+        }
+        sky_power *= 4.0*PI/directions * PI*scene_radius*scene_radius;
+    }
+    double total_power = sky_power + lights.shape_power();
+    if(total_power <= 0.0) return;
+    double sky_odds = sky_power / total_power;
+
+    double radius = photon_radius;
+    if(radius <= 0.0){
+        Point3 middle = sky_photons ? scene_center : Point3{0,0,0};
+        radius = std::max(1e-4, (middle - origin).length() * pixel_angle * 2.0);
+    }
+    constexpr double alpha = 2.0/3.0; // how much of the photons each pass keeps, Knaus and Zwicker's suggestion
+
+    photon_maps.resize(photon_passes);
+    int max_threads = std::max(1u,thread::hardware_concurrency());
+    for(int pass=0; pass<photon_passes; pass++){
+        std::vector<std::vector<Photon>> found(max_threads);
+        std::atomic<int> next_batch = 0;
+        constexpr int batch = 1024;
+        auto trace = [&](int thread_index){
+            std::vector<Photon>& out = found[thread_index];
+            HitRecord rec;
+            LazyMesh::TracingThread tracing;
+            for(int first=batch*next_batch++; first<photons_per_pass; first=batch*next_batch++){
+                for(int photon=first; photon<std::min(first+batch, photons_per_pass); photon++){
+                    tracing.quiescent();
+                    Ray ray;
+                    Color power;
+                    if(sample_1d() < sky_odds){
+                        Vector3 to_sky;
+                        double pdf;
+                        if(environment){
+                            Color unused;
+                            if(!environment->sample(to_sky,unused,pdf)) continue;
+                        } else {
+                            Real u,v;
+                            sample_2d(u,v);
+                            double z = 1.0 - 2.0*u, r = std::sqrt(std::max(0.0, 1.0 - z*z)), angle = 2.0*PI*v;
+                            to_sky = Vector3{Real(r*std::cos(angle)), Real(z), Real(r*std::sin(angle))};
+                            pdf = 1.0 / (4.0*PI);
+                        }
+                        Vector3 tangent, bitangent;
+                        Vector3::orthonormal_basis(to_sky,tangent,bitangent);
+                        Real u,v;
+                        sample_2d(u,v);
+                        double r = scene_radius * std::sqrt((double)u), angle = 2.0*PI*v;
+                        ray.origin = scene_center + to_sky*scene_radius + tangent*(Real)(r*std::cos(angle)) + bitangent*(Real)(r*std::sin(angle));
+                        if(sky_blocked(ray.origin,to_sky)) continue;
+                        ray.direction = to_sky.reverse();
+                        power = sky_radiance(to_sky) * (Real)(PI*scene_radius*scene_radius / (pdf * sky_odds));
+                    } else {
+                        if(!lights.emit(ray,power)) continue;
+                        power = power / (Real)(1.0 - sky_odds);
+                    }
+                    power = power / (Real)photons_per_pass;
+
+                    bool through_specular = false;
+                    for(int bounce=0; bounce<max_trace_depth; bounce++){
+                        RealRange hit_allowed_range(0.0001,Infinity);
+                        if(!scene.hit(ray,hit_allowed_range,rec)) break;
+                        rec.footprint = 0;
+                        if(through_specular && material_table[rec.material].type == MaterialType::BRD){
+                            Vector3 back = ray.direction.reverse().normalize();
+                            out.push_back({
+                                {(float)rec.intersection_point.x, (float)rec.intersection_point.y, (float)rec.intersection_point.z},
+                                {(float)back.x, (float)back.y, (float)back.z},
+                                {(float)power.red, (float)power.green, (float)power.blue}});
+                        }
+                        Color attenuation = Black;
+                        Ray next_bounce;
+                        double bounce_pdf = 0.0;
+                        scatter(rec.material,ray,rec,attenuation,next_bounce,bounce_pdf);
+                        if(bounce_pdf > 0.0) break;
+                        power = power * attenuation;
+                        if(std::max({power.red, power.green, power.blue}) <= 0) break;
+                        through_specular = true;
+                        next_bounce.origin = offset_ray_origin(rec.intersection_point,rec.normal,next_bounce.direction);
+                        ray = next_bounce;
+                    }
+                }
+            }
+        };
+        {
+            std::vector<std::jthread> threads;
+            for(int t=0; t<max_threads; t++){
+                threads.emplace_back( std::jthread(trace,t) );
+            }
+        }
+        std::vector<Photon> photons;
+        for(auto& list : found) photons.insert(photons.end(), list.begin(), list.end());
+        photon_maps[pass].build(std::move(photons),(Real)radius);
+        radius *= std::sqrt((pass + 1 + alpha) / (pass + 2));
+    }
+}
+
+// Density of the photons around the hit, each reflected towards the camera by the surface
+Color Camera::_gather_caustics(const PhotonMap& map, const Ray& ray, const HitRecord& rec)const{
+    Color sum = Black;
+    Real plane_distance = map.radius * (Real)0.25;
+    map.gather(rec.intersection_point, [&](const Photon& photon){
+        Vector3 direction{photon.direction[0], photon.direction[1], photon.direction[2]};
+        Real cosine = direction.dot(rec.normal);
+        if(cosine <= (Real)1e-3) return;
+        // Nothing from photons on other surfaces close by, like the far side of a thin wall
+        Vector3 offset = Point3{photon.position[0], photon.position[1], photon.position[2]} - rec.intersection_point;
+        if(std::fabs(offset.dot(rec.normal)) > plane_distance) return;
+        // scatter_eval has the cosine in it, photons already carry it in how tightly they landed
+        sum += scatter_eval(rec.material,ray,rec,direction) * Color{photon.power[0], photon.power[1], photon.power[2]} / cosine;
+    });
+    return sum / (Real)(PI * map.radius*map.radius);
+}
+
+// Sampler dimensions of one sample - the pixel jitter first, then the same block for every bounce so each
+// decision gets the same dimension in every sample of the pixel no matter which way the ones before it went
+static constexpr uint32_t pixel_dimensions = 2;
+static constexpr uint32_t light_dimension = 0; // which light and where on it (1 + 2)
+static constexpr uint32_t roulette_dimension = 3;
+static constexpr uint32_t scatter_dimension = 4; // which lobe and which way (1 + 2)
+static constexpr uint32_t bounce_dimensions = 7;
+
+Color Camera::_cast_ray_for_color(Ray& ray, const Hittable& scene, FirstHit* first_hit, bool filling_cache, const PhotonMap* caustics){
+    // Where a path is at - there is only ever more than one of these once splitting has forked the path
+    struct PathState{
+        Ray ray;
+        Color throughput;
+        // A cone around the path with the width of a pixel, for how blurry textures should be where it hits
+        Real cone_width, cone_spread;
+        int bounces;
+        // How likely the last bounce was to go the way it did, 0 when light sampling could not have picked
+        // that way too (the camera ray, mirror-like bounces) and whatever it finds counts in full
+        double bounce_pdf;
+        Vector3 bounce_normal; // of the surface the last bounce left, light picking depends on it
+        uint32_t stream; // of sampler dimensions, split off paths get new ones
+        // Only mirror-like bounces since the last diffuse one - with caustics the photons already brought
+        // whatever light this path finds back to that diffuse surface
+        bool specular_chain;
+    };
+    constexpr int max_pending = 16;
+    PathState pending[max_pending];
+    int pending_count = 0;
+    pending[pending_count++] = {ray, White, 0, pixel_angle, 0, 0.0, Vector3{0,0,0}, 0, false};
+    uint32_t next_stream = 1;
+    if(first_hit) *first_hit = {White, Black, 0};
+
     HitRecord rec;
-    Color total_attenuation = White;
     Color accumulated_energy = Black;
-    int depth_left = this->max_trace_depth;
-    while (depth_left > 0 && total_attenuation.length_squared()>0.0000001){
-        // This gets remade every loop since the .hit() method will trim the allowed_range to find only closer hits as it goes
-        RealRange hit_allowed_range(0.0001,Infinity);
-        if(scene.hit(ray,hit_allowed_range,rec)){
-            depth_left--;
-            Color additional_attenuation;
-            Ray next_bounce;
-            rec.material->scatter(ray,rec,additional_attenuation,next_bounce);
-
-            accumulated_energy += total_attenuation * rec.material->extra_light(ray,rec,total_attenuation);
-            total_attenuation = total_attenuation * additional_attenuation;
-            ray = next_bounce;
-        } else {
-            accumulated_energy += total_attenuation * simulated_skybox(ray);
-            break;
+    // While filling the cache, the surfaces the path went through so far and the light each one has sent along
+    // it since - the light reaching the camera divided by the throughput up to that surface
+    struct CacheVertex{
+        RadianceCache::Cell* cell;
+        Color inverse_throughput;
+        Color radiance;
+    };
+    constexpr int max_cache_vertices = 16;
+    CacheVertex cache_vertices[max_cache_vertices];
+    int cache_vertex_count = 0;
+    auto add_light = [&](const Color& light){
+        accumulated_energy += light;
+        for(int v=0; v<cache_vertex_count; v++) cache_vertices[v].radiance += light * cache_vertices[v].inverse_throughput;
+    };
+    while(pending_count){
+        PathState path = pending[--pending_count];
+        while(path.bounces < max_trace_depth){
+            // This gets remade every loop since the .hit() method will trim the allowed_range to find only closer hits as it goes
+            RealRange hit_allowed_range(0.0001,Infinity);
+            if(!scene.hit(path.ray,hit_allowed_range,rec)){
+                if(path.specular_chain) break;
+                if(!lights.environment()){
+                    add_light(path.throughput * simulated_skybox(path.ray));
+                    break;
+                }
+                // The environment is a light like any other, weighed against _sample_direct_light finding it
+                Color sky = lights.environment_radiance(path.ray.direction);
+                if(path.bounce_pdf > 0.0){
+                    double light_pdf = lights.environment_pdf(path.ray.direction);
+                    if(light_pdf > 0.0) sky = sky * (Real)power_heuristic(path.bounce_pdf,light_pdf);
+                }
+                add_light(path.throughput * sky);
+                break;
+            }
+            path.bounces++;
+            uint32_t first_dimension = pixel_dimensions + (path.bounces-1)*bounce_dimensions;
+            if(first_hit && path.bounces == 1)
+                *first_hit = {surface_albedo(rec.material,rec), rec.normal, rec.distanceScale * path.ray.direction.length()};
+            rec.footprint = path.cone_width + path.cone_spread*rec.distanceScale;
+            Color emitted = path.specular_chain ? Black : extra_light(rec.material);
+            if(path.bounce_pdf > 0.0){
+                double light_pdf = lights.pdf(path.ray.origin,path.bounce_normal,rec);
+                if(light_pdf > 0.0) emitted = emitted * (Real)power_heuristic(path.bounce_pdf,light_pdf);
+            }
+            add_light(path.throughput * emitted);
+
+            // Everything past here is light leaving this surface, which is what the cache holds
+            bool diffuse_surface = material_table[rec.material].type == MaterialType::BRD;
+            bool cached_surface = diffuse_surface && material_table[rec.material].roughness >= radiance_cache.min_roughness;
+            if(filling_cache){
+                if(cached_surface && cache_vertex_count < max_cache_vertices){
+                    RadianceCache::Cell* cell = radiance_cache.insert(rec.intersection_point,rec.normal);
+                    if(cell){
+                        Color inverse;
+                        for(int c=0; c<3; c++) inverse[c] = path.throughput[c] > 0 ? 1/path.throughput[c] : 0;
+                        cache_vertices[cache_vertex_count++] = {cell, inverse, Black};
+                    }
+                }
+            } else if(radiance_cache_depth > 0 && path.bounces >= radiance_cache_depth && path.bounce_pdf > 0.0 && cached_surface){
+                Color cached;
+                if(radiance_cache.lookup(rec.intersection_point,rec.normal,rec.footprint,cached)){
+                    accumulated_energy += path.throughput * cached;
+                    break;
+                }
+            }
+
+            if(caustics && diffuse_surface)
+                add_light(path.throughput * _gather_caustics(*caustics,path.ray,rec));
+
+            sample_dimension(first_dimension + light_dimension, path.stream);
+            if(!lights.empty())
+                add_light(path.throughput * _sample_direct_light(path.ray,rec,scene));
+
+            // Russian roulette and splitting, both keep the expected light of the path the same
+            double strength = std::max({path.throughput.x, path.throughput.y, path.throughput.z}) / roulette_throughput;
+            if(strength <= 0.0) break; // nothing more can come back along this path
+            int copies = 1;
+            if(path.bounces >= roulette_min_depth){
+                sample_dimension(first_dimension + roulette_dimension, path.stream);
+                if(strength < 1.0){
+                    if(sample_1d() >= strength) break;
+                    path.throughput /= (Real)strength;
+                } else if(max_splits > 1 && strength > 1.0 && !filling_cache){
+                    double split = std::min({strength, (double)max_splits, (double)(max_pending - pending_count + 1)});
+                    copies = (int)split;
+                    if(sample_1d() < split - copies) copies++;
+                    path.throughput /= (Real)split;
+                }
+            }
+
+            Ray incident = path.ray;
+            Color arriving = path.throughput;
+            for(int copy=0; copy<copies; copy++){
+                uint32_t stream = copy+1 < copies ? next_stream++ : path.stream;
+                sample_dimension(first_dimension + scatter_dimension, stream);
+                Color additional_attenuation;
+                Ray next_bounce;
+                double bounce_pdf;
+                scatter(rec.material,incident,rec,additional_attenuation,next_bounce,bounce_pdf);
+                next_bounce.origin = offset_ray_origin(rec.intersection_point,rec.normal,next_bounce.direction);
+
+                // Rough bounces widen the cone to about the solid angle their lobe covers, 1/pdf
+                Real spread = path.cone_spread;
+                if(bounce_pdf > 0.0) spread = std::max(spread, (Real)(2.0/std::sqrt(PI*bounce_pdf)));
+                bool specular_chain = caustics && bounce_pdf <= 0.0 && (path.bounce_pdf > 0.0 || path.specular_chain);
+                PathState next{next_bounce, arriving * additional_attenuation, rec.footprint, spread, path.bounces, bounce_pdf, rec.normal, stream, specular_chain};
+                // The last copy carries on in this loop, the rest wait their turn
+                if(copy+1 < copies) pending[pending_count++] = next;
+                else path = next;
+            }
         }
     }
+    for(int v=0; v<cache_vertex_count; v++){
+        const Color& radiance = cache_vertices[v].radiance;
+        if(std::isfinite(radiance.x + radiance.y + radiance.z))
+            RadianceCache::add(cache_vertices[v].cell,radiance);
+    }
     return accumulated_energy;
 }
@@ -5,13 +5,20 @@
 #include "vec_utils.h"
 #include "utils.h"
 #include "scene.h"
+#include "lights.h"
+#include "sampler.h"
+#include "denoise.h"
+#include "radiance_cache.h"
+#include "photon_map.h"
+#include "framebuffer.h"
 
 
 class Camera{
     private:
     std::vector<std::jthread> image_save_threads;
     public:
-    Image* pixels;
+    Image* pixels; // the finished frame, converted from frame once every tile of it is done
+    FrameBuffer frame; // rendered into a tile at a time
     Vector3 origin = {0.0,0.0,0.0};
     Vector3 look_direction = {0.0,0.0,-1.0};
     Vector3 up_direction = {0.0,1.0,0.0};
@@ -19,16 +26,61 @@ class Camera{
     bool inverted_y = true; // the world has up as positive y, but most viewports have positive y going down
     int sampling_per_pixel = 100;
     int max_trace_depth = 10;
+    // Past roulette_min_depth bounces a path whose throughput (brightest channel) is below roulette_throughput
+    // only carries on with odds of how close it is, and gets brighter to make up for the ones that stopped.
+    // With max_splits above 1 a path above it is split into that many at most instead, each carrying a share.
+    int roulette_min_depth = 3;
+    double roulette_throughput = 1.0;
+    int max_splits = 1;
     int ongoing_image_export = 0;
+    int png_compression_level = 2; // zlib's 0 to 9, saving a frame gets slower with more
+    // Where the random numbers for the pixel jitter and every sampling decision along the paths come from
+    SamplerType sampler_type = SamplerType::Sobol;
+    // Albedo, normal and depth of what each pixel sees first, only filled in when capture_aovs is set
+    // or the frame gets denoised (which needs them). Sized to the image on the first render that needs them.
+    bool capture_aovs = false;
+    AOVBuffers* aovs = nullptr;
+    // Edge avoiding a-trous passes run over the finished frame, 0 leaves it as rendered. 5 passes cover 61x61 pixels.
+    int denoise_iterations = 0;
+    std::chrono::milliseconds denoise_time{0}; // of the last render
+    // From this many bounces on, paths that reach a diffuse surface take the light leaving it from a cache filled
+    // by a few passes before the frame instead of tracing on. 0 turns the cache off, see RadianceCache for the rest.
+    int radiance_cache_depth = 0;
+    RadianceCache radiance_cache;
+    std::chrono::milliseconds radiance_cache_time{0}; // filling it for the last render
+    // Caustics through glass and mirrors from photons traced out of the lights and the sky, 0 passes leaves them
+    // to the camera paths. Each pass traces photons_per_pass with a smaller gather radius than the one before
+    // (Knaus and Zwicker's probabilistic progressive photon mapping) and the samples of a pixel take turns at
+    // them, so with more passes the blur of the caustics shrinks away and the result converges.
+    int photon_passes = 0;
+    int photons_per_pass = 200000;
+    double photon_radius = 0.0; // of the first pass in world units, 0 for 4 pixels wide at the middle of the scene
+    std::vector<PhotonMap> photon_maps;
+    std::chrono::milliseconds photon_time{0}; // tracing them for the last render
+    // Emissive objects of the scene to sample directly, with none every light has to be found by bouncing into it
+    LightList lights;
 
     protected:
     Vector3 viewport_up,viewport_right; // Calculated at the start of the render based on the look and up directions
+    Real pixel_angle; // how far apart neighbouring pixel rays spread, also calculated at the start of the render
     Ray _initial_pixel_ray(int x, int y, Vector3& screen_origin, Vector3& pixel_delta_x, Vector3& pixel_delta_y, double x_variance=0.0, double y_variance=0.0)const;
     Vector3 _calculate_screen_origin();
     Vector3 _calculate_pixel_delta_x()const;
     Vector3 _calculate_pixel_delta_y()const;
 
-    Color _cast_ray_for_color(Ray& ray, const Hittable& scene);
+    // What the camera ray of one sample hit first, for the AOVs
+    struct FirstHit{
+        Color albedo;
+        Vector3 normal;
+        Real depth; // 0 when it escaped
+    };
+    // filling_cache traces the whole path (without splitting) and adds what it finds to radiance_cache,
+    // with caustics the diffuse surfaces take their caustics from the photons
+    Color _cast_ray_for_color(Ray& ray, const Hittable& scene, FirstHit* first_hit=nullptr, bool filling_cache=false, const PhotonMap* caustics=nullptr);
+    void _fill_radiance_cache(const Hittable& scene, Vector3& screen_origin, Vector3& pixel_delta_x, Vector3& pixel_delta_y);
+    Color _sample_direct_light(const Ray& ray, const HitRecord& rec, const Hittable& scene)const;
+    void _trace_photons(const Hittable& scene);
+    Color _gather_caustics(const PhotonMap& map, const Ray& ray, const HitRecord& rec)const;
 
     public:
     Camera(int px_width=1920, int px_height=1080, double focal_length=1.0, double viewport_height=2.0);
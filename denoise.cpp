@@ -0,0 +1,155 @@
+#include "denoise.h"
+#include <cmath>
+#include <algorithm>
+#include <thread>
+
+AOVBuffers::AOVBuffers(int width, int height):
+    albedo(width,height), normals(width,height), depth(width,height), variance((size_t)width*height, 0.0f)
+{}
+
+void AOVBuffers::write_to_pfm(const std::string& prefix)const{
+    albedo.write_to_pfm(prefix + ".albedo.pfm");
+    normals.write_to_pfm(prefix + ".normal.pfm");
+    depth.write_to_pfm(prefix + ".depth.pfm");
+}
+
+static inline double luminance(const Color& c){
+    return 0.2126*c.red + 0.7152*c.green + 0.0722*c.blue;
+}
+
+// Runs rows first to last split up over every core, returning once all of them are done
+template<typename RowFunction>
+static void for_each_row(int height, RowFunction row_function){
+    int max_threads = std::max(1u,std::thread::hardware_concurrency());
+    int chunk = std::max(4, (height + max_threads-1) / max_threads);
+    std::vector<std::jthread> threads;
+    for(int first=0; first<height; first+=chunk){
+        threads.emplace_back( std::jthread([&row_function](int first, int last){
+            for(int y=first; y<last; y++) row_function(y);
+        }, first, std::min(first+chunk, height)) );
+    }
+}
+
+// How strongly each kind of difference stops the filter
+static constexpr int sigma_normal_squarings = 7; // the cosine between the normals to the power of 2^7 = 128
+static constexpr float sigma_depth = 1.0f; // in units of how fast the depth changes across the pixel
+static constexpr float sigma_luminance = 2.0f; // in standard deviations of the noise, SVGF's 4 blurred too much here
+
+// Everything a pass reads about a pixel packed into 16 bytes, the wider passes jump across so many rows that
+// the memory traffic is most of the cost
+struct GuidePixel{
+    float normal[3];
+    float depth; // 0 for escaped rays
+};
+struct LightingPixel{
+    float color[3];
+    float luminance;
+};
+
+void denoise(Image& beauty, const AOVBuffers& aovs, int iterations){
+    const int width = beauty.width(), height = beauty.height();
+    const size_t count = (size_t)width*height;
+
+    // Lighting without the albedo, and the variance of it. Black albedo (and emitters) have nothing to divide out.
+    std::vector<Color> divided_albedo(count);
+    std::vector<LightingPixel> lighting(count), next_lighting(count);
+    std::vector<float> variance(count), next_variance(count);
+    std::vector<GuidePixel> guide(count);
+    for(size_t i=0; i<count; i++){
+        Color albedo = aovs.albedo[i];
+        for(int c=0; c<3; c++) if(albedo[c] < 1e-3) albedo[c] = 1;
+        divided_albedo[i] = albedo;
+        Color divided = beauty[i] / albedo;
+        lighting[i] = {{(float)divided.red, (float)divided.green, (float)divided.blue}, (float)luminance(divided)};
+        double scale = luminance(albedo);
+        variance[i] = aovs.variance[i] / (scale*scale);
+        const Vector3& normal = aovs.normals[i];
+        guide[i] = {{(float)normal.x, (float)normal.y, (float)normal.z}, (float)aovs.depth[i].x};
+    }
+
+    // How fast depth changes around each pixel, so a slanted floor does not look like an edge everywhere
+    std::vector<float> depth_gradient(count, 0.0f);
+    for_each_row(height, [&](int y){
+        for(int x=0; x<width; x++){
+            float center = guide[(size_t)y*width + x].depth;
+            if(center <= 0.0f) continue;
+            float gradient = 0.0f;
+            for(auto [dx,dy] : {std::pair{1,0}, std::pair{-1,0}, std::pair{0,1}, std::pair{0,-1}}){
+                int nx = x+dx, ny = y+dy;
+                if(nx < 0 || ny < 0 || nx >= width || ny >= height) continue;
+                float neighbour = guide[(size_t)ny*width + nx].depth;
+                if(neighbour > 0.0f) gradient = std::max(gradient, std::fabs(neighbour - center));
+            }
+            depth_gradient[(size_t)y*width + x] = gradient;
+        }
+    });
+
+    static constexpr float kernel[3] = {3.0f/8.0f, 1.0f/4.0f, 1.0f/16.0f}; // B3 spline, by distance from the center
+    float inverse_distance[5][5]; // in taps
+    for(int j=-2; j<=2; j++) for(int i=-2; i<=2; i++) inverse_distance[j+2][i+2] = (i||j) ? 1.0f/std::sqrt((float)(i*i + j*j)) : 0.0f;
+
+    for(int iteration=0; iteration<iterations; iteration++){
+        int step = 1 << iteration;
+        for_each_row(height, [&](int y){
+            for(int x=0; x<width; x++){
+                size_t p = (size_t)y*width + x;
+                // The variance is blurred a little before it decides anything, a single pixel of it is too noisy
+                float blurred_variance = 0.0f, variance_weight = 0.0f;
+                for(int dy=-1; dy<=1; dy++){
+                    for(int dx=-1; dx<=1; dx++){
+                        int nx = x+dx, ny = y+dy;
+                        if(nx < 0 || ny < 0 || nx >= width || ny >= height) continue;
+                        float w = (dx ? 0.5f : 1.0f) * (dy ? 0.5f : 1.0f);
+                        blurred_variance += w * variance[(size_t)ny*width + nx];
+                        variance_weight += w;
+                    }
+                }
+                float inverse_luminance_scale = 1.0f / (sigma_luminance * std::sqrt(blurred_variance / variance_weight) + 1e-6f);
+                float inverse_depth_scale = 1.0f / (sigma_depth * depth_gradient[p] * step + 1e-6f);
+
+                const GuidePixel& center = guide[p];
+                float center_luminance = lighting[p].luminance;
+                float sum[3] = {0,0,0};
+                float weight_sum = 0.0f, variance_sum = 0.0f;
+                for(int j=-2; j<=2; j++){
+                    int ny = y + j*step;
+                    if(ny < 0 || ny >= height) continue;
+                    for(int i=-2; i<=2; i++){
+                        int nx = x + i*step;
+                        if(nx < 0 || nx >= width) continue;
+                        size_t q = (size_t)ny*width + nx;
+                        float weight = kernel[std::abs(i)] * kernel[std::abs(j)];
+                        if(q != p){
+                            const GuidePixel& other = guide[q];
+                            // Escaped rays only blend with other escaped rays
+                            if((center.depth > 0.0f) != (other.depth > 0.0f)) continue;
+                            float exponent = std::fabs(center_luminance - lighting[q].luminance) * inverse_luminance_scale;
+                            if(center.depth > 0.0f){
+                                float facing = std::max(0.0f, center.normal[0]*other.normal[0] + center.normal[1]*other.normal[1] + center.normal[2]*other.normal[2]);
+                                for(int s=0; s<sigma_normal_squarings; s++) facing *= facing;
+                                weight *= facing;
+                                exponent += std::fabs(center.depth - other.depth) * inverse_depth_scale * inverse_distance[j+2][i+2];
+                            }
+                            if(weight <= 1e-12f || exponent > 30.0f) continue;
+                            weight *= std::exp(-exponent);
+                        }
+                        for(int c=0; c<3; c++) sum[c] += lighting[q].color[c] * weight;
+                        weight_sum += weight;
+                        variance_sum += weight*weight * variance[q];
+                    }
+                }
+                LightingPixel& out = next_lighting[p];
+                for(int c=0; c<3; c++) out.color[c] = sum[c] / weight_sum;
+                out.luminance = 0.2126f*out.color[0] + 0.7152f*out.color[1] + 0.0722f*out.color[2];
+                next_variance[p] = variance_sum / (weight_sum*weight_sum);
+            }
+        });
+        lighting.swap(next_lighting);
+        variance.swap(next_variance);
+    }
+
+    for(size_t i=0; i<count; i++){
+        const float* color = lighting[i].color;
+        beauty[i] = Color{(Real)color[0], (Real)color[1], (Real)color[2]} * divided_albedo[i];
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <vector>
+#include "image.h"
+
+// What the camera rays of each pixel saw first, averaged over the samples of the pixel - the denoiser uses
+// these to tell edges apart from noise, and they can be saved as images of their own
+struct AOVBuffers{
+    Image albedo; // how much light the surface reflects, white where the rays escaped
+    Image normals; // world space, averaged without normalizing so they are shorter at edges and 0 where the rays escaped
+    Image depth; // distance along the camera ray in every channel, averaged over the samples that hit something
+    std::vector<float> variance; // of the pixel's mean luminance, from the spread of its samples
+
+    AOVBuffers(int width, int height);
+    // <prefix>.albedo.pfm, <prefix>.normal.pfm and <prefix>.depth.pfm
+    void write_to_pfm(const std::string& prefix)const;
+};
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010) with the variance guided luminance weight of SVGF
+// (Schied et al. 2017). The lighting is separated from the albedo first so texture detail is never blurred, then
+// each pass spreads a 5x5 kernel twice as far as the last, stopping at changes of normal, depth, or luminance
+// larger than the noise in that spot accounts for. Runs on every core.
+void denoise(Image& beauty, const AOVBuffers& aovs, int iterations);
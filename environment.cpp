@@ -0,0 +1,227 @@
+#include "environment.h"
+#include "sampler.h"
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <map>
+
+//===================================================================
+// Loading
+//===================================================================
+// Radiance .hdr - 8 bit RGB sharing one exponent, with the scanlines usually run length encoded per channel
+static bool read_rgbe(const std::string& filename, int& width, int& height, std::vector<Color>& texels){
+    FILE* fp = fopen(filename.c_str(),"rb");
+    if(!fp) return false;
+    char line[256];
+    bool is_rgbe = false;
+    // Header lines until a blank one, then the size line
+    while(fgets(line,sizeof(line),fp)){
+        if(line[0] == '\n') break;
+        if(strncmp(line,"#?",2) == 0) is_rgbe = true;
+        if(strncmp(line,"FORMAT=",7) == 0 && strncmp(line+7,"32-bit_rle_rgbe",15) != 0) is_rgbe = false;
+    }
+    // Only the usual orientation, top row first and left to right
+    if(!is_rgbe || fscanf(fp,"-Y %d +X %d",&height,&width) != 2 || width <= 0 || height <= 0){
+        fclose(fp);
+        return false;
+    }
+    fgetc(fp); // the newline ending the size line
+
+    texels.assign((size_t)width*height, Black);
+    std::vector<unsigned char> scanline(width*4);
+    for(int y=0; y<height; y++){
+        unsigned char start[4];
+        if(fread(start,1,4,fp) != 4){ fclose(fp); return false; }
+        if(width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && ((start[2]<<8) | start[3]) == width){
+            // New style run length encoding, each of the 4 channels coded on its own
+            for(int channel=0; channel<4; channel++){
+                for(int x=0; x<width;){
+                    int count = fgetc(fp);
+                    if(count == EOF){ fclose(fp); return false; }
+                    if(count > 128){
+                        count -= 128;
+                        int value = fgetc(fp);
+                        if(value == EOF || x+count > width){ fclose(fp); return false; }
+                        for(; count; count--) scanline[(x++)*4 + channel] = value;
+                    } else {
+                        if(count == 0 || x+count > width){ fclose(fp); return false; }
+                        for(; count; count--){
+                            int value = fgetc(fp);
+                            if(value == EOF){ fclose(fp); return false; }
+                            scanline[(x++)*4 + channel] = value;
+                        }
+                    }
+                }
+            }
+        } else {
+            // Flat pixels
+            memcpy(scanline.data(),start,4);
+            if(fread(scanline.data()+4,1,(width-1)*4,fp) != (size_t)(width-1)*4){ fclose(fp); return false; }
+        }
+        for(int x=0; x<width; x++){
+            const unsigned char* rgbe = &scanline[x*4];
+            if(rgbe[3] == 0) continue;
+            Real scale = (Real)std::ldexp(1.0, rgbe[3] - (128+8));
+            texels[(size_t)y*width + x] = Color{(Real)rgbe[0], (Real)rgbe[1], (Real)rgbe[2]} * scale;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+bool EnvironmentMap::load(const std::string& filename){
+    std::string extension = filename.substr(std::min(filename.size(), filename.find_last_of('.')));
+    if(extension == ".pfm"){
+        Image image(1,1);
+        if(!image.read_from_pfm(filename)){
+            printf("%s: unable to read environment map\n", filename.c_str());
+            return false;
+        }
+        width = image.width();
+        height = image.height();
+        texels.assign(image.begin(), image.end());
+    } else if(!read_rgbe(filename,width,height,texels)){
+        printf("%s: unable to read environment map (expected a .pfm or a Radiance .hdr)\n", filename.c_str());
+        return false;
+    }
+    build_distribution();
+    return true;
+}
+
+//===================================================================
+// Directions
+//===================================================================
+// u goes once around the horizon, v from straight up (0) to straight down (1)
+static inline void direction_to_uv(const Vector3& direction, double& u, double& v){
+    double length = std::sqrt((double)direction.length_squared());
+    double y = std::clamp((double)direction.y/length, -1.0, 1.0);
+    u = std::atan2(-(double)direction.z, (double)direction.x) / (2.0*PI) + 0.5;
+    v = std::acos(y) / PI;
+}
+
+static inline double luminance(const Color& c){
+    return 0.2126*c.x + 0.7152*c.y + 0.0722*c.z;
+}
+
+void EnvironmentMap::texel_of(const Vector3& direction, int& x, int& y)const{
+    double u,v;
+    direction_to_uv(direction,u,v);
+    x = std::clamp((int)(u*width), 0, width-1);
+    y = std::clamp((int)(v*height), 0, height-1);
+}
+
+// Texels are looked up without filtering so what is seen matches the piecewise constant distribution exactly
+Color EnvironmentMap::radiance(const Vector3& direction)const{
+    int x,y;
+    texel_of(direction,x,y);
+    return texels[(size_t)y*width + x];
+}
+
+//===================================================================
+// Sampling
+//===================================================================
+// Every texel is weighed by its brightness times the solid angle it covers (less towards the poles).
+// The rows are independent of each other, so their CDFs get built on every core which matters for the 8k
+// and larger maps where this is the slowest part of starting a render.
+void EnvironmentMap::build_distribution(){
+    column_cdf.assign((size_t)(width+1)*height, 0.0f);
+    row_weight.assign(height, 0.0f);
+    auto build_rows = [this](int first, int last){
+        for(int y=first; y<last; y++){
+            double sin_theta = std::sin(PI*(y+0.5)/height);
+            float* cdf = &column_cdf[(size_t)(width+1)*y];
+            double sum = 0.0;
+            for(int x=0; x<width; x++){
+                sum += std::max(0.0, luminance(texels[(size_t)y*width + x])) * sin_theta;
+                cdf[x+1] = (float)sum;
+            }
+            row_weight[y] = (float)sum;
+            if(sum > 0.0) for(int x=1; x<=width; x++) cdf[x] = (float)(cdf[x]/sum);
+            cdf[width] = 1.0f;
+        }
+    };
+    {
+        int max_threads = std::max(1u,std::thread::hardware_concurrency());
+        int chunk = std::max(16, (height + max_threads-1) / max_threads);
+        std::vector<std::jthread> threads;
+        for(int first=0; first<height; first+=chunk){
+            threads.emplace_back( std::jthread(build_rows, first, std::min(first+chunk, height)) );
+        }
+    }
+
+    row_cdf.assign(height+1, 0.0f);
+    double total = 0.0;
+    for(int y=0; y<height; y++){
+        total += row_weight[y];
+        row_cdf[y+1] = (float)total;
+    }
+    if(total > 0.0) for(int y=1; y<=height; y++) row_cdf[y] = (float)(row_cdf[y]/total);
+    row_cdf[height] = 1.0f;
+    average_weight = total / ((double)width*height);
+}
+
+// Index of the bin of cdf (count+1 entries) the random number lands in, skipping over empty bins.
+// random is turned into where it landed within the bin, so it can go on to place the sample inside of it.
+static inline int find_bin(const float* cdf, int count, Real& random){
+    const float* found = std::upper_bound(cdf, cdf+count+1, (float)random);
+    int bin = std::clamp((int)(found - cdf) - 1, 0, count-1);
+    double width = cdf[bin+1] - cdf[bin];
+    random = width > 0.0 ? std::clamp((Real)((random - cdf[bin]) / width), (Real)0, (Real)0.999999) : (Real)0.5;
+    return bin;
+}
+
+double EnvironmentMap::texel_pdf(int x, int y)const{
+    if(average_weight <= 0.0) return 0.0;
+    double sin_theta = std::sin(PI*(y+0.5)/height);
+    return std::max(0.0, luminance(texels[(size_t)y*width + x])) * sin_theta / average_weight;
+}
+
+bool EnvironmentMap::sample(Vector3& direction, Color& radiance, double& pdf)const{
+    if(average_weight <= 0.0) return false;
+    Real column_pick, row_pick;
+    sample_2d(column_pick,row_pick);
+    int y = find_bin(row_cdf.data(), height, row_pick);
+    int x = find_bin(&column_cdf[(size_t)(width+1)*y], width, column_pick);
+    double density = texel_pdf(x,y); // over the unit square of u,v
+    if(density <= 0.0) return false;
+
+    // Anywhere inside of the texel
+    double u = (x + column_pick) / width;
+    double v = (y + row_pick) / height;
+    double theta = v*PI, phi = (u-0.5)*2.0*PI;
+    double sin_theta = std::sin(theta);
+    if(sin_theta <= 0.0) return false;
+    direction = Vector3{(Real)(sin_theta*std::cos(phi)), (Real)std::cos(theta), (Real)(-sin_theta*std::sin(phi))};
+    radiance = texels[(size_t)y*width + x];
+    // du dv covers 2 pi^2 sin(theta) of solid angle
+    pdf = density / (2.0*PI*PI*sin_theta);
+    return true;
+}
+
+double EnvironmentMap::pdf(const Vector3& direction)const{
+    int x,y;
+    texel_of(direction,x,y);
+    double y_squared = (double)direction.y*direction.y / direction.length_squared();
+    double sin_theta = std::sqrt(std::max(0.0, 1.0 - y_squared));
+    if(sin_theta <= 0.0) return 0.0;
+    return texel_pdf(x,y) / (2.0*PI*PI*sin_theta);
+}
+
+//===================================================================
+// Cache
+//===================================================================
+std::shared_ptr<const EnvironmentMap> load_environment(const std::string& filename){
+    static std::mutex cache_mutex;
+    static std::map<std::string, std::shared_ptr<const EnvironmentMap>> cache; // failures are remembered as nullptr
+    std::lock_guard lock(cache_mutex);
+    auto cached = cache.find(filename);
+    if(cached != cache.end()) return cached->second;
+    auto map = std::make_shared<EnvironmentMap>();
+    std::shared_ptr<const EnvironmentMap> loaded;
+    if(map->load(filename)) loaded = map;
+    cache[filename] = loaded;
+    return loaded;
+}
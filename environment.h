@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include "image.h"
+
+// An HDR image wrapped around the whole scene as the light that arrives from infinitely far away, in
+// latitude/longitude layout with the top row straight up (+y). Directions are sampled in proportion to how
+// bright the map is that way, so a small sun gets nearly every sample instead of a lucky few.
+class EnvironmentMap{
+    int width = 0, height = 0;
+    std::vector<Color> texels; // top row first
+    // Piecewise constant distribution over the texels: a CDF over the rows, then one over each row
+    std::vector<float> row_cdf; // height+1 entries
+    std::vector<float> column_cdf; // (width+1) per row
+    std::vector<float> row_weight; // what each row adds up to
+    double average_weight = 0; // over every texel, the density over the map is weight / average_weight
+
+    void build_distribution();
+    double texel_pdf(int x, int y)const;
+    void texel_of(const Vector3& direction, int& x, int& y)const;
+
+    public:
+    // PFM or Radiance RGBE (.hdr), false if it cannot be read
+    bool load(const std::string& filename);
+    // Light arriving from the direction (does not need to be normalized)
+    Color radiance(const Vector3& direction)const;
+    // Picks a direction by brightness, false if the map is black all over
+    bool sample(Vector3& direction, Color& radiance, double& pdf)const;
+    // Density per solid angle sample() gives the direction (does not need to be normalized either)
+    double pdf(const Vector3& direction)const;
+};
+
+// Loads each map once per process, the distribution being the slow part - nullptr if it cannot be loaded
+std::shared_ptr<const EnvironmentMap> load_environment(const std::string& filename);
@@ -0,0 +1,55 @@
+#include "framebuffer.h"
+#include <algorithm>
+#include <cstring>
+#include "utils.h"
+
+bool FrameBuffer::resize(int width, int height){
+    if(pixels && width == _width && height == _height) return true;
+    tiles_across = (width + tile_size-1) / tile_size;
+    tiles_down = (height + tile_size-1) / tile_size;
+    stride = (size_t)tiles_across * tile_size;
+    size_t bytes = stride * tiles_down * tile_size * sizeof(FramePixel); // a multiple of 64 already
+    pixels.reset(static_cast<FramePixel*>(std::aligned_alloc(64, bytes)));
+    if(!pixels){
+        print("Unable to allocate a {}x{} frame\n",width,height);
+        _width = _height = tiles_across = tiles_down = 0;
+        stride = 0;
+        return false;
+    }
+    // Black until a tile is flushed over it, which is what the ongoing export shows of the unrendered part
+    memset(pixels.get(), 0, bytes);
+    _width = width;
+    _height = height;
+    return true;
+}
+
+void FrameBuffer::start_tile(int index, Tile& tile)const{
+    tile.x0 = (index % tiles_across) * tile_size;
+    tile.y0 = (index / tiles_across) * tile_size;
+    tile.width = std::min(tile_size, _width - tile.x0);
+    tile.height = std::min(tile_size, _height - tile.y0);
+}
+
+void FrameBuffer::flush(const Tile& tile, AOVBuffers* aovs){
+    for(int y=0; y<tile.height; y++)
+        std::copy_n(tile.pixels + y*tile_size, tile.width, &pixels[(tile.y0 + y)*stride + tile.x0]);
+    if(!aovs) return;
+    for(int y=0; y<tile.height; y++){
+        const FramePixelAOV* row = tile.aovs + y*tile_size;
+        size_t p = (size_t)(tile.y0 + y)*_width + tile.x0;
+        for(int x=0; x<tile.width; x++, p++){
+            aovs->albedo[p] = row[x].albedo;
+            aovs->normals[p] = row[x].normal;
+            aovs->depth[p] = Color{row[x].depth, row[x].depth, row[x].depth};
+            aovs->variance[p] = row[x].variance;
+        }
+    }
+}
+
+void FrameBuffer::to_image(Image& image)const{
+    for(int y=0; y<_height; y++){
+        const FramePixel* row = &pixels[y*stride];
+        for(int x=0; x<_width; x++)
+            image.get_px(x,y) = Color{row[x].color[0], row[x].color[1], row[x].color[2]};
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <memory>
+#include <cstdlib>
+#include "image.h"
+#include "denoise.h"
+
+// What a pixel of the frame came to, packed into 16 bytes
+struct alignas(16) FramePixel{
+    float color[3]; // the average of its samples
+    float samples; // how many went into it
+};
+
+// What the denoiser needs of a pixel, averaged over its samples (see AOVBuffers)
+struct FramePixelAOV{
+    Color albedo;
+    Color normal;
+    Real depth;
+    float variance;
+};
+
+// The frame while it is being rendered. Threads take whole tiles and keep the pixels of theirs in a Tile of their
+// own until every pixel of it is done, then copy it in a row at a time. Rows are padded out to a whole number of
+// tiles and the buffer is 64 byte aligned, so each row of a tile is whole cache lines no other tile shares and
+// no two threads ever write to the same line. Half the size of a double precision Image, which it converts to.
+// The AOVs of a tile are kept in it the same way and go into the AOVBuffers along with the colors.
+class FrameBuffer{
+    public:
+    static constexpr int tile_size = 16; // a row of a tile is 256 bytes, 4 cache lines
+
+    struct Tile{
+        int x0, y0, width, height; // in pixels, cut short at the right and bottom edges of the frame
+        FramePixel pixels[tile_size*tile_size];
+        FramePixelAOV aovs[tile_size*tile_size];
+        FramePixel& at(int x, int y){ return pixels[(y-y0)*tile_size + (x-x0)]; }
+        FramePixelAOV& aov_at(int x, int y){ return aovs[(y-y0)*tile_size + (x-x0)]; }
+    };
+
+    private:
+    struct AlignedFree{ void operator()(FramePixel* pixels)const{ std::free(pixels); } };
+    std::unique_ptr<FramePixel[], AlignedFree> pixels;
+    int _width = 0, _height = 0;
+    int tiles_across = 0, tiles_down = 0;
+    size_t stride = 0; // pixels from one row to the next
+
+    public:
+    // Reallocates only when the size changes, starting out black, and leaves the pixels as they were otherwise
+    // False (with an empty frame) when the memory could not be had
+    bool resize(int width, int height);
+    int width()const{ return _width; }
+    int height()const{ return _height; }
+    int tile_count()const{ return tiles_across*tiles_down; }
+
+    // Where tile number index (row by row) is, ready to be filled in
+    void start_tile(int index, Tile& tile)const;
+    // Copies the tile into the frame, and its AOVs into aovs unless that is nullptr
+    void flush(const Tile& tile, AOVBuffers* aovs = nullptr);
+    const FramePixel& pixel(int x, int y)const{ return pixels[y*stride + x]; }
+    // image has to be the same size
+    void to_image(Image& image)const;
+};
@@ -1,8 +1,11 @@
 #include "image.h"
-#define PNG_SETJMP_NOT_SUPPORTED
-#include <png.h>
 #include <zlib.h>
 #include <cstdlib>
+#include <cstdint>
+#include <bit>
+#include <thread>
+#include <algorithm>
+#include <cstring>
 
 const Color White={1.0,1.0,1.0};
 const Color Red=  {1.0,0.0,0.0};
@@ -16,81 +19,379 @@ const Color DarkBlue= {0.0,0.0,0.5};
 const Color BlueSky = {0.4,0.6,0.9};
 
 Image::Image(int width, int height): std::vector<Color>(height*width,{0.0,0.0,0.0}), _height(height), _width(width){}
-int Image::width(){return _width;}
-int Image::height(){return _height;}
+int Image::width()const{return _width;}
+int Image::height()const{return _height;}
 
 Color& Image::get_px(const int& x,const int& y){
     return this->operator[]((y*_width) + x);
 }
 
-png_byte png_clamp(int val){
-    if(val<0) return 0;
-    if(val>255) return 255;
-    return val;
+// Bytes of linear_to_gamma(value)*255 from a table instead of a square root per channel. Byte b starts at
+// (b/255)^2, the table has the byte at the start of 4096 even steps over [0,1) and at most a few of the
+// starts past that need checking.
+class GammaTable{
+    float byte_start[257];
+    uint8_t step_byte[4096];
+
+    public:
+    GammaTable(){
+        for(int b=0; b<256; b++) byte_start[b] = (float)((b/255.0)*(b/255.0));
+        byte_start[256] = std::numeric_limits<float>::infinity();
+        int b = 0;
+        for(int step=0; step<4096; step++){
+            while(byte_start[b+1] <= step/4096.0f) b++;
+            step_byte[step] = b;
+        }
+    }
+    uint8_t operator()(float value)const{
+        if(!(value > 0.0f)) return 0; // NaN too
+        if(value >= 1.0f) return 255;
+        int b = step_byte[(int)(value*4096.0f)];
+        while(value >= byte_start[b+1]) b++;
+        return b;
+    }
+};
+static const GammaTable gamma_table;
+
+// PNG's Paeth predictor - whichever of left, up and up left is closest to left + up - up left
+static inline int paeth(int left, int up, int up_left){
+    int to_left = std::abs(up - up_left), to_up = std::abs(left - up_left), to_up_left = std::abs(left + up - 2*up_left);
+    return (to_left <= to_up && to_left <= to_up_left) ? left : to_up <= to_up_left ? up : up_left;
 }
 
-void Image::write_to_png(std::string filename)const{
+static constexpr size_t pixel_bytes = 3;
+
+// Filters one row of RGB bytes with whichever PNG filter leaves the smallest sum of absolute (signed) bytes, the
+// same guess libpng makes. out gets the filter type and then the filtered row. Both rows need a black pixel
+// in front of them, so the first pixel has something to its left like the rest.
+static void filter_row(const uint8_t* row, const uint8_t* above, size_t bytes, uint8_t* out){
+    // Sums first and only the winner written out, written so the compiler can run the five side by side
+    // in vector registers - trying all of them costs little more than trying one that way
+    auto left_of = [](const uint8_t* bytes, size_t i)->int{ return bytes[i-pixel_bytes]; };
+    auto cost = [](int difference){ return std::abs((int)(int8_t)(uint8_t)difference); };
+    uint32_t sum_none = 0, sum_sub = 0, sum_up = 0, sum_average = 0, sum_paeth = 0;
+    for(size_t i=0; i<bytes; i++){
+        int x = row[i], left = left_of(row,i), up = above[i], up_left = left_of(above,i);
+        sum_none += cost(x);
+        sum_sub += cost(x - left);
+        sum_up += cost(x - up);
+        sum_average += cost(x - (left + up)/2);
+        sum_paeth += cost(x - paeth(left,up,up_left));
+    }
+    uint32_t sums[5] = {sum_none, sum_sub, sum_up, sum_average, sum_paeth};
+    int best = (int)(std::min_element(sums, sums+5) - sums);
+    out[0] = best;
+    for(size_t i=0; i<bytes; i++){
+        int x = row[i], left = left_of(row,i), up = above[i];
+        switch(best){
+            case 0: out[1+i] = x; break;
+            case 1: out[1+i] = x - left; break;
+            case 2: out[1+i] = x - up; break;
+            case 3: out[1+i] = x - (left + up)/2; break;
+            default: out[1+i] = x - paeth(left,up,left_of(above,i)); break;
+        }
+    }
+}
+
+// Runs every strip of rows on its own thread, returning once all of them are done
+template<typename StripFunction>
+static void for_each_strip(int height, int strip_rows, StripFunction strip_function){
+    std::vector<std::jthread> threads;
+    for(int first=0, strip=0; first<height; first+=strip_rows, strip++){
+        threads.emplace_back( std::jthread(strip_function, strip, first, std::min(first+strip_rows, height)) );
+    }
+}
+
+static void write_chunk(FILE* fp, const char* type, const uint8_t* data, size_t length, uLong crc){
+    uint8_t header[8] = {(uint8_t)(length>>24), (uint8_t)(length>>16), (uint8_t)(length>>8), (uint8_t)length,
+        (uint8_t)type[0], (uint8_t)type[1], (uint8_t)type[2], (uint8_t)type[3]};
+    uint8_t footer[4] = {(uint8_t)(crc>>24), (uint8_t)(crc>>16), (uint8_t)(crc>>8), (uint8_t)crc};
+    fwrite(header,1,8,fp);
+    fwrite(data,1,length,fp);
+    fwrite(footer,1,4,fp);
+}
+static void write_chunk(FILE* fp, const char* type, const uint8_t* data, size_t length){
+    uLong crc = crc32(0, (const Bytef*)type, 4);
+    if(length) crc = crc32(crc, data, length); // a null data restarts the crc instead
+    write_chunk(fp,type,data,length,crc);
+}
+
+// Every strip of rows is tonemapped, filtered and deflated on its own core (the way pigz does it) and the
+// pieces written one after another as IDAT chunks of a single zlib stream. Each strip but the last ends on a
+// sync flush so the next one starts on a byte boundary, and starts off with the 32K of filtered rows before it
+// as its dictionary so splitting it up costs next to nothing in size. The strips work those rows out again
+// themselves instead of waiting for the strip before.
+void Image::write_to_png(std::string filename, int compression_level)const{
+    compression_level = std::clamp(compression_level, 0, 9);
+    const size_t row_bytes = (size_t)_width*3;
+    const size_t filtered_row_bytes = row_bytes + 1; // the filter type goes first
+    constexpr size_t window = 32768;
+    const int context_rows = (int)((window + filtered_row_bytes-1) / filtered_row_bytes);
+
+    struct Strip{
+        std::vector<uint8_t> deflated;
+        uLong adler, crc;
+        size_t length; // of the filtered rows going in
+        bool ok = false;
+    };
+    // One strip per core
+    int max_threads = std::max(1u,std::thread::hardware_concurrency());
+    int strip_rows = std::max(16, (_height + max_threads-1) / max_threads);
+    std::vector<Strip> strips((_height + strip_rows-1) / strip_rows);
+    for_each_strip(_height, strip_rows, [&](int strip, int first, int last){
+        Strip& out = strips[strip];
+        int context_first = std::max(0, first - context_rows);
+        int tonemap_first = std::max(0, context_first - 1);
+        // A black pixel in front of every row and a black row for above the image
+        const size_t stride = pixel_bytes + row_bytes;
+        std::vector<uint8_t> tonemapped((last - tonemap_first + 1) * stride, 0);
+        const uint8_t* black_row = tonemapped.data() + pixel_bytes;
+        for(int row=tonemap_first; row<last; row++){
+            uint8_t* bytes = tonemapped.data() + (row - tonemap_first + 1)*stride + pixel_bytes;
+            const Color* px = data() + (size_t)row*_width;
+            for(int x=0; x<_width; x++){
+                bytes[x*3 + 0] = gamma_table(px[x].red);
+                bytes[x*3 + 1] = gamma_table(px[x].green);
+                bytes[x*3 + 2] = gamma_table(px[x].blue);
+            }
+        }
+        std::vector<uint8_t> filtered((last - context_first) * filtered_row_bytes);
+        for(int row=context_first; row<last; row++){
+            const uint8_t* bytes = tonemapped.data() + (row - tonemap_first + 1)*stride + pixel_bytes;
+            filter_row(bytes, row ? bytes - stride : black_row, row_bytes, filtered.data() + (row - context_first)*filtered_row_bytes);
+        }
+
+        const uint8_t* input = filtered.data() + (first - context_first)*filtered_row_bytes;
+        out.length = (last - first) * filtered_row_bytes;
+        out.adler = adler32(adler32(0,nullptr,0), input, out.length);
+
+        z_stream stream{};
+        if(deflateInit2(&stream, compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return;
+        size_t dictionary = std::min(window, (size_t)(input - filtered.data()));
+        if(dictionary) deflateSetDictionary(&stream, input - dictionary, dictionary);
+        int flush = last == _height ? Z_FINISH : Z_SYNC_FLUSH;
+        out.deflated.resize(deflateBound(&stream, out.length) + 16);
+        stream.next_in = const_cast<uint8_t*>(input);
+        stream.avail_in = out.length;
+        int status;
+        do{
+            if(stream.avail_out == 0 && stream.total_out){
+                out.deflated.resize(out.deflated.size()*2);
+            }
+            stream.next_out = out.deflated.data() + stream.total_out;
+            stream.avail_out = out.deflated.size() - stream.total_out;
+            status = deflate(&stream, flush);
+        } while(status == Z_OK && (flush == Z_FINISH || stream.avail_out == 0));
+        out.deflated.resize(stream.total_out);
+        deflateEnd(&stream);
+        if(status != (flush == Z_FINISH ? Z_STREAM_END : Z_OK)) return;
+        out.crc = crc32(crc32(0, (const Bytef*)"IDAT", 4), out.deflated.data(), out.deflated.size());
+        out.ok = true;
+    });
+    for(const Strip& strip : strips){
+        if(!strip.ok){
+            print("Could not compress {}\n",filename);
+            return;
+        }
+    }
+
     FILE* fp = fopen(filename.c_str(),"wb");
     if(!fp) return;
+    static const uint8_t signature[8] = {0x89,'P','N','G','\r','\n',0x1a,'\n'};
+    fwrite(signature,1,8,fp);
+    uint8_t header[13] = {(uint8_t)(_width>>24), (uint8_t)(_width>>16), (uint8_t)(_width>>8), (uint8_t)_width,
+        (uint8_t)(_height>>24), (uint8_t)(_height>>16), (uint8_t)(_height>>8), (uint8_t)_height,
+        8, 2, 0, 0, 0}; // 8 bit RGB, deflate, adaptive filtering, not interlaced
+    write_chunk(fp, "IHDR", header, sizeof(header));
 
-    //Initializa Libpng
-    png_structp png_ptr = png_create_write_struct(
-        PNG_LIBPNG_VER_STRING,
-        nullptr, //(png_voidp)user_error_ptr,
-        nullptr, //user_error_fn,
-        nullptr //user_warning_fn
-        );
-    if (!png_ptr)
-        return;
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr){
-        png_destroy_write_struct(&png_ptr,
-            (png_infopp)nullptr);
-        fclose(fp);
-        return;
+    // zlib header with a 32K window, its level bits only say roughly how hard the compressor tried
+    uint8_t zlib_header[2] = {0x78, (uint8_t)(compression_level < 2 ? 0x01 : compression_level < 6 ? 0x5e : compression_level == 6 ? 0x9c : 0xda)};
+    write_chunk(fp, "IDAT", zlib_header, 2);
+    uLong adler = adler32(0,nullptr,0);
+    for(const Strip& strip : strips){
+        write_chunk(fp, "IDAT", strip.deflated.data(), strip.deflated.size(), strip.crc);
+        adler = adler32_combine(adler, strip.adler, strip.length);
     }
+    uint8_t adler_bytes[4] = {(uint8_t)(adler>>24), (uint8_t)(adler>>16), (uint8_t)(adler>>8), (uint8_t)adler};
+    write_chunk(fp, "IDAT", adler_bytes, 4);
+    write_chunk(fp, "IEND", nullptr, 0);
+    fclose(fp);
+}
 
-    //Lets setup for writing
-    png_init_io(png_ptr, fp);
-    png_set_IHDR(png_ptr, info_ptr,
-        _width,
-        _height,
-        8, //bitdepth
-        PNG_COLOR_TYPE_RGB,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT);
-    /* set the zlib compression level */
-    // png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
-    png_set_compression_level(png_ptr, 2); // to make it save images faster, tell it to do less compression
-    /* set other zlib parameters */
-    png_set_compression_mem_level(png_ptr, 8);
-    png_set_compression_strategy(png_ptr, Z_DEFAULT_STRATEGY);
-    png_set_compression_window_bits(png_ptr, 15);
-    png_set_compression_method(png_ptr, 8);
-    png_set_compression_buffer_size(png_ptr, 8192);
-    // png_set_filter(png_ptr,0,PNG_FILTER_SUB); // restricting the filtering methods available doesn't improve processing speed much
-
-    //Start writing
-    png_write_info(png_ptr, info_ptr);
-    std::vector<png_byte> rowbuf(_width*3); // *3 for RGB
+void Image::write_to_pfm(std::string filename)const{
+    FILE* fp = fopen(filename.c_str(),"wb");
+    if(!fp) return;
+    // A negative scale marks the data as little endian
+    fprintf(fp,"PF\n%d %d\n-1.0\n",_width,_height);
+    // PFM rows are stored bottom to top
+    std::vector<float> rowbuf(_width*3);
+    for(int row=_height-1; row>=0; row--){
+        for(int x=0; x<_width; x++){
+            const Color& px = operator[](row*_width + x);
+            rowbuf[x*3 + 0] = px.red;
+            rowbuf[x*3 + 1] = px.green;
+            rowbuf[x*3 + 2] = px.blue;
+        }
+        fwrite(rowbuf.data(),sizeof(float),rowbuf.size(),fp);
+    }
+    fclose(fp);
+}
+
+void Image::to_rgb24(std::vector<uint8_t>& bytes)const{
+    bytes.resize(size()*3);
+    for(size_t i=0; i<size(); i++){
+        const Color& px = operator[](i);
+        bytes[i*3 + 0] = gamma_table(px.red);
+        bytes[i*3 + 1] = gamma_table(px.green);
+        bytes[i*3 + 2] = gamma_table(px.blue);
+    }
+}
+
+void Image::to_rgb_float(std::vector<float>& floats)const{
+    floats.resize(size()*3);
+    for(size_t i=0; i<size(); i++){
+        const Color& px = operator[](i);
+        floats[i*3 + 0] = px.red;
+        floats[i*3 + 1] = px.green;
+        floats[i*3 + 2] = px.blue;
+    }
+}
+
+void Image::write_to_raw(std::string filename)const{
+    FILE* fp = fopen(filename.c_str(),"wb");
+    if(!fp) return;
+    std::vector<float> floats;
+    to_rgb_float(floats);
+    fwrite(floats.data(),sizeof(float),floats.size(),fp);
+    fclose(fp);
+}
+
+void Image::write_to_exr(std::string filename)const{
+    FILE* fp = fopen(filename.c_str(),"wb");
+    if(!fp) return;
+    // Everything in an EXR is little endian
+    std::vector<uint8_t> header;
+    auto put_bytes = [&](const void* data, size_t length){
+        header.insert(header.end(), (const uint8_t*)data, (const uint8_t*)data + length);
+    };
+    auto put_int = [&](uint32_t value){
+        for(int shift=0; shift<32; shift+=8) header.push_back((uint8_t)(value >> shift));
+    };
+    auto put_float = [&](float value){ put_int(std::bit_cast<uint32_t>(value)); };
+    auto put_string = [&](const char* text){ put_bytes(text, strlen(text)+1); };
+    auto attribute = [&](const char* name, const char* type, uint32_t size){
+        put_string(name);
+        put_string(type);
+        put_int(size);
+    };
+
+    put_int(20000630); // magic
+    put_int(2); // version 2, single part scanlines
+    // Channels have to be in alphabetical order, each a name, FLOAT, not linear, reserved and x/y sampling of 1
+    static const char* channels[3] = {"B","G","R"};
+    attribute("channels", "chlist", 3*(2 + 16) + 1);
+    for(const char* channel : channels){
+        put_string(channel);
+        put_int(2);
+        put_int(0);
+        put_int(1);
+        put_int(1);
+    }
+    header.push_back(0);
+    attribute("compression", "compression", 1);
+    header.push_back(0); // none
+    for(const char* window : {"dataWindow","displayWindow"}){
+        attribute(window, "box2i", 16);
+        put_int(0);
+        put_int(0);
+        put_int(_width-1);
+        put_int(_height-1);
+    }
+    attribute("lineOrder", "lineOrder", 1);
+    header.push_back(0); // increasing y, top row first
+    attribute("pixelAspectRatio", "float", 4);
+    put_float(1.0f);
+    attribute("screenWindowCenter", "v2f", 8);
+    put_float(0.0f);
+    put_float(0.0f);
+    attribute("screenWindowWidth", "float", 4);
+    put_float(1.0f);
+    header.push_back(0);
+
+    // Where each row starts, then the rows - the row number, its size and every channel of the row in turn
+    const uint32_t row_size = (uint32_t)_width * 3 * sizeof(float);
+    uint64_t offset = header.size() + (uint64_t)_height*8;
     for(int row=0; row<_height; row++){
-        //copy into the temp buf
+        for(int shift=0; shift<64; shift+=8) header.push_back((uint8_t)(offset >> shift));
+        offset += 8 + row_size;
+    }
+    fwrite(header.data(),1,header.size(),fp);
+
+    std::vector<float> rowbuf(_width*3);
+    for(int row=0; row<_height; row++){
+        uint32_t block[2] = {(uint32_t)row, row_size};
+        fwrite(block,sizeof(uint32_t),2,fp);
         for(int x=0; x<_width; x++){
-            Color px = operator[](row*_width + x);
-            rowbuf[x*3 + 0] = png_clamp( linear_to_gamma(px.red) * 255 );
-            rowbuf[x*3 + 1] = png_clamp( linear_to_gamma(px.green) * 255 );
-            rowbuf[x*3 + 2] = png_clamp( linear_to_gamma(px.blue) * 255 );
+            const Color& px = operator[](row*_width + x);
+            rowbuf[x] = px.blue;
+            rowbuf[_width + x] = px.green;
+            rowbuf[2*_width + x] = px.red;
         }
-        png_write_row(png_ptr,rowbuf.data());
+        fwrite(rowbuf.data(),sizeof(float),rowbuf.size(),fp);
     }
+    fclose(fp);
+}
 
-    //finalize writing
-    png_write_end(png_ptr, info_ptr);
+bool Image::read_from_pfm(std::string filename){
+    FILE* fp = fopen(filename.c_str(),"rb");
+    if(!fp) return false;
+    char magic[3] = {0};
+    int w,h;
+    float scale;
+    if(fscanf(fp,"%2s %d %d %f",magic,&w,&h,&scale) != 4 || std::string(magic) != "PF" || w<=0 || h<=0){
+        fclose(fp);
+        return false;
+    }
+    fgetc(fp); // the single whitespace between the header and the data
 
-    //cleanup
-    png_destroy_write_struct(&png_ptr,&info_ptr);
+    _width = w;
+    _height = h;
+    assign(w*h,Color{0.0,0.0,0.0});
+    std::vector<float> rowbuf(_width*3);
+    for(int row=_height-1; row>=0; row--){
+        if(fread(rowbuf.data(),sizeof(float),rowbuf.size(),fp) != rowbuf.size()){
+            fclose(fp);
+            return false;
+        }
+        if(scale > 0){
+            // big endian data - swap it around for us
+            for(float& f : rowbuf){
+                f = std::bit_cast<float>(__builtin_bswap32(std::bit_cast<uint32_t>(f)));
+            }
+        }
+        for(int x=0; x<_width; x++){
+            operator[](row*_width + x) = Color{rowbuf[x*3 + 0], rowbuf[x*3 + 1], rowbuf[x*3 + 2]};
+        }
+    }
     fclose(fp);
+    return true;
+}
+
+void Image::compare(const Image& reference, double& rmse, double& max_error)const{
+    rmse = max_error = 0.0;
+    if(reference._width != _width || reference._height != _height || empty()){
+        rmse = max_error = Infinity;
+        return;
+    }
+    double sum_sq = 0.0;
+    for(size_t i=0; i<size(); i++){
+        for(int c=0; c<3; c++){
+            double diff = std::fabs((double)operator[](i)[c] - (double)reference[i][c]);
+            sum_sq += diff*diff;
+            if(diff > max_error) max_error = diff;
+        }
+    }
+    rmse = std::sqrt(sum_sq / (size()*3));
 }
 
 double Image::linear_to_gamma(double px){
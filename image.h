@@ -2,6 +2,7 @@
 #include "vec_utils.h"
 #include <vector>
 #include <string>
+#include <cstdint>
 
 using Color = Vector3;
 
@@ -11,12 +12,25 @@ class Image:public std::vector<Color>{
 
     public:
     Image(int width, int height);
-    int width();
-    int height();
+    int width()const;
+    int height()const;
 
     Color& get_px(const int& x,const int& y);
 
-    void write_to_png(std::string filename)const;
+    // 8 bit sRGB-ish PNG (see linear_to_gamma), compressed on every core. Level is zlib's, 0 (stored) to 9.
+    void write_to_png(std::string filename, int compression_level = 2)const;
+    // Portable float map - full precision float RGB with no tonemapping, used to compare renders
+    void write_to_pfm(std::string filename)const;
+    // Headerless float RGB, top row first, in the machine's byte order - what ffmpeg calls rgbf32le
+    void write_to_raw(std::string filename)const;
+    // Uncompressed OpenEXR with 32 bit float R, G and B channels, for compositing without requantizing
+    void write_to_exr(std::string filename)const;
+    // Every pixel top row first as 8 bit RGB tonemapped the same as write_to_png, or as the float RGB itself
+    void to_rgb24(std::vector<uint8_t>& bytes)const;
+    void to_rgb_float(std::vector<float>& floats)const;
+    bool read_from_pfm(std::string filename);
+    // Root mean square and largest per channel difference against a reference image of the same size
+    void compare(const Image& reference, double& rmse, double& max_error)const;
     static double linear_to_gamma(double px);
 };
 
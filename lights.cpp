@@ -0,0 +1,404 @@
+#include "lights.h"
+#include "sampler.h"
+#include <cmath>
+#include <algorithm>
+
+static inline double luminance(const Color& c){
+    return 0.2126*c.red + 0.7152*c.green + 0.0722*c.blue;
+}
+
+LightList::LightList(const ObjList& objects){
+    for(const auto& obj : objects){
+        Light light{obj, dynamic_cast<const Sphere*>(obj.get()), dynamic_cast<const Triangle*>(obj.get())};
+        if(!light.sphere && !light.triangle) continue;
+        const MaterialData& material = material_table[light.sphere ? light.sphere->material : light.triangle->material];
+        if(material.type != MaterialType::BRD || material.emissive.length_squared() <= 0.0) continue;
+        light.emitted = material.emissive;
+        if(light.triangle){
+            const Triangle& tri = *light.triangle;
+            light.area = 0.5 * (tri.p2-tri.p1).cross(tri.p3-tri.p1).length();
+            if(light.area <= 0.0) continue;
+        } else {
+            light.area = 4.0*PI * light.sphere->radius*light.sphere->radius;
+        }
+        index[obj.get()] = lights.size();
+        lights.push_back(light);
+        // Triangles give off light from both faces
+        double power = luminance(light.emitted) * light.area * PI * (light.triangle ? 2.0 : 1.0);
+        power_cdf.push_back((power_cdf.empty() ? 0.0 : power_cdf.back()) + power);
+    }
+    if(lights.size() < min_tree_lights) return;
+
+    std::vector<std::pair<LightBounds,uint32_t>> items;
+    items.reserve(lights.size());
+    for(size_t i=0; i<lights.size(); i++){
+        const Light& light = lights[i];
+        LightBounds bounds;
+        bounds.bounds = light.object->bbox();
+        bounds.power = power_cdf[i] - (i ? power_cdf[i-1] : 0.0);
+        if(light.triangle){
+            // Flat, so every normal is the same one and the light leaves to both sides of it
+            bounds.axis = light.triangle->normal.normalize();
+            bounds.cos_theta_o = 1.0;
+        }
+        items.push_back({bounds, (uint32_t)i});
+    }
+    trails.assign(lights.size(), 0);
+    tree.reserve(2*lights.size());
+    build_tree(items, 0, items.size(), 0, 0);
+}
+
+static inline double safe_sqrt(double x){
+    return std::sqrt(std::max(0.0, x));
+}
+// cos(max(0, a-b)) and sin(max(0, a-b)) from the sines and cosines of angles a and b
+static inline double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b){
+    return cos_a > cos_b ? 1.0 : cos_a*cos_b + sin_a*sin_b;
+}
+static inline double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b){
+    return cos_a > cos_b ? 0.0 : sin_a*cos_b - cos_a*sin_b;
+}
+
+// The power over the squared distance, times the cosines at both ends with each angle made as small as the
+// spread of the lights allows, as in pbrt-v4's light bounds
+double LightList::LightBounds::importance(const Point3& point, const Vector3& normal)const{
+    Point3 center = bounds.center();
+    double radius_squared = 0.25 * (bounds.max - bounds.min).length_squared();
+    Vector3 from_center = point - center;
+    double distance_squared = from_center.length_squared();
+    Vector3 to_point = distance_squared > 0.0 ? from_center / (Real)std::sqrt(distance_squared) : axis;
+
+    // How wide the bounds look from the point, all the way around once it is inside of them
+    double cos_b = -1.0, sin_b = 0.0;
+    if(distance_squared > radius_squared){
+        double sin_squared = radius_squared / distance_squared;
+        cos_b = safe_sqrt(1.0 - sin_squared);
+        sin_b = std::sqrt(sin_squared);
+    }
+
+    double cos_w = axis.dot(to_point);
+    if(two_sided) cos_w = std::fabs(cos_w);
+    double sin_w = safe_sqrt(1.0 - cos_w*cos_w);
+    double sin_o = safe_sqrt(1.0 - cos_theta_o*cos_theta_o);
+    double cos_x = cos_sub_clamped(sin_w,cos_w,sin_o,cos_theta_o);
+    double sin_x = sin_sub_clamped(sin_w,cos_w,sin_o,cos_theta_o);
+    double cos_emit = cos_sub_clamped(sin_x,cos_x,sin_b,cos_b);
+    if(cos_emit <= cos_theta_e) return 0.0;
+
+    // Surfaces only reflect what arrives in front of them
+    double cos_i = -to_point.dot(normal);
+    double sin_i = safe_sqrt(1.0 - cos_i*cos_i);
+    double cos_arrive = cos_sub_clamped(sin_i,cos_i,sin_b,cos_b);
+    if(cos_arrive <= 0.0) return 0.0;
+    return power * cos_emit * cos_arrive / std::max(distance_squared, radius_squared);
+}
+
+LightList::LightBounds LightList::LightBounds::merge(const LightBounds& a, const LightBounds& b){
+    LightBounds merged;
+    merged.bounds = a.bounds;
+    merged.bounds.absorb(b.bounds);
+    merged.power = a.power + b.power;
+    merged.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+    merged.two_sided = a.two_sided && b.two_sided;
+    // Light leaving both ways does not care which way its axis points, so it can point the way of the other
+    Vector3 b_axis = merged.two_sided && a.axis.dot(b.axis) < 0 ? b.axis.reverse() : b.axis;
+
+    double theta_a = std::acos(std::clamp(a.cos_theta_o, -1.0, 1.0));
+    double theta_b = std::acos(std::clamp(b.cos_theta_o, -1.0, 1.0));
+    double theta_d = std::acos(std::clamp((double)a.axis.dot(b_axis), -1.0, 1.0));
+    if(std::min(theta_d + theta_b, PI) <= theta_a){
+        merged.axis = a.axis;
+        merged.cos_theta_o = a.cos_theta_o;
+        return merged;
+    }
+    if(std::min(theta_d + theta_a, PI) <= theta_b){
+        merged.axis = b_axis;
+        merged.cos_theta_o = b.cos_theta_o;
+        return merged;
+    }
+    // The smallest cone around both, its axis turned from a's towards b's
+    double theta_o = 0.5 * (theta_a + theta_d + theta_b);
+    Vector3 turn_axis = a.axis.cross(b_axis);
+    if(theta_o >= PI || turn_axis.length_squared() <= 1e-12){
+        merged.axis = a.axis;
+        merged.cos_theta_o = -1.0;
+        return merged;
+    }
+    double theta_r = theta_o - theta_a;
+    turn_axis = turn_axis.normalize();
+    merged.axis = (a.axis*(Real)std::cos(theta_r) + turn_axis.cross(a.axis)*(Real)std::sin(theta_r)).normalize();
+    merged.cos_theta_o = std::cos(theta_o);
+    return merged;
+}
+
+double LightList::LightBounds::split_cost(double stretch)const{
+    // Solid angle the normal cone and the emission around it cover
+    double theta_o = std::acos(std::clamp(cos_theta_o, -1.0, 1.0));
+    double theta_e = std::acos(std::clamp(cos_theta_e, -1.0, 1.0));
+    double theta_w = std::min(theta_o + theta_e, PI);
+    double sin_o = safe_sqrt(1.0 - cos_theta_o*cos_theta_o);
+    double orientation = 2.0*PI*(1.0 - cos_theta_o) +
+        PI/2.0 * (2.0*theta_w*sin_o - std::cos(theta_o - 2.0*theta_w) - 2.0*theta_o*sin_o + cos_theta_o);
+    return power * orientation * stretch * bounds.half_surface_area();
+}
+
+// Binned top down build, each split is the one of 12 bins along each axis with the least power times
+// surface area times orientation spread on both sides (Conty Estevez and Kulla's SAOH)
+void LightList::build_tree(std::vector<std::pair<LightBounds,uint32_t>>& items, size_t first, size_t last, int depth, uint64_t trail){
+    size_t node = tree.size();
+    tree.push_back({items[first].first, items[first].second, true});
+    if(last - first == 1){
+        trails[items[first].second] = trail;
+        return;
+    }
+
+    LightBounds all = items[first].first;
+    BBox centroids{items[first].first.bounds.center(), items[first].first.bounds.center()};
+    for(size_t i=first+1; i<last; i++){
+        all = LightBounds::merge(all, items[i].first);
+        centroids.absorb(items[i].first.bounds.center());
+    }
+    Vector3 extent = all.bounds.max - all.bounds.min;
+    double longest = std::max({extent.x, extent.y, extent.z});
+
+    constexpr int bins = 12;
+    auto bin_of = [&](const LightBounds& bounds, int axis){
+        double offset = (bounds.bounds.center()[axis] - centroids.min[axis]) / (centroids.max[axis] - centroids.min[axis]);
+        return std::clamp((int)(offset*bins), 0, bins-1);
+    };
+    double best_cost = Infinity;
+    int best_axis = -1, best_split = -1;
+    // Past this depth the split is always down the middle of the list, so the trails stay within 64 bits
+    constexpr int max_binned_depth = 40;
+    for(int axis=0; axis<3 && depth<max_binned_depth; axis++){
+        if(centroids.max[axis] <= centroids.min[axis]) continue;
+        LightBounds bin_bounds[bins];
+        bool bin_used[bins] = {};
+        for(size_t i=first; i<last; i++){
+            int bin = bin_of(items[i].first, axis);
+            bin_bounds[bin] = bin_used[bin] ? LightBounds::merge(bin_bounds[bin], items[i].first) : items[i].first;
+            bin_used[bin] = true;
+        }
+        double stretch = extent[axis] > 0 ? longest / extent[axis] : 1.0;
+        for(int split=0; split<bins-1; split++){
+            LightBounds left, right;
+            bool has_left = false, has_right = false;
+            for(int bin=0; bin<bins; bin++){
+                if(!bin_used[bin]) continue;
+                LightBounds& side = bin <= split ? left : right;
+                bool& has_side = bin <= split ? has_left : has_right;
+                side = has_side ? LightBounds::merge(side, bin_bounds[bin]) : bin_bounds[bin];
+                has_side = true;
+            }
+            if(!has_left || !has_right) continue;
+            double cost = left.split_cost(stretch) + right.split_cost(stretch);
+            if(cost < best_cost){
+                best_cost = cost;
+                best_axis = axis;
+                best_split = split;
+            }
+        }
+    }
+
+    size_t middle;
+    if(best_axis >= 0){
+        middle = std::partition(items.begin()+first, items.begin()+last, [&](const std::pair<LightBounds,uint32_t>& item){
+            return bin_of(item.first, best_axis) <= best_split;
+        }) - items.begin();
+    } else {
+        middle = first + (last - first)/2;
+        int axis = 0;
+        Vector3 spread = centroids.max - centroids.min;
+        if(spread.y > spread[axis]) axis = 1;
+        if(spread.z > spread[axis]) axis = 2;
+        std::nth_element(items.begin()+first, items.begin()+middle, items.begin()+last, [axis](const auto& a, const auto& b){
+            return a.first.bounds.center()[axis] < b.first.bounds.center()[axis];
+        });
+    }
+
+    build_tree(items, first, middle, depth+1, trail);
+    tree[node] = {all, (uint32_t)tree.size(), false};
+    build_tree(items, middle, last, depth+1, trail | (1ull << depth));
+}
+
+void LightList::set_environment(std::shared_ptr<const EnvironmentMap> map, Real intensity){
+    environment_map = std::move(map);
+    environment_intensity = intensity;
+}
+
+// Sampling a sphere by the cone of directions it covers, so every sample lands on the side facing us.
+// 1-cos(theta max) is worked out as sin^2/(1+cos) since far away spheres would lose it all to rounding otherwise
+static bool sphere_cone(const Sphere& sphere, const Point3& from, Vector3& to_center, double& distance_squared, double& one_minus_cos_max){
+    to_center = sphere.center - from;
+    distance_squared = to_center.length_squared();
+    double radius_squared = (double)sphere.radius*sphere.radius;
+    if(distance_squared <= radius_squared) return false; // inside of it
+    double sin_squared_max = radius_squared / distance_squared;
+    one_minus_cos_max = sin_squared_max / (1.0 + std::sqrt(1.0 - sin_squared_max));
+    return one_minus_cos_max > 0.0;
+}
+
+double LightList::sphere_pdf(const Sphere& sphere, const Point3& from){
+    Vector3 to_center;
+    double distance_squared, one_minus_cos_max;
+    if(!sphere_cone(sphere,from,to_center,distance_squared,one_minus_cos_max)) return 0.0;
+    return 1.0 / (2.0*PI*one_minus_cos_max);
+}
+
+bool LightList::sample(const Point3& from, const Vector3& normal, LightSample& sample)const{
+    // One number picks both between the environment and the shapes and then which shape
+    double env_odds = environment_odds();
+    double pick = sample_1d();
+    if(env_odds > 0.0 && (env_odds >= 1.0 || pick < env_odds)){
+        if(!environment_map->sample(sample.direction,sample.emitted,sample.pdf)) return false;
+        sample.emitted *= environment_intensity;
+        sample.distance = Infinity;
+        sample.light = nullptr;
+        sample.pdf *= env_odds;
+        return true;
+    }
+    if(lights.empty()) return false;
+    pick = (pick - env_odds) / (1.0 - env_odds);
+    size_t picked;
+    double picked_odds;
+    if(tree.empty()){
+        picked = std::min(lights.size()-1, (size_t)(pick*lights.size()));
+        picked_odds = 1.0 / lights.size();
+    } else {
+        // Down the tree by the importance of each side, what is left of the number picking at the next level
+        size_t node = 0;
+        picked_odds = 1.0;
+        while(!tree[node].leaf){
+            size_t first = node+1, second = tree[node].index;
+            double first_importance = tree[first].bounds.importance(from,normal);
+            double second_importance = tree[second].bounds.importance(from,normal);
+            if(first_importance + second_importance <= 0.0) return false;
+            double first_odds = first_importance / (first_importance + second_importance);
+            if(pick < first_odds){
+                pick = pick / first_odds;
+                node = first;
+                picked_odds *= first_odds;
+            } else {
+                pick = std::min(0.99999999, (pick - first_odds) / (1.0 - first_odds));
+                node = second;
+                picked_odds *= 1.0 - first_odds;
+            }
+        }
+        picked = tree[node].index;
+    }
+    Real u,v;
+    sample_2d(u,v);
+    const Light& light = lights[picked];
+    sample.light = light.object.get();
+    sample.emitted = light.emitted;
+
+    if(light.sphere){
+        Vector3 to_center;
+        double distance_squared, one_minus_cos_max;
+        if(!sphere_cone(*light.sphere,from,to_center,distance_squared,one_minus_cos_max)) return false;
+        double cos_theta = 1.0 - u*one_minus_cos_max;
+        double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta*cos_theta));
+        double angle = v * 2.0*PI;
+
+        Vector3 w = to_center / (Real)std::sqrt(distance_squared);
+        Vector3 u,v;
+        Vector3::orthonormal_basis(w,u,v);
+        sample.direction = u*(Real)(std::cos(angle)*sin_theta) + v*(Real)(std::sin(angle)*sin_theta) + w*(Real)cos_theta;
+        // Near side of the sphere along the picked direction
+        double b = sample.direction.dot(to_center);
+        double disc = b*b - distance_squared + (double)light.sphere->radius*light.sphere->radius;
+        sample.distance = b - std::sqrt(std::max(0.0,disc));
+        sample.pdf = 1.0 / (2.0*PI*one_minus_cos_max);
+    } else {
+        // Uniform over the area of the triangle, then turned into a density over directions from here
+        const Triangle& tri = *light.triangle;
+        double su = std::sqrt((double)u);
+        double b1 = 1.0 - su;
+        double b2 = v * su;
+        Point3 point = tri.p1*(Real)b1 + tri.p2*(Real)b2 + tri.p3*(Real)(1.0 - b1 - b2);
+        Vector3 to_point = point - from;
+        double distance_squared = to_point.length_squared();
+        if(distance_squared <= 0.0) return false;
+        sample.distance = std::sqrt(distance_squared);
+        sample.direction = to_point / sample.distance;
+        double cos_light = std::fabs(tri.normal.dot(sample.direction));
+        if(cos_light <= 1e-8) return false;
+        sample.pdf = distance_squared / (light.area*cos_light);
+    }
+    sample.pdf *= (1.0 - env_odds) * picked_odds;
+    return true;
+}
+
+double LightList::pick_odds(size_t light, const Point3& point, const Vector3& normal)const{
+    if(tree.empty()) return 1.0 / lights.size();
+    double odds = 1.0;
+    size_t node = 0;
+    uint64_t trail = trails[light];
+    for(int depth=0; !tree[node].leaf; depth++){
+        size_t first = node+1, second = tree[node].index;
+        double first_importance = tree[first].bounds.importance(point,normal);
+        double second_importance = tree[second].bounds.importance(point,normal);
+        if(first_importance + second_importance <= 0.0) return 0.0;
+        bool take_second = (trail >> depth) & 1;
+        odds *= (take_second ? second_importance : first_importance) / (first_importance + second_importance);
+        node = take_second ? second : first;
+    }
+    return odds;
+}
+
+double LightList::pdf(const Point3& from, const Vector3& normal, const HitRecord& rec)const{
+    auto found = index.find(rec.object);
+    if(found == index.end()) return 0.0;
+    const Light& light = lights[found->second];
+    double density;
+    if(light.sphere){
+        density = sphere_pdf(*light.sphere,from);
+    } else {
+        Vector3 to_point = rec.intersection_point - from;
+        double distance_squared = to_point.length_squared();
+        double cos_light = std::fabs(light.triangle->normal.dot(to_point)) / std::sqrt(distance_squared);
+        if(cos_light <= 1e-8) return 0.0;
+        density = distance_squared / (light.area*cos_light);
+    }
+    return density * (1.0 - environment_odds()) * pick_odds(found->second,from,normal);
+}
+
+bool LightList::emit(Ray& ray, Color& power)const{
+    if(lights.empty() || shape_power() <= 0.0) return false;
+    double pick = sample_1d() * shape_power();
+    size_t picked = std::min(lights.size()-1, (size_t)(std::upper_bound(power_cdf.begin(), power_cdf.end(), pick) - power_cdf.begin()));
+    const Light& light = lights[picked];
+    double odds = (power_cdf[picked] - (picked ? power_cdf[picked-1] : 0.0)) / shape_power();
+
+    Real u,v;
+    sample_2d(u,v);
+    Vector3 normal;
+    if(light.sphere){
+        double z = 1.0 - 2.0*u;
+        double r = std::sqrt(std::max(0.0, 1.0 - z*z));
+        double angle = 2.0*PI*v;
+        normal = Vector3{Real(r*std::cos(angle)), Real(r*std::sin(angle)), Real(z)};
+        ray.origin = light.sphere->center + normal*light.sphere->radius;
+    } else {
+        const Triangle& tri = *light.triangle;
+        double su = std::sqrt((double)u);
+        double b1 = 1.0 - su;
+        double b2 = v * su;
+        ray.origin = tri.p1*(Real)b1 + tri.p2*(Real)b2 + tri.p3*(Real)(1.0 - b1 - b2);
+        normal = sample_1d() < 0.5 ? tri.normal : tri.normal.reverse();
+    }
+    // Cosine weighted, so the cosine and the density cancel into the pi of the power
+    Vector3 tangent, bitangent;
+    Vector3::orthonormal_basis(normal,tangent,bitangent);
+    sample_2d(u,v);
+    double r = std::sqrt((double)u), angle = 2.0*PI*v;
+    ray.direction = (tangent*(Real)(r*std::cos(angle)) + bitangent*(Real)(r*std::sin(angle)) + normal*(Real)std::sqrt(std::max(0.0, 1.0 - (double)u))).normalize();
+    ray.origin = offset_ray_origin(ray.origin,normal,ray.direction);
+    power = light.emitted * (Real)(light.area * PI * (light.triangle ? 2.0 : 1.0) / odds);
+    return true;
+}
+
+double LightList::environment_pdf(const Vector3& direction)const{
+    if(!environment_map) return 0.0;
+    return environment_map->pdf(direction) * environment_odds();
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "scene.h"
+#include "environment.h"
+
+// A point picked on one of the lights, as seen from where it was sampled
+struct LightSample{
+    Vector3 direction; // normalized
+    Real distance; // along direction to the point on the light, Infinity for the environment
+    Color emitted;
+    double pdf; // per solid angle, including the odds of this light being the one picked
+    const Hittable* light; // nullptr for the environment
+};
+
+// Every emissive sphere and triangle of a scene so shading can aim at them directly instead of waiting
+// for a bounce to happen to find them. Only the objects handed over are looked at - an emissive shape
+// inside a nested BVH (like a placed mesh) is not in the list and only gets found by bounces, same as before.
+// An environment map, when there is one, is picked half of the time and the shapes share the other half.
+// With more than a handful of shapes they go into a light tree (Conty Estevez and Kulla 2018) that picks
+// one by roughly how much light it could send to the point being shaded, in log time.
+class LightList{
+    struct Light{
+        std::shared_ptr<Hittable> object; // keeps the shape alive, the pointers below are into it
+        const Sphere* sphere;
+        const Triangle* triangle;
+        Color emitted;
+        double area;
+    };
+    std::vector<Light> lights;
+    std::vector<double> power_cdf; // running total of the luminance power of the shapes, for emit()
+
+    // Where a group of lights is, how much power they give off and which way - every surface normal is within
+    // theta_o of axis, and light leaves up to theta_e past the normal (a right angle for diffuse emitters)
+    struct LightBounds{
+        BBox bounds;
+        double power = 0.0;
+        Vector3 axis = {0,0,1};
+        double cos_theta_o = -1.0; // all directions
+        double cos_theta_e = 0.0;
+        bool two_sided = true; // light leaves along -axis just as much
+        // An upper bound on how much of the light could reach point, a surface facing normal
+        double importance(const Point3& point, const Vector3& normal)const;
+        // Bounds around both, with the cone widened to take in both cones
+        static LightBounds merge(const LightBounds& a, const LightBounds& b);
+        // Surface area orientation heuristic of splitting off these lights, stretch is how much longer
+        // the bounds of the parent are on their longest side than on the side being split
+        double split_cost(double stretch)const;
+    };
+    struct LightNode{
+        LightBounds bounds;
+        uint32_t index; // of the light for a leaf, of the second child otherwise (the first is the next node)
+        bool leaf;
+    };
+    static constexpr size_t min_tree_lights = 8; // fewer than this are picked between evenly
+    std::vector<LightNode> tree; // depth first, empty when picking evenly
+    std::vector<uint64_t> trails; // per light the way down to it from the root, bit n set for the second child at depth n
+    void build_tree(std::vector<std::pair<LightBounds,uint32_t>>& items, size_t first, size_t last, int depth, uint64_t trail);
+    // Odds of picking light from point, a surface facing normal
+    double pick_odds(size_t light, const Point3& point, const Vector3& normal)const;
+    std::unordered_map<const Hittable*, size_t> index;
+    std::shared_ptr<const EnvironmentMap> environment_map;
+    Real environment_intensity = 1.0;
+
+    // Odds of sample() going for the environment instead of one of the shapes
+    double environment_odds()const{ return !environment_map ? 0.0 : lights.empty() ? 1.0 : 0.5; }
+
+    static double sphere_pdf(const Sphere& sphere, const Point3& from);
+
+    public:
+    LightList() = default;
+    explicit LightList(const ObjList& objects);
+    bool empty()const{ return lights.empty() && !environment_map; }
+    size_t size()const{ return lights.size(); }
+
+    // Light arriving from everywhere rays escape to, nullptr for none (the simulated sky)
+    void set_environment(std::shared_ptr<const EnvironmentMap> map, Real intensity = 1.0);
+    const EnvironmentMap* environment()const{ return environment_map.get(); }
+    Color environment_radiance(const Vector3& direction)const{ return environment_map->radiance(direction) * environment_intensity; }
+
+    // Picks a light and a point on it for a surface at from facing normal, false if the one picked cannot be seen
+    // from here at all. Lights behind the surface are picked less or not at all, so normal has to be the one the
+    // surface reflects around.
+    bool sample(const Point3& from, const Vector3& normal, LightSample& sample)const;
+    // Density sample() would have given for the hit a ray from from landed on, 0 if it was not a light in the list
+    double pdf(const Point3& from, const Vector3& normal, const HitRecord& rec)const;
+    // Density sample() would have given for a ray escaping to the environment along direction
+    double environment_pdf(const Vector3& direction)const;
+
+    // Light leaving the shapes rather than arriving somewhere - picks a shape by its share of the power they
+    // give off, a point on it and a cosine weighted direction away from it. power is what the ray carries,
+    // all of them together add up to the power of the shapes on average. False if there are none.
+    bool emit(Ray& ray, Color& power)const;
+    // Luminance of the power all the shapes give off together
+    double shape_power()const{ return power_cdf.empty() ? 0.0 : power_cdf.back(); }
+};
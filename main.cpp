@@ -5,44 +5,45 @@
 #include "shapes.h"
 #include "scene.h"
 #include "model.h"
+#include "scene_file.h"
 
-void populate_random_spheres_volume(HittableList& list, int num_spheres, RealRange radius_range, double dx, double dy, double dz, int glass_frequency=12){
+void populate_random_spheres_volume(HittableList& list, int num_spheres, RealRange radius_range, Real dx, Real dy, Real dz, int glass_frequency=12){
     while(num_spheres){
         num_spheres--;
-        double new_r = random_percentage_distribution(gen) * (radius_range.max - radius_range.min) + radius_range.min;
-        list.add(std::make_shared<Sphere>(
+        Real new_r = random_percentage_distribution(gen) * (radius_range.max - radius_range.min) + radius_range.min;
+        list.emplace<Sphere>(
             Vector3{dx*random_neg_pos_one(gen),dy*random_neg_pos_one(gen),dz*random_neg_pos_one(gen)},
             new_r,
             num_spheres%glass_frequency==0 ? 
-                (std::shared_ptr<Material>) std::make_shared<PureTransparentMaterial>(PureTransparentMaterial(1.5)) :
-                (std::shared_ptr<Material>) std::make_shared<BRDMaterial>(BRDMaterial::random())
-            ));
+                PureTransparentMaterial(1.5).id :
+                BRDMaterial::random().id
+            );
     }
 }
-void populate_random_spheres_plane_sitting(HittableList& list, int num_spheres, RealRange radius_range, double dx, double dz){
+void populate_random_spheres_plane_sitting(HittableList& list, int num_spheres, RealRange radius_range, Real dx, Real dz){
     while(num_spheres){
         num_spheres--;
-        double new_r = random_percentage_distribution(gen) * (radius_range.max - radius_range.min) + radius_range.min;
-        list.add(std::make_shared<Sphere>(
+        Real new_r = random_percentage_distribution(gen) * (radius_range.max - radius_range.min) + radius_range.min;
+        list.emplace<Sphere>(
             Vector3{dx*random_neg_pos_one(gen),new_r,dz*random_neg_pos_one(gen)},
             new_r,
-            std::make_shared<BRDMaterial>(BRDMaterial::random())
-            ));
+            BRDMaterial::random().id
+            );
     }
 }
 
-void populate_random_sphere_of_spheres(HittableList& list, int num_spheres, RealRange radius_range, double major_sphere_radius, int glass_frequency=12){
-    auto glass = std::make_shared<PureTransparentMaterial>(PureTransparentMaterial(1.5));
+void populate_random_sphere_of_spheres(HittableList& list, int num_spheres, RealRange radius_range, Real major_sphere_radius, int glass_frequency=12){
+    MaterialId glass = PureTransparentMaterial(1.5).id;
     while(num_spheres){
         num_spheres--;
-        double new_r = random_percentage_distribution(gen) * (radius_range.max - radius_range.min) + radius_range.min;
-        list.add(std::make_shared<Sphere>(
+        Real new_r = random_percentage_distribution(gen) * (radius_range.max - radius_range.min) + radius_range.min;
+        list.emplace<Sphere>(
             Vector3::random_unit_vector() * major_sphere_radius,
             new_r,
             num_spheres%glass_frequency==0 ? 
-                (std::shared_ptr<Material>) glass :
-                (std::shared_ptr<Material>) std::make_shared<BRDMaterial>(BRDMaterial::random())
-            ));
+                glass :
+                BRDMaterial::random().id
+            );
     }
 }
 
@@ -64,9 +65,9 @@ void populate_triangles_crafted_test(HittableList& list){
 }
 void populate_sphere_crafted_test(HittableList& list){
     // "Horizon"
-    list.add(std::make_shared<Sphere>(
-        Vector3{0.0,-100.0,0.0},
-        100.0,
+    list.add(std::make_shared<Plane>(
+        Vector3{0.0,0.0,0.0},
+        y_pos,
         std::make_shared<BRDMaterial>(DarkGreen,White,Black,1.0,1.0)
     ));
     // Center - Basic
@@ -112,7 +113,64 @@ void populate_hand_crafted_box_plus_embedded_sphere(HittableList& list){
     ));
 }
 
-int main(){
+// Compare two renders of the same frame, ie the single precision build against the double precision one
+int compare_pfm_images(const char* reference_filename, const char* test_filename){
+    Image reference(0,0), test(0,0);
+    if(!reference.read_from_pfm(reference_filename) || !test.read_from_pfm(test_filename)){
+        print("Unable to read {} or {}\n",reference_filename,test_filename);
+        return 1;
+    }
+    double rmse, max_error;
+    test.compare(reference,rmse,max_error);
+    print("Image error against {}: RMSE {:.6f}  max {:.6f}\n",reference_filename,rmse,max_error);
+    return 0;
+}
+
+// Renders each scene file in turn, sharing loaded meshes and built BVHs between them
+int render_batch(const std::vector<std::string>& scene_files){
+    Stopwatch totalTimer;
+    AssetCache cache;
+    int failed = 0;
+    for(const std::string& scene_file : scene_files){
+        RenderJob job;
+        if(!load_render_job(scene_file,cache,job)){
+            failed++;
+            continue;
+        }
+        render_job(job,cache);
+    }
+    print("\n\nTotal Time {}  ({} of {} jobs failed to load)\n",ms_to_human(totalTimer.duration()),failed,scene_files.size());
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char** argv){
+    std::string pfm_output, environment_file, aov_output;
+    int denoise_iterations = 0;
+    std::vector<std::string> scene_files;
+    for(int arg=1; arg<argc; arg++){
+        std::string flag = argv[arg];
+        if(flag == "--compare" && arg+2 < argc){
+            return compare_pfm_images(argv[arg+1],argv[arg+2]);
+        } else if(flag == "--pfm" && arg+1 < argc){
+            pfm_output = argv[++arg];
+        } else if(flag == "--denoise" && arg+1 < argc){
+            denoise_iterations = std::max(0, atoi(argv[++arg]));
+        } else if(flag == "--aovs" && arg+1 < argc){
+            aov_output = argv[++arg];
+        } else if(flag == "--environment" && arg+1 < argc){
+            environment_file = argv[++arg];
+        } else if(flag == "--batch" && arg+1 < argc){
+            scene_files.assign(argv+arg+1, argv+argc);
+            break;
+        } else {
+            print("Usage: {} [--pfm frame.pfm] [--environment map.hdr] [--denoise passes] [--aovs prefix] [--compare reference.pfm test.pfm] [--batch scene_file...]\n",argv[0]);
+            return 1;
+        }
+    }
+    print("Precision: {}  SIMD: {}\n", sizeof(Real)==sizeof(float) ? "single" : "double", cpu_dispatch_level());
+    if(!scene_files.empty())
+        return render_batch(scene_files);
+
     // Camera viewport(1920*4,1080*4);
     Camera viewport(1920,1080);
     // Camera viewport(1920/2,1080/2);
@@ -133,17 +191,34 @@ int main(){
     Stopwatch timer,totalTimer;
     BVHList world(spheres.objects);
     print("BVH Creation Time  {}\n",timer.duration());
+    viewport.lights = LightList(spheres.objects);
+    viewport.denoise_iterations = denoise_iterations;
+    viewport.capture_aovs = !aov_output.empty();
+    if(!environment_file.empty()){
+        auto map = load_environment(environment_file);
+        if(!map) return 1;
+        viewport.lights.set_environment(map);
+    }
 
     //Horizontal Rotation
     int number_frames = 16;
     // for(int frame=0; frame < number_frames; frame++){
         int frame = 4; //58;
-        viewport.origin = Vector3{cos(2*PI*(frame/(double)number_frames))*15,5,sin(2*PI*(frame/(double)number_frames))*15};
+        viewport.origin = Vector3{Real(cos(2*PI*(frame/(double)number_frames))*15),5,Real(sin(2*PI*(frame/(double)number_frames))*15)};
         viewport.look_at(Vector3{0,0,0});
         timer.reset();
         // viewport.render(spheres);
         viewport.render(world);
         print("Frame: {} - {}\n",frame,ms_to_human(timer.duration()));
+        if(viewport.denoise_iterations)
+            print("Denoise Time {}\n",ms_to_human(viewport.denoise_time));
+#ifdef BVH_STATS
+        print("BVH nodes visited per ray: {:.2f}\n",BVHList::nodes_visited / (double)std::max(1ull,BVHList::rays_traversed.load()));
+#endif
+        if(!pfm_output.empty())
+            viewport.pixels->write_to_pfm(pfm_output);
+        if(!aov_output.empty())
+            viewport.aovs->write_to_pfm(aov_output);
         viewport.threaded_write_to_png(std::format("video/{}.png",frame));
     // }
 
@@ -1,29 +1,289 @@
 #include "materials.h"
+#include "shapes.h"
+#include "sampler.h"
 
-void Material::scatter(const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce)const{}
-Color Material::extra_light(const Ray& incident, const HitRecord& rec, const Color& current_color)const{
-    return Black;
+//===================================================================
+// MaterialTable
+//===================================================================
+// Defined before the global materials below so it is constructed before they add themselves to it
+MaterialTable material_table;
+
+bool MaterialData::operator==(const MaterialData& other)const{
+    auto same_color = [](const Color& a, const Color& b){ return a.x==b.x && a.y==b.y && a.z==b.z; };
+    return type == other.type &&
+        same_color(diffuse,other.diffuse) && same_color(specular,other.specular) && same_color(emissive,other.emissive) &&
+        specular_tightness == other.specular_tightness && roughness == other.roughness &&
+        refractive_index == other.refractive_index && diffuse_texture == other.diffuse_texture;
 }
 
-// BRDMaterial::BRDMaterial(const BRDMaterial& other)
-// : diffuse(other.diffuse), specular(other.specular), emissive(other.emissive), specular_tightness(other.specular_tightness), roughness(other.roughness)
-// {}
-BRDMaterial::BRDMaterial(const Color& diffuse, const Color& specular, const Color& emissive, const double& specular_tightness, const double& roughness)
-: diffuse(diffuse), specular(specular), emissive(emissive), specular_tightness(specular_tightness), roughness(roughness)
-{}
+static size_t hash_material(const MaterialData& material){
+    size_t hash = std::hash<int>()((int)material.type);
+    auto mix = [&hash](double value){ hash ^= std::hash<double>()(value) + 0x9e3779b97f4a7c15ull + (hash<<6) + (hash>>2); };
+    for(const Color* color : {&material.diffuse, &material.specular, &material.emissive}){
+        mix(color->x); mix(color->y); mix(color->z);
+    }
+    mix(material.specular_tightness);
+    mix(material.roughness);
+    mix(material.refractive_index);
+    mix(material.diffuse_texture);
+    return hash;
+}
+
+MaterialId MaterialTable::add(const MaterialData& material){
+    std::lock_guard<std::mutex> guard(add_mutex);
+    size_t hash = hash_material(material);
+    auto [same_hash, same_hash_end] = by_hash.equal_range(hash);
+    for(; same_hash != same_hash_end; same_hash++){
+        if((*this)[same_hash->second] == material) return same_hash->second;
+    }
+
+    MaterialId id = count.load(std::memory_order_relaxed);
+    if(id >= chunk_size*max_chunks){
+        printf("Material table is full, using the first material instead\n");
+        return 0;
+    }
+    if(!chunks[id>>chunk_bits]) chunks[id>>chunk_bits] = std::make_unique<MaterialData[]>(chunk_size);
+    chunks[id>>chunk_bits][id&(chunk_size-1)] = material;
+    by_hash.emplace(hash,id);
+    count.store(id+1, std::memory_order_release);
+    return id;
+}
+
+MaterialId material_id(const std::shared_ptr<Material>& material){
+    return material ? material->id : AluminiumDull->id;
+}
+
+//===================================================================
+// Shading
+//===================================================================
+// BRD is a GGX microfacet lobe tinted by specular (Schlick fresnel, specular is the color head on) on top of a
+// Lambert lobe tinted by diffuse. roughness moves the mix from all specular at 0 to all diffuse at 1, and
+// specular_tightness narrows the specular lobe down to a mirror at 1.
+// Everything is worked out in the space of the normal, where z is up and the incident ray leaves along wo.
+struct BRDLobes{
+    double specular_weight; // how much of the light the specular lobe gets
+    double specular_odds; // of sampling the specular lobe rather than the diffuse one, by how bright each is
+    double alpha; // GGX width
+    bool mirror; // specular lobe too narrow to be anything but a mirror, so sampling it is not a density
+};
+static constexpr double min_alpha = 0.001;
+
+static inline BRDLobes brd_lobes(const MaterialData& material){
+    BRDLobes lobes;
+    lobes.specular_weight = std::clamp(1.0 - material.roughness, 0.0, 1.0);
+    auto average = [](const Color& c){ return (c.red + c.green + c.blue) / 3.0; };
+    double specular_albedo = lobes.specular_weight * average(material.specular);
+    double diffuse_albedo = (1.0 - lobes.specular_weight) * average(material.diffuse);
+    lobes.specular_odds = specular_albedo + diffuse_albedo > 0.0 ? specular_albedo / (specular_albedo + diffuse_albedo) : lobes.specular_weight;
+    lobes.alpha = material.roughness * (1.0 - std::clamp(material.specular_tightness, 0.0, 1.0));
+    lobes.mirror = lobes.alpha < min_alpha;
+    return lobes;
+}
+
+static inline Color schlick_fresnel(const Color& head_on, double cosine){
+    double edge = std::pow(1.0 - std::clamp(cosine,0.0,1.0), 5);
+    return head_on + (White - head_on) * (Real)edge;
+}
+
+// Normal distribution and Smith shadowing for GGX, alpha2 is alpha squared
+static inline double ggx_d(double cos_h, double alpha2){
+    double d = cos_h*cos_h*(alpha2 - 1.0) + 1.0;
+    return alpha2 / (PI*d*d);
+}
+static inline double ggx_lambda(double cos_theta, double alpha2){
+    double cos2 = cos_theta*cos_theta;
+    return 0.5 * (std::sqrt(1.0 + alpha2*std::max(0.0, 1.0 - cos2)/cos2) - 1.0);
+}
 
-void BRDMaterial::scatter(const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce)const{
-    Vector3 diffuse_cast = rec.normal + Vector3::random_unit_vector(); // lambertian diffusion
-    Vector3 specular_cast = Vector3::reflect_around_normal(rec.normal,incident.direction);
+// Shirley and Chiu's concentric mapping of the unit square onto the unit disk - unlike the polar one it keeps
+// squares that are close together close on the disk, so evenly spread samples stay evenly spread
+static inline void concentric_disk(double& x, double& y){
+    Real u,v;
+    sample_2d(u,v);
+    double a = 2.0*u - 1.0, b = 2.0*v - 1.0;
+    if(a == 0.0 && b == 0.0){
+        x = y = 0.0;
+    } else if(std::fabs(a) > std::fabs(b)){
+        x = a*std::cos(PI/4.0 * (b/a));
+        y = a*std::sin(PI/4.0 * (b/a));
+    } else {
+        x = b*std::cos(PI/2.0 - PI/4.0 * (a/b));
+        y = b*std::sin(PI/2.0 - PI/4.0 * (a/b));
+    }
+}
+
+// Heitz 2018 "Sampling the GGX Distribution of Visible Normals" - a microfacet normal as seen from wo
+static Vector3 ggx_sample_visible_normal(const Vector3& wo, double alpha){
+    Vector3 stretched = Vector3{Real(alpha*wo.x), Real(alpha*wo.y), wo.z}.normalize();
+    Real length_squared = stretched.x*stretched.x + stretched.y*stretched.y;
+    Vector3 t1 = length_squared > 0 ? Vector3{-stretched.y, stretched.x, 0} / std::sqrt(length_squared) : Vector3{1,0,0};
+    Vector3 t2 = stretched.cross(t1);
+    double p1, p2;
+    concentric_disk(p1,p2);
+    double s = 0.5*(1.0 + stretched.z);
+    p2 = (1.0 - s)*std::sqrt(std::max(0.0, 1.0 - p1*p1)) + s*p2;
+    Vector3 normal = t1*(Real)p1 + t2*(Real)p2 + stretched*(Real)std::sqrt(std::max(0.0, 1.0 - p1*p1 - p2*p2));
+    return Vector3{Real(alpha*normal.x), Real(alpha*normal.y), std::max((Real)0, normal.z)}.normalize();
+}
+
+// The diffuse color at the hit, with the texture filtered over the footprint of the ray there
+static inline Color brd_diffuse(const MaterialData& material, const HitRecord& rec){
+    if(!material.diffuse_texture) return material.diffuse;
+    Real u, v, uv_scale;
+    rec.object->texture_coordinates(rec,u,v,uv_scale);
+    const Texture& texture = texture_table[material.diffuse_texture];
+    return material.diffuse * texture.sample(material.diffuse_texture, u, v, rec.footprint*uv_scale);
+}
 
-    outgoing_bounce.direction = Vector3::lerp(specular_cast,diffuse_cast,roughness).normalize();
+// The BRDF times the cosine of wi, and the density brd_scatter has of picking wi - both leave out a mirror lobe
+static void brd_eval(const MaterialData& material, const BRDLobes& lobes, const Color& diffuse, const Vector3& wo, const Vector3& wi, Color& value, double& pdf){
+    value = Black;
+    pdf = 0.0;
+    if(wo.z <= 0 || wi.z <= 0) return;
+    double diffuse_weight = 1.0 - lobes.specular_weight;
+    value = diffuse * (Real)(diffuse_weight * wi.z / PI);
+    pdf = (1.0 - lobes.specular_odds) * wi.z / PI;
+    if(lobes.mirror || lobes.specular_odds <= 0.0) return;
+
+    Vector3 half = (wo + wi).normalize();
+    double alpha2 = lobes.alpha*lobes.alpha;
+    double d = ggx_d(half.z,alpha2);
+    double lambda_o = ggx_lambda(wo.z,alpha2);
+    double lambda_i = ggx_lambda(wi.z,alpha2);
+    // f cos(wi) = F D G2 / (4 cos(wo)), and visible normal sampling reflected about the normal is G1(wo) D / (4 cos(wo))
+    value += schlick_fresnel(material.specular, wo.dot(half)) * (Real)(lobes.specular_weight * d / ((1.0 + lambda_o + lambda_i) * 4.0*wo.z));
+    pdf += lobes.specular_odds * d / ((1.0 + lambda_o) * 4.0*wo.z);
+}
+
+static void brd_scatter(const MaterialData& material, const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce, double& pdf){
+    Vector3 tangent, bitangent;
+    Vector3::orthonormal_basis(rec.normal,tangent,bitangent);
+    Vector3 to_viewer = incident.direction.reverse().normalize();
+    Vector3 wo{to_viewer.dot(tangent), to_viewer.dot(bitangent), to_viewer.dot(rec.normal)};
+    BRDLobes lobes = brd_lobes(material);
     outgoing_bounce.origin = rec.intersection_point;
+    attenuation = Black;
+    pdf = 0.0;
+    if(wo.z <= 0){
+        outgoing_bounce.direction = rec.normal;
+        return;
+    }
+
+    Vector3 wi;
+    if(sample_1d() < lobes.specular_odds){
+        if(lobes.mirror){
+            outgoing_bounce.direction = Vector3::reflect_around_normal(rec.normal,incident.direction).normalize();
+            attenuation = schlick_fresnel(material.specular, wo.z) * (Real)(lobes.specular_weight / lobes.specular_odds);
+            return;
+        }
+        Vector3 microfacet = ggx_sample_visible_normal(wo,lobes.alpha);
+        wi = microfacet * (2*wo.dot(microfacet)) - wo;
+    } else {
+        // cosine weighted, straight up from a point on the disk
+        double x, y;
+        concentric_disk(x,y);
+        wi = Vector3{Real(x), Real(y), Real(std::sqrt(std::max(0.0, 1.0 - x*x - y*y)))};
+    }
+    outgoing_bounce.direction = (tangent*wi.x + bitangent*wi.y + rec.normal*wi.z).normalize();
 
-    attenuation = Vector3::lerp(specular,diffuse, outgoing_bounce.direction.dot(rec.normal) );
+    Color value;
+    brd_eval(material,lobes,brd_diffuse(material,rec),wo,wi,value,pdf);
+    if(pdf > 0.0) attenuation = value / (Real)pdf;
 }
 
-Color BRDMaterial::extra_light(const Ray& incident, const HitRecord& rec, const Color& current_color)const{
-    return emissive;
+// Both ways into brd_eval from world space directions
+static void brd_eval(const MaterialData& material, const Ray& incident, const HitRecord& rec, const Vector3& direction, Color& value, double& pdf){
+    Vector3 tangent, bitangent;
+    Vector3::orthonormal_basis(rec.normal,tangent,bitangent);
+    Vector3 to_viewer = incident.direction.reverse().normalize();
+    Vector3 wo{to_viewer.dot(tangent), to_viewer.dot(bitangent), to_viewer.dot(rec.normal)};
+    Vector3 wi{direction.dot(tangent), direction.dot(bitangent), direction.dot(rec.normal)};
+    brd_eval(material,brd_lobes(material),brd_diffuse(material,rec),wo,wi,value,pdf);
+}
+
+static void pure_transparent_scatter(const MaterialData& material, const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce, double& pdf){
+    attenuation = White;
+    pdf = 0.0;
+    double ri_ratio = rec.front_face ? (1.0/material.refractive_index) : material.refractive_index;
+    double cos_theta = fmin(incident.direction.reverse().dot(rec.normal), 1.0);
+    double sin_theta = sqrt(1.0 - (cos_theta*cos_theta));
+
+    bool can_refract = (ri_ratio * sin_theta) <= 1.0;
+    if(!can_refract || PureTransparentMaterial::reflectance(cos_theta, ri_ratio) > sample_1d()) {
+        outgoing_bounce.direction = rec.normal.reflect(incident.direction);
+    } else {
+        outgoing_bounce.direction = rec.normal.refract(incident.direction,ri_ratio);
+    }
+    outgoing_bounce.origin = rec.intersection_point;
+}
+
+void scatter(MaterialId id, const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce, double& pdf){
+    const MaterialData& material = material_table[id];
+    pdf = 0.0;
+    switch(material.type){
+        case MaterialType::BRD: brd_scatter(material,incident,rec,attenuation,outgoing_bounce,pdf); break;
+        case MaterialType::PureTransparent: pure_transparent_scatter(material,incident,rec,attenuation,outgoing_bounce,pdf); break;
+        case MaterialType::None: break;
+    }
+}
+
+Color extra_light(MaterialId id){
+    const MaterialData& material = material_table[id];
+    switch(material.type){
+        case MaterialType::BRD: return material.emissive;
+        default: return Black;
+    }
+}
+
+double scatter_pdf(MaterialId id, const Ray& incident, const HitRecord& rec, const Vector3& direction){
+    const MaterialData& material = material_table[id];
+    if(material.type != MaterialType::BRD) return 0.0;
+    Color value;
+    double pdf;
+    brd_eval(material,incident,rec,direction,value,pdf);
+    return pdf;
+}
+
+Color scatter_eval(MaterialId id, const Ray& incident, const HitRecord& rec, const Vector3& direction){
+    const MaterialData& material = material_table[id];
+    if(material.type != MaterialType::BRD) return Black;
+    Color value;
+    double pdf;
+    brd_eval(material,incident,rec,direction,value,pdf);
+    return value;
+}
+
+Color surface_albedo(MaterialId id, const HitRecord& rec){
+    const MaterialData& material = material_table[id];
+    switch(material.type){
+        case MaterialType::BRD:{
+            Real specular_weight = brd_lobes(material).specular_weight;
+            return brd_diffuse(material,rec)*(1-specular_weight) + material.specular*specular_weight;
+        }
+        case MaterialType::PureTransparent: return White;
+        default: return Black;
+    }
+}
+
+//===================================================================
+// BRDMaterial
+//===================================================================
+
+// BRDMaterial::BRDMaterial(const BRDMaterial& other)
+// : diffuse(other.diffuse), specular(other.specular), emissive(other.emissive), specular_tightness(other.specular_tightness), roughness(other.roughness)
+// {}
+BRDMaterial::BRDMaterial(const Color& diffuse, const Color& specular, const Color& emissive, const double& specular_tightness, const double& roughness, TextureId diffuse_texture)
+: diffuse(diffuse), specular(specular), emissive(emissive), specular_tightness(specular_tightness), roughness(roughness), diffuse_texture(diffuse_texture)
+{
+    MaterialData data;
+    data.type = MaterialType::BRD;
+    data.diffuse = diffuse;
+    data.specular = specular;
+    data.emissive = emissive;
+    data.specular_tightness = specular_tightness;
+    data.roughness = roughness;
+    data.diffuse_texture = diffuse_texture;
+    id = material_table.add(data);
 }
 
 BRDMaterial BRDMaterial::random(){
@@ -82,20 +342,11 @@ std::shared_ptr<BRDMaterial> ErrorMaterialRed =
 //===================================================================
 PureTransparentMaterial::PureTransparentMaterial(const double& refractive_index)
 :refractive_index(refractive_index)
-{}
-void PureTransparentMaterial::scatter(const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce)const{
-    attenuation = White;
-    double ri_ratio = rec.front_face ? (1.0/refractive_index) : refractive_index;
-    double cos_theta = fmin(incident.direction.reverse().dot(rec.normal), 1.0);
-    double sin_theta = sqrt(1.0 - (cos_theta*cos_theta));
-
-    bool can_refract = (ri_ratio * sin_theta) <= 1.0;
-    if(!can_refract || reflectance(cos_theta, ri_ratio) > random_percentage_distribution(gen)) {
-        outgoing_bounce.direction = rec.normal.reflect(incident.direction);
-    } else {
-        outgoing_bounce.direction = rec.normal.refract(incident.direction,ri_ratio);
-    }
-    outgoing_bounce.origin = rec.intersection_point;
+{
+    MaterialData data;
+    data.type = MaterialType::PureTransparent;
+    data.refractive_index = refractive_index;
+    id = material_table.add(data);
 }
 double PureTransparentMaterial::reflectance(double cosine, double refraction_index) {
     // Use Schlick's approximation for reflectance.
@@ -103,7 +354,3 @@ double PureTransparentMaterial::reflectance(double cosine, double refraction_ind
     r0 = r0*r0;
     return r0 + (1-r0)*pow((1 - cosine),5);
 }
-
-Color PureTransparentMaterial::extra_light(const Ray& incident, const HitRecord& rec, const Color& current_color)const{
-    return Black;
-}
\ No newline at end of file
@@ -1,15 +1,81 @@
 #pragma once
 #include "vec_utils.h"
-#include "shapes.h"
 #include "image.h"
+#include "texture.h"
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
 
-class HitRecord;
+struct HitRecord;
 
+// Index of a material in material_table - this is what shapes and hit records carry around
+using MaterialId = uint32_t;
+
+enum class MaterialType : uint8_t { None, BRD, PureTransparent };
+
+// Every kind of material flattened into one plain struct so they can all live in one table,
+// with shading picking what to do from the type instead of going through a vtable
+struct MaterialData{
+    MaterialType type = MaterialType::None;
+    // BRD
+    Color diffuse = {0,0,0};
+    Color specular = {0,0,0};
+    Color emissive = {0,0,0};
+    double specular_tightness = 0; // narrows the specular lobe, a mirror at 1
+    double roughness = 0; // all specular at 0 to all diffuse at 1
+    TextureId diffuse_texture = 0; // multiplies diffuse when there is one
+    // PureTransparent
+    double refractive_index = 1;
+
+    bool operator==(const MaterialData& other)const;
+};
+
+// Shading for whatever material the id points at
+// scatter picks the next bounce, attenuation being the BSDF times the cosine over pdf. pdf is the density per
+// solid angle the bounce was picked with, 0 when it came from a lobe that only ever bounces one way (mirrors,
+// glass), which sampling a light directly can never line up with.
+void scatter(MaterialId material, const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce, double& pdf);
+Color extra_light(MaterialId material);
+// Density of scatter() sending the bounce along direction (normalized), leaving out one way lobes
+double scatter_pdf(MaterialId material, const Ray& incident, const HitRecord& rec, const Vector3& direction);
+// The BSDF times the cosine for a bounce along direction, leaving out one way lobes
+Color scatter_eval(MaterialId material, const Ray& incident, const HitRecord& rec, const Vector3& direction);
+
+// Roughly how much light the surface reflects overall, for the albedo AOV - white for glass
+Color surface_albedo(MaterialId material, const HitRecord& rec);
+
+// Append only table of every material, identical materials share one entry.
+// Entries live in fixed size chunks that never move, so looking one up never locks even while another
+// thread is adding materials - only add() takes the lock.
+class MaterialTable{
+    static constexpr unsigned int chunk_bits = 10;
+    static constexpr MaterialId chunk_size = 1u<<chunk_bits;
+    static constexpr unsigned int max_chunks = 1u<<14;
+
+    std::unique_ptr<MaterialData[]> chunks[max_chunks];
+    std::atomic<MaterialId> count = 0;
+    std::mutex add_mutex;
+    std::unordered_multimap<size_t, MaterialId> by_hash; // for finding an identical material to reuse
+
+    public:
+    MaterialId add(const MaterialData& material);
+    const MaterialData& operator[](MaterialId id)const{
+        return chunks[id>>chunk_bits][id&(chunk_size-1)];
+    }
+    MaterialId size()const{ return count.load(std::memory_order_acquire); }
+};
+extern MaterialTable material_table;
+
+// The classes below only describe a material - constructing one adds it to material_table and keeps the id.
+// Changing the fields afterwards does not change the table entry.
 class Material{
     public:
-    virtual void scatter(const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce)const;
-    virtual Color extra_light(const Ray& incident, const HitRecord& rec, const Color& current_color)const;
+    MaterialId id = 0;
 };
+// Material of a shared_ptr handed to a shape, the default material when there is none
+MaterialId material_id(const std::shared_ptr<Material>& material);
 
 class BRDMaterial:public Material{
     public:
@@ -18,11 +84,10 @@ class BRDMaterial:public Material{
     Color emissive;
     double specular_tightness;
     double roughness;
+    TextureId diffuse_texture;
 
     // BRDMaterial(const BRDMaterial& other);
-    BRDMaterial(const Color& diffuse, const Color& specular, const Color& emissive, const double& specular_tightness, const double& roughness);
-    void scatter(const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce)const;
-    Color extra_light(const Ray& incident, const HitRecord& rec, const Color& current_color)const;
+    BRDMaterial(const Color& diffuse, const Color& specular, const Color& emissive, const double& specular_tightness, const double& roughness, TextureId diffuse_texture = 0);
     static BRDMaterial random();
 };
 
@@ -38,7 +103,5 @@ class PureTransparentMaterial:public Material{
     double refractive_index;
 
     PureTransparentMaterial(const double& refractive_index);
-    void scatter(const Ray& incident, const HitRecord& rec, Color& attenuation, Ray& outgoing_bounce)const;
-    Color extra_light(const Ray& incident, const HitRecord& rec, const Color& current_color)const;
     static double reflectance(double cosine, double refraction_index);
 };
\ No newline at end of file
@@ -1,69 +1,904 @@
 #include "model.h"
 #include <iostream>
-#include <fstream>
 #include <string>
 #include <cstring>
+#include <sstream>
+#include <bit>
+#include <charconv>
+#include <thread>
+#include <algorithm>
+#include <string_view>
+#include <cerrno>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-extern bool load_ply_file(std::string filename, HittableList& list, std::shared_ptr<Material> material, double scale, Point3 center) {
-    std::ifstream file(filename);
-    if(!file.is_open()) return false;
-    unsigned int num_points=0, num_faces=0;
-    std::string line;
+//===================================================================
+// MappedFile
+//===================================================================
+// Read only view of an entire file through mmap so the parsers can walk it without copying it first
+class MappedFile{
+    public:
+    const char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile(const std::string& filename){
+        int fd = open(filename.c_str(),O_RDONLY);
+        if(fd<0) return;
+        struct stat st;
+        if(fstat(fd,&st)==0 && st.st_size>0){
+            void* mapped = mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+            if(mapped != MAP_FAILED){
+                madvise(mapped,st.st_size,MADV_SEQUENTIAL);
+                data = (const char*)mapped;
+                size = st.st_size;
+            }
+        }
+        close(fd); // the mapping stays valid after the descriptor is closed
+    }
+    ~MappedFile(){
+        if(data) munmap((void*)data,size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    bool is_open()const{ return data != nullptr; }
+};
+
+//===================================================================
+// PLY header
+//===================================================================
+enum class PlyFormat{ Ascii, BinaryLittleEndian, BinaryBigEndian };
+enum class PlyType{ Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid };
+
+struct PlyProperty{
+    std::string name;
+    PlyType type = PlyType::Invalid;
+    bool is_list = false;
+    PlyType count_type = PlyType::Invalid; // only for lists
+};
+struct PlyElement{
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> properties;
+};
+struct PlyHeader{
+    PlyFormat format = PlyFormat::Ascii;
+    std::vector<PlyElement> elements;
+    size_t data_offset = 0; // first byte after end_header
+    size_t header_lines = 0; // so errors in an ASCII body can give the line number in the file
+};
+
+static PlyType parse_ply_type(const std::string& name){
+    if(name=="char"   || name=="int8")    return PlyType::Int8;
+    if(name=="uchar"  || name=="uint8")   return PlyType::UInt8;
+    if(name=="short"  || name=="int16")   return PlyType::Int16;
+    if(name=="ushort" || name=="uint16")  return PlyType::UInt16;
+    if(name=="int"    || name=="int32")   return PlyType::Int32;
+    if(name=="uint"   || name=="uint32")  return PlyType::UInt32;
+    if(name=="float"  || name=="float32") return PlyType::Float32;
+    if(name=="double" || name=="float64") return PlyType::Float64;
+    return PlyType::Invalid;
+}
+static size_t ply_type_size(PlyType type){
+    switch(type){
+        case PlyType::Int8: case PlyType::UInt8: return 1;
+        case PlyType::Int16: case PlyType::UInt16: return 2;
+        case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+        case PlyType::Float64: return 8;
+        default: return 0;
+    }
+}
+
+static bool parse_ply_header(const char* data, size_t size, PlyHeader& header, const std::string& filename){
+    const char* end_marker = "end_header";
+    const char* pos = data;
+    const char* end = data + size;
+    int line_number = 0;
+    while(pos < end){
+        const char* eol = (const char*)memchr(pos,'\n',end-pos);
+        if(!eol) break;
+        std::string line(pos, eol - pos);
+        if(!line.empty() && line.back()=='\r') line.pop_back();
+        pos = eol+1;
+        line_number++;
+
+        std::istringstream words(line);
+        std::string keyword;
+        words >> keyword;
+        if(line_number==1){
+            if(keyword != "ply"){
+                printf("%s: not a PLY file\n", filename.c_str());
+                return false;
+            }
+        } else if(keyword == "format"){
+            std::string format;
+            words >> format;
+            if(format=="ascii") header.format = PlyFormat::Ascii;
+            else if(format=="binary_little_endian") header.format = PlyFormat::BinaryLittleEndian;
+            else if(format=="binary_big_endian") header.format = PlyFormat::BinaryBigEndian;
+            else{
+                printf("%s:%d: unknown format '%s'\n", filename.c_str(), line_number, format.c_str());
+                return false;
+            }
+        } else if(keyword == "element"){
+            PlyElement element;
+            words >> element.name >> element.count;
+            header.elements.push_back(element);
+        } else if(keyword == "property"){
+            if(header.elements.empty()){
+                printf("%s:%d: property before any element\n", filename.c_str(), line_number);
+                return false;
+            }
+            PlyProperty property;
+            std::string type;
+            words >> type;
+            if(type == "list"){
+                std::string count_type, item_type;
+                words >> count_type >> item_type;
+                property.is_list = true;
+                property.count_type = parse_ply_type(count_type);
+                property.type = parse_ply_type(item_type);
+            } else {
+                property.type = parse_ply_type(type);
+            }
+            words >> property.name;
+            if(property.type == PlyType::Invalid || (property.is_list && property.count_type == PlyType::Invalid)){
+                printf("%s:%d: unknown property type in '%s'\n", filename.c_str(), line_number, line.c_str());
+                return false;
+            }
+            header.elements.back().properties.push_back(property);
+        } else if(keyword == end_marker){
+            header.data_offset = pos - data;
+            header.header_lines = line_number;
+            return true;
+        }
+        // comment and obj_info lines are ignored
+    }
+    printf("%s: no end_header found\n", filename.c_str());
+    return false;
+}
+
+//===================================================================
+// Binary PLY
+//===================================================================
+template<typename T>
+static inline T load_raw(const char* ptr, bool swap){
+    T value;
+    memcpy(&value,ptr,sizeof(T));
+    if(swap){
+        if constexpr (sizeof(T)==2) value = std::bit_cast<T>(__builtin_bswap16(std::bit_cast<uint16_t>(value)));
+        if constexpr (sizeof(T)==4) value = std::bit_cast<T>(__builtin_bswap32(std::bit_cast<uint32_t>(value)));
+        if constexpr (sizeof(T)==8) value = std::bit_cast<T>(__builtin_bswap64(std::bit_cast<uint64_t>(value)));
+    }
+    return value;
+}
+
+template<typename T>
+static inline T read_ply_value(const char* ptr, PlyType type, bool swap){
+    switch(type){
+        case PlyType::Int8:    return (T)load_raw<int8_t>(ptr,swap);
+        case PlyType::UInt8:   return (T)load_raw<uint8_t>(ptr,swap);
+        case PlyType::Int16:   return (T)load_raw<int16_t>(ptr,swap);
+        case PlyType::UInt16:  return (T)load_raw<uint16_t>(ptr,swap);
+        case PlyType::Int32:   return (T)load_raw<int32_t>(ptr,swap);
+        case PlyType::UInt32:  return (T)load_raw<uint32_t>(ptr,swap);
+        case PlyType::Float32: return (T)load_raw<float>(ptr,swap);
+        case PlyType::Float64: return (T)load_raw<double>(ptr,swap);
+        default: return 0;
+    }
+}
+
+// Adds the polygon as a fan of triangles around its first point
+static inline void add_fan_triangles(std::vector<unsigned int>& indices, const unsigned int* polygon, unsigned int points){
+    for(unsigned int p=1; p+1<points; p++){
+        indices.push_back(polygon[0]);
+        indices.push_back(polygon[p]);
+        indices.push_back(polygon[p+1]);
+    }
+}
+
+static bool load_binary_ply_body(const char* data, size_t size, const PlyHeader& header, Mesh& mesh, const std::string& filename){
+    const bool swap = (header.format == PlyFormat::BinaryLittleEndian) != (std::endian::native == std::endian::little);
+    const char* pos = data + header.data_offset;
+    const char* end = data + size;
+    auto truncated = [&](const PlyElement& element, size_t index){
+        printf("%s: file ends in the middle of %s %lu\n", filename.c_str(), element.name.c_str(), index);
+        return false;
+    };
+
+    for(const PlyElement& element : header.elements){
+        // Where each fixed size property sits inside of a record, or -1 if a list comes before it
+        // which means the record has to be walked one property at a time
+        std::vector<long> offsets;
+        long fixed_stride = 0;
+        for(const PlyProperty& property : element.properties){
+            if(property.is_list || fixed_stride < 0){
+                offsets.push_back(-1);
+                fixed_stride = -1;
+            } else {
+                offsets.push_back(fixed_stride);
+                fixed_stride += ply_type_size(property.type);
+            }
+        }
+
+        if(element.name == "vertex"){
+            int xyz[3] = {-1,-1,-1};
+            for(int p=0; p<(int)element.properties.size(); p++){
+                const std::string& name = element.properties[p].name;
+                if(name=="x") xyz[0]=p;
+                if(name=="y") xyz[1]=p;
+                if(name=="z") xyz[2]=p;
+            }
+            if(xyz[0]<0 || xyz[1]<0 || xyz[2]<0 || fixed_stride<=0){
+                printf("%s: vertex element needs fixed size x, y and z properties\n", filename.c_str());
+                return false;
+            }
+            if(pos + fixed_stride*element.count > end) return truncated(element,0);
+            // Every vertex record is the same size, so we can pull x/y/z straight out of the mapping
+            mesh.vertices.resize(element.count);
+            for(size_t v=0; v<element.count; v++){
+                const char* record = pos + v*fixed_stride;
+                for(int axis=0; axis<3; axis++){
+                    const PlyProperty& property = element.properties[xyz[axis]];
+                    mesh.vertices[v][axis] = read_ply_value<Real>(record + offsets[xyz[axis]], property.type, swap);
+                }
+            }
+            pos += fixed_stride*element.count;
+            continue;
+        }
+
+        if(fixed_stride >= 0){
+            // Some element we do not care about, and it is all fixed size so we can jump over all of it
+            if(pos + fixed_stride*element.count > end) return truncated(element,0);
+            pos += fixed_stride*element.count;
+            continue;
+        }
+
+        // Variable sized records - faces or anything else with a list in it
+        bool is_face = element.name == "face";
+        std::vector<unsigned int> polygon;
+        if(is_face) mesh.indices.reserve(mesh.indices.size() + element.count*3);
+        for(size_t index=0; index<element.count; index++){
+            for(const PlyProperty& property : element.properties){
+                if(!property.is_list){
+                    size_t bytes = ply_type_size(property.type);
+                    if(pos + bytes > end) return truncated(element,index);
+                    pos += bytes;
+                    continue;
+                }
+                size_t count_bytes = ply_type_size(property.count_type);
+                if(pos + count_bytes > end) return truncated(element,index);
+                size_t count = read_ply_value<size_t>(pos, property.count_type, swap);
+                pos += count_bytes;
+                size_t item_bytes = ply_type_size(property.type);
+                if(pos + count*item_bytes > end) return truncated(element,index);
+
+                if(is_face && (property.name=="vertex_indices" || property.name=="vertex_index")){
+                    polygon.resize(count);
+                    for(size_t i=0; i<count; i++){
+                        polygon[i] = read_ply_value<unsigned int>(pos + i*item_bytes, property.type, swap);
+                        if(polygon[i] >= mesh.vertices.size()){
+                            printf("%s: face %lu uses vertex %u but there are only %lu vertices\n", filename.c_str(), index, polygon[i], mesh.vertices.size());
+                            return false;
+                        }
+                    }
+                    add_fan_triangles(mesh.indices,polygon.data(),count);
+                }
+                pos += count*item_bytes;
+            }
+        }
+    }
+    return true;
+}
+
+//===================================================================
+// ASCII PLY
+//===================================================================
+// Walks the whitespace separated numbers of one line of an ASCII file
+struct AsciiLine{
+    const char* pos;
+    const char* end; // the '\n' or end of file
+
+    static bool is_space(char c){ return c==' ' || c=='\t' || c=='\r'; }
+
+    template<typename T>
+    bool next(T& value){
+        while(pos<end && is_space(*pos)) pos++;
+        if(pos<end && *pos=='+') pos++; // from_chars does not take a leading +
+        auto [number_end,error] = std::from_chars(pos,end,value);
+        if(error != std::errc() || (number_end<end && !is_space(*number_end))) return false;
+        pos = number_end;
+        return true;
+    }
+};
+
+// A newline aligned run of records out of one element, parsed by its own thread
+struct AsciiPlyChunk{
+    const char* begin;
+    const char* end;
+    size_t first_record;
+    size_t records;
+    std::vector<unsigned int> indices; // faces only, assembled in chunk order afterwards
+    size_t error_record = 0; // first bad record in this chunk when error is set
+    std::string error;
+};
+
+// Records under this many are not worth another thread
+static constexpr size_t ascii_ply_min_chunk_records = 16384;
+
+// Finds the end of an element's records, noting a chunk boundary every chunk_records lines on the way.
+// Returns nullptr if the file runs out first.
+static const char* split_ascii_element(const char* pos, const char* end, size_t count, std::vector<AsciiPlyChunk>& chunks){
+    size_t max_chunks = std::max(1u,std::thread::hardware_concurrency());
+    size_t chunk_records = std::max(ascii_ply_min_chunk_records, (count + max_chunks-1) / max_chunks);
+    for(size_t record=0; record<count; record++){
+        if(pos >= end) return nullptr;
+        if(record % chunk_records == 0){
+            if(!chunks.empty()) chunks.back().end = pos;
+            chunks.push_back( AsciiPlyChunk{pos, pos, record, std::min(chunk_records, count-record)} );
+        }
+        const char* eol = (const char*)memchr(pos,'\n',end-pos);
+        pos = eol ? eol+1 : end;
+    }
+    if(!chunks.empty()) chunks.back().end = pos;
+    return pos;
+}
+
+// Parses one chunk of vertex or face records. Vertices go straight into their slot in mesh.vertices
+// since every record is one vertex, faces are gathered in the chunk and copied out in order later.
+static void parse_ascii_ply_chunk(AsciiPlyChunk& chunk, const PlyElement& element, const int xyz[3], int face_list, Mesh& mesh, size_t num_vertices){
+    std::vector<unsigned int> polygon;
+    const char* pos = chunk.begin;
+    for(size_t record=0; record<chunk.records; record++){
+        const char* eol = (const char*)memchr(pos,'\n',chunk.end-pos);
+        AsciiLine line{pos, eol ? eol : chunk.end};
+        pos = eol ? eol+1 : chunk.end;
+        auto fail = [&](std::string message){
+            chunk.error_record = chunk.first_record + record;
+            chunk.error = message;
+        };
+
+        for(int p=0; p<(int)element.properties.size(); p++){
+            const PlyProperty& property = element.properties[p];
+            if(!property.is_list){
+                Real value;
+                if(!line.next(value)) return fail("expected a number for " + property.name);
+                for(int axis=0; axis<3; axis++){
+                    if(p == xyz[axis]) mesh.vertices[chunk.first_record + record][axis] = value;
+                }
+                continue;
+            }
+            size_t count;
+            if(!line.next(count)) return fail("expected a list length for " + property.name);
+            polygon.resize(count);
+            for(size_t i=0; i<count; i++){
+                Real value;
+                if(p != face_list){
+                    if(!line.next(value)) return fail("expected " + std::to_string(count) + " items in " + property.name);
+                    continue;
+                }
+                if(!line.next(polygon[i])) return fail("expected " + std::to_string(count) + " vertex indices");
+                if(polygon[i] >= num_vertices)
+                    return fail("face uses vertex " + std::to_string(polygon[i]) + " but there are only " + std::to_string(num_vertices) + " vertices");
+            }
+            if(p == face_list) add_fan_triangles(chunk.indices,polygon.data(),count);
+        }
+    }
+}
+
+static bool load_ascii_ply_body(const char* data, size_t size, const PlyHeader& header, Mesh& mesh, const std::string& filename){
+    const char* pos = data + header.data_offset;
+    const char* end = data + size;
+    size_t first_line = header.header_lines + 1;
+
+    size_t num_vertices = 0;
+    for(const PlyElement& element : header.elements){
+        if(element.name == "vertex") num_vertices = element.count;
+    }
+
+    for(const PlyElement& element : header.elements){
+        int xyz[3] = {-1,-1,-1};
+        int face_list = -1;
+        for(int p=0; p<(int)element.properties.size(); p++){
+            const PlyProperty& property = element.properties[p];
+            if(element.name == "vertex" && !property.is_list){
+                if(property.name=="x") xyz[0]=p;
+                if(property.name=="y") xyz[1]=p;
+                if(property.name=="z") xyz[2]=p;
+            }
+            if(element.name == "face" && property.is_list && (property.name=="vertex_indices" || property.name=="vertex_index")) face_list = p;
+        }
+        if(element.name == "vertex" && (xyz[0]<0 || xyz[1]<0 || xyz[2]<0)){
+            printf("%s: vertex element needs x, y and z properties\n", filename.c_str());
+            return false;
+        }
+
+        std::vector<AsciiPlyChunk> chunks;
+        const char* element_end = split_ascii_element(pos,end,element.count,chunks);
+        if(!element_end){
+            printf("%s: file ends before all %lu %s records\n", filename.c_str(), element.count, element.name.c_str());
+            return false;
+        }
+        pos = element_end;
+        if(element.name != "vertex" && face_list < 0){
+            first_line += element.count;
+            continue; // nothing we need in here
+        }
+
+        if(element.name == "vertex") mesh.vertices.resize(element.count);
+        {
+            std::vector<std::jthread> threads;
+            for(AsciiPlyChunk& chunk : chunks){
+                threads.emplace_back( std::jthread([&](){ parse_ascii_ply_chunk(chunk,element,xyz,face_list,mesh,num_vertices); }) );
+            }
+        } // threads join here
+
+        for(const AsciiPlyChunk& chunk : chunks){
+            if(!chunk.error.empty()){
+                printf("%s:%lu: %s %lu: %s\n", filename.c_str(), first_line + chunk.error_record, element.name.c_str(), chunk.error_record, chunk.error.c_str());
+                return false;
+            }
+        }
+        size_t total = mesh.indices.size();
+        for(const AsciiPlyChunk& chunk : chunks) total += chunk.indices.size();
+        mesh.indices.reserve(total);
+        for(const AsciiPlyChunk& chunk : chunks){
+            mesh.indices.insert(mesh.indices.end(), chunk.indices.begin(), chunk.indices.end());
+        }
+        first_line += element.count;
+    }
+    return true;
+}
+
+//===================================================================
+// OBJ
+//===================================================================
+// OBJ indices count from 1, or back from the newest entry when negative
+static inline bool resolve_obj_index(long index, size_t count, unsigned int& resolved){
+    long absolute = index < 0 ? (long)count + index : index - 1;
+    if(index == 0 || absolute < 0 || absolute >= (long)count) return false;
+    resolved = absolute;
+    return true;
+}
 
-    // Parse the header for the counts of points and triangles
-    std::getline(file,line);
-    while(! line.starts_with("end_header")) {
-        if (line.starts_with("element vertex ")) {
-            line = line.substr(strlen("element vertex "));
-            num_points = std::stod(line);
+// Parts of the face being parsed, kept between lines so their buffers get reused
+struct ObjPolygon{
+    std::vector<unsigned int> vertices, uvs, normals;
+    bool every_corner_has_uv = true;
+    bool every_corner_has_normal = true;
+};
+
+// Parses one "v", "vt", "vn" or "f" line, everything else (groups, materials...) is skipped
+static bool parse_obj_line(const char* pos, const char* end, size_t line_number, Mesh& mesh, ObjPolygon& polygon, const std::string& filename){
+    while(pos<end && AsciiLine::is_space(*pos)) pos++;
+    const char* keyword = pos;
+    while(pos<end && !AsciiLine::is_space(*pos)) pos++;
+    std::string_view type(keyword, pos-keyword);
+    auto fail = [&](const char* message){
+        printf("%s:%lu: %s\n", filename.c_str(), line_number, message);
+        return false;
+    };
+
+    if(type == "v" || type == "vn"){
+        AsciiLine line{pos,end};
+        Real x,y,z;
+        if(!line.next(x) || !line.next(y) || !line.next(z)) return fail("expected 3 coordinates");
+        if(type == "v") mesh.vertices.push_back( Point3{x,y,z} );
+        else mesh.normals.push_back( Vector3{x,y,z} );
+        return true;
+    }
+    if(type == "vt"){
+        AsciiLine line{pos,end};
+        float u,v;
+        if(!line.next(u) || !line.next(v)) return fail("expected 2 texture coordinates");
+        mesh.uvs.push_back( UV{u,v} );
+        return true;
+    }
+    if(type != "f") return true;
+
+    // Each corner is v, v/vt, v/vt/vn or v//vn
+    polygon.vertices.clear();
+    polygon.uvs.clear();
+    polygon.normals.clear();
+    while(true){
+        while(pos<end && AsciiLine::is_space(*pos)) pos++;
+        if(pos >= end) break;
+        long index;
+        auto [index_end,error] = std::from_chars(pos,end,index);
+        if(error != std::errc()) return fail("expected a vertex index");
+        pos = index_end;
+        polygon.vertices.emplace_back();
+        if(!resolve_obj_index(index, mesh.vertices.size(), polygon.vertices.back())) return fail("face uses a vertex that has not been defined");
+
+        bool has_uv = false, has_normal = false;
+        for(int slot=1; slot<=2 && pos<end && *pos=='/'; slot++){
+            pos++;
+            if(pos<end && (*pos=='-' || (*pos>='0' && *pos<='9'))){
+                auto [slot_end,slot_error] = std::from_chars(pos,end,index);
+                if(slot_error != std::errc()) return fail("bad index in face corner");
+                pos = slot_end;
+                if(slot == 1){
+                    polygon.uvs.emplace_back();
+                    if(!resolve_obj_index(index, mesh.uvs.size(), polygon.uvs.back())) return fail("face uses texture coordinates that have not been defined");
+                    has_uv = true;
+                } else {
+                    polygon.normals.emplace_back();
+                    if(!resolve_obj_index(index, mesh.normals.size(), polygon.normals.back())) return fail("face uses a normal that has not been defined");
+                    has_normal = true;
+                }
+            }
+        }
+        if(pos<end && !AsciiLine::is_space(*pos)) return fail("unexpected character in face");
+        polygon.every_corner_has_uv &= has_uv;
+        polygon.every_corner_has_normal &= has_normal;
+    }
+    if(polygon.vertices.size() < 3) return fail("face needs at least 3 vertices");
+    add_fan_triangles(mesh.indices, polygon.vertices.data(), polygon.vertices.size());
+    if(polygon.every_corner_has_uv) add_fan_triangles(mesh.uv_indices, polygon.uvs.data(), polygon.uvs.size());
+    if(polygon.every_corner_has_normal) add_fan_triangles(mesh.normal_indices, polygon.normals.data(), polygon.normals.size());
+    return true;
+}
+
+// Size of each read while streaming an OBJ file, only a line longer than this makes the buffer grow
+static constexpr size_t obj_read_block = 1<<20;
+
+extern bool load_obj_mesh(const std::string& filename, Mesh& mesh){
+    int fd = open(filename.c_str(),O_RDONLY);
+    if(fd<0) return false;
+
+    // Negative indices depend on everything read so far so the file is parsed in order,
+    // one block at a time, instead of being held in memory as a whole
+    std::vector<char> buffer(obj_read_block);
+    ObjPolygon polygon;
+    size_t filled = 0, line_number = 0;
+    bool ok = true, at_end = false;
+    while(ok && !at_end){
+        if(filled == buffer.size()) buffer.resize(buffer.size()*2);
+        ssize_t bytes = read(fd, buffer.data()+filled, buffer.size()-filled);
+        if(bytes < 0){
+            printf("%s: read failed: %s\n", filename.c_str(), strerror(errno));
+            ok = false;
+            break;
         }
-        if (line.starts_with("element face ")) {
-            line = line.substr(strlen("element face "));
-            num_faces = std::stod(line);
+        at_end = bytes == 0;
+        filled += bytes;
+
+        const char* pos = buffer.data();
+        const char* end = pos + filled;
+        while(ok && pos<end){
+            const char* eol = (const char*)memchr(pos,'\n',end-pos);
+            if(!eol && !at_end) break; // partial line, finish it after the next read
+            if(!eol) eol = end;
+            ok = parse_obj_line(pos, eol, ++line_number, mesh, polygon, filename);
+            pos = eol < end ? eol+1 : end;
         }
-        std::getline(file,line);
+        filled = end - pos;
+        memmove(buffer.data(), pos, filled);
     }
+    close(fd);
+    if(!polygon.every_corner_has_uv) mesh.uv_indices.clear();
+    if(!polygon.every_corner_has_normal) mesh.normal_indices.clear();
+    if(!ok) return false;
+
+    printf("%s: %lu points, %lu triangles\n", filename.c_str(), mesh.vertices.size(), mesh.indices.size()/3);
+    return !mesh.indices.empty();
+}
+
+//===================================================================
+// Binary STL
+//===================================================================
+static constexpr size_t stl_header_bytes = 84; // 80 byte comment and the triangle count
+static constexpr size_t stl_record_bytes = 50; // normal, 3 points, 2 byte attribute
+static constexpr size_t stl_min_chunk_triangles = 65536;
 
-    printf("%s: %d points, %d faces\n", filename.c_str(), num_points, num_faces );
+extern bool load_stl_mesh(const std::string& filename, Mesh& mesh){
+    MappedFile file(filename);
+    if(!file.is_open()) return false;
+    if(file.size < stl_header_bytes){
+        printf("%s: too small to be a binary STL file\n", filename.c_str());
+        return false;
+    }
+    const bool swap = std::endian::native != std::endian::little;
+    size_t num_triangles = load_raw<uint32_t>(file.data+80, swap);
+    if(stl_header_bytes + num_triangles*stl_record_bytes > file.size){
+        if(strncmp(file.data,"solid",5) == 0) printf("%s: looks like an ASCII STL file, only binary STL is supported\n", filename.c_str());
+        else printf("%s: file ends before all %lu triangles\n", filename.c_str(), num_triangles);
+        return false;
+    }
+    printf("%s: %lu triangles\n", filename.c_str(), num_triangles);
+
+    // STL does not share points between triangles, so every triangle gets 3 of its own.
+    // Records are all the same size, so each thread can take a range of them.
+    mesh.vertices.resize(num_triangles*3);
+    mesh.indices.resize(num_triangles*3);
+    auto load_range = [&](size_t first, size_t last){
+        for(size_t t=first; t<last; t++){
+            const char* points = file.data + stl_header_bytes + t*stl_record_bytes + 12; // skip the facet normal
+            for(int corner=0; corner<3; corner++){
+                for(int axis=0; axis<3; axis++){
+                    mesh.vertices[t*3+corner][axis] = load_raw<float>(points + corner*12 + axis*4, swap);
+                }
+                mesh.indices[t*3+corner] = t*3+corner;
+            }
+        }
+    };
+    size_t max_threads = std::max(1u,std::thread::hardware_concurrency());
+    size_t chunk = std::max(stl_min_chunk_triangles, (num_triangles + max_threads-1) / max_threads);
+    std::vector<std::jthread> threads;
+    for(size_t first=0; first<num_triangles; first+=chunk){
+        threads.emplace_back( std::jthread(load_range, first, std::min(first+chunk, num_triangles)) );
+    }
+    return num_triangles > 0;
+}
+
+//===================================================================
+// Loading
+//===================================================================
+extern bool load_ply_mesh(const std::string& filename, Mesh& mesh){
+    MappedFile file(filename);
+    if(!file.is_open()) return false;
+
+    PlyHeader header;
+    if(!parse_ply_header(file.data,file.size,header,filename)) return false;
+
+    size_t num_points=0, num_faces=0;
+    for(const PlyElement& element : header.elements){
+        if(element.name == "vertex") num_points = element.count;
+        if(element.name == "face") num_faces = element.count;
+    }
+    printf("%s: %lu points, %lu faces\n", filename.c_str(), num_points, num_faces );
     if (!num_points || !num_faces){
         printf("Not able to parse header correctly\n");
         return false;
     }
 
-    std::vector<Point3> vertexes;
-    vertexes.reserve(num_points);
-    while(num_points){
-        num_points--;
-        double x,y,z;
-        file >> x;
-        file >> y;
-        file >> z;
-        vertexes.push_back( (Point3{x,y,z} * scale) + center );
-        std::getline(file,line); // consume the rest of the line
-    }
-
-    list.objects.reserve(list.objects.size() + num_faces);
-    while(num_faces){
-        num_faces--;
-        int num_points_in_face;
-        file >> num_points_in_face;
-        if (num_points_in_face != 3) {
-            printf("Warning: %d points in a face importing model - currently only triangles are supported\n", num_points_in_face);
-        }
-        unsigned int p1,p2,p3;
-        file >> p1;
-        file >> p2;
-        file >> p3;
-        list.add(
-            std::make_shared<Triangle>(
-                vertexes[p1],
-                vertexes[p2],
-                vertexes[p3],
-                material
-            )
+    if(header.format == PlyFormat::Ascii)
+        return load_ascii_ply_body(file.data,file.size,header,mesh,filename);
+    return load_binary_ply_body(file.data,file.size,header,mesh,filename);
+}
+
+extern void add_mesh_to_list(const Mesh& mesh, HittableList& list, std::shared_ptr<Material> material, double scale, const Point3& center){
+    std::vector<Point3> placed(mesh.vertices.size());
+    for(size_t v=0; v<mesh.vertices.size(); v++){
+        placed[v] = (mesh.vertices[v] * scale) + center;
+    }
+    list.objects.reserve(list.objects.size() + mesh.indices.size()/3);
+    // The triangles go into the list's arena, so they end up next to each other in memory
+    bool has_uvs = mesh.uv_indices.size() == mesh.indices.size();
+    for(size_t i=0; i+2<mesh.indices.size(); i+=3){
+        auto triangle = list.emplace<Triangle>(
+            placed[mesh.indices[i]],
+            placed[mesh.indices[i+1]],
+            placed[mesh.indices[i+2]],
+            material
         );
-        std::getline(file,line); // consume the rest of the line
+        if(has_uvs){
+            for(int corner=0; corner<3; corner++) triangle->uv[corner] = mesh.uvs[mesh.uv_indices[i+corner]];
+        }
     }
+}
+
+extern bool load_mesh(const std::string& filename, Mesh& mesh){
+    std::string extension = filename.substr(std::min(filename.size(), filename.rfind('.')+1));
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c){ return std::tolower(c); });
+    if(extension == "ply") return load_ply_mesh(filename,mesh);
+    if(extension == "obj") return load_obj_mesh(filename,mesh);
+    if(extension == "stl") return load_stl_mesh(filename,mesh);
+    printf("%s: unknown model format\n", filename.c_str());
+    return false;
+}
+
+extern bool load_ply_file(std::string filename, HittableList& list, std::shared_ptr<Material> material, double scale, const Point3& center) {
+    Mesh mesh;
+    if(!load_ply_mesh(filename,mesh)) return false;
+    add_mesh_to_list(mesh,list,material,scale,center);
+    return true;
+}
 
+extern bool load_model_file(std::string filename, HittableList& list, std::shared_ptr<Material> material, double scale, const Point3& center) {
+    Mesh mesh;
+    if(!load_mesh(filename,mesh)) return false;
+    add_mesh_to_list(mesh,list,material,scale,center);
     return true;
-}
\ No newline at end of file
+}
+
+//===================================================================
+// LazyMesh
+//===================================================================
+size_t LazyMesh::default_memory_budget(){
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    if(pages <= 0 || page_size <= 0) return SIZE_MAX;
+    return (size_t)pages * page_size / 2;
+}
+std::atomic<size_t> LazyMesh::memory_budget = LazyMesh::default_memory_budget();
+std::atomic<size_t> LazyMesh::memory_used = 0;
+std::atomic<size_t> LazyMesh::evicted_bytes = 0;
+
+// Every LazyMesh that exists, so eviction can find the coldest ones
+static std::mutex lazy_meshes_mutex;
+static std::vector<const LazyMesh*> lazy_meshes;
+// Evicting a mesh ticks the reclaim epoch and tags the mesh with the new value. Tracing threads copy the epoch
+// at their quiescent points, so once every one of them has copied at least the tag, none can still be inside.
+static std::atomic<unsigned long long> reclaim_epoch = 1;
+struct EvictedMesh{
+    std::shared_ptr<BVHList> mesh;
+    size_t bytes;
+    unsigned long long epoch;
+};
+// Both guarded by lazy_meshes_mutex
+static std::vector<EvictedMesh> evicted_meshes;
+static std::vector<const std::atomic<unsigned long long>*> tracing_threads;
+static thread_local const std::atomic<unsigned long long>* this_thread_seen = nullptr;
+// How long a load waits at most for other threads to move on from evicted meshes when over budget
+static constexpr int max_load_waits = 20; // of 1ms
+
+// Whether an evicted mesh is only held up by other threads, not by a path this thread is still tracing
+static bool others_hold_evicted(){
+    std::lock_guard<std::mutex> guard(lazy_meshes_mutex);
+    unsigned long long own = this_thread_seen ? this_thread_seen->load(std::memory_order_relaxed) : ULLONG_MAX;
+    for(const EvictedMesh& evicted : evicted_meshes){
+        if(evicted.epoch <= own) return true;
+    }
+    return false;
+}
+
+// Bytes of the meshes that are still loaded
+static size_t resident_memory(){
+    size_t used = LazyMesh::memory_used.load();
+    return used - std::min(used, LazyMesh::evicted_bytes.load());
+}
+// Ticks once per load. Hits only store it when it changed, which keeps the per ray cost to a
+// read of a line that is almost never written, and that is all the ordering eviction needs.
+static std::atomic<unsigned long long> load_clock = 1;
+
+LazyMesh::LazyMesh(const std::string& filename, std::shared_ptr<Material> material, double scale, const Point3& center, const BBox& bbox)
+    :filename(filename),material(material),scale(scale),center(center),declared_bbox(bbox){
+    std::lock_guard<std::mutex> guard(lazy_meshes_mutex);
+    lazy_meshes.push_back(this);
+}
+LazyMesh::~LazyMesh(){
+    {
+        std::lock_guard<std::mutex> guard(lazy_meshes_mutex);
+        lazy_meshes.erase(std::find(lazy_meshes.begin(), lazy_meshes.end(), this));
+    }
+    if(owner) memory_used -= resident_bytes;
+}
+
+BBox LazyMesh::bbox()const{
+    return declared_bbox;
+}
+bool LazyMesh::is_loaded()const{
+    return loaded.load(std::memory_order_acquire) != nullptr;
+}
+
+const BVHList* LazyMesh::mesh_for(const Ray& ray, const RealRange& allowed_distance)const{
+    // Only a ray that actually gets into the box is worth loading the mesh for
+    RealRange box_distance = declared_bbox.intersection_distance(ray);
+    if(box_distance.max < box_distance.min || box_distance.max <= allowed_distance.min || box_distance.min >= allowed_distance.max) return nullptr;
+
+    const BVHList* mesh = loaded.load(std::memory_order_acquire);
+    if(!mesh){
+        if(load_failed.load(std::memory_order_relaxed)) return nullptr;
+        mesh = load();
+        if(!mesh) return nullptr;
+    }
+    unsigned long long now = load_clock.load(std::memory_order_relaxed);
+    if(last_used.load(std::memory_order_relaxed) != now) last_used.store(now, std::memory_order_relaxed);
+    return mesh;
+}
+
+bool LazyMesh::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const{
+    // An evicted mesh stays alive in evicted_meshes until free_evicted(), so the pointer outlives this ray
+    const BVHList* mesh = mesh_for(ray,allowed_distance);
+    return mesh && mesh->hit(ray,allowed_distance,rec);
+}
+bool LazyMesh::occluded(const Ray& ray, RealRange allowed_distance)const{
+    const BVHList* mesh = mesh_for(ray,allowed_distance);
+    return mesh && mesh->occluded(ray,allowed_distance);
+}
+
+const BVHList* LazyMesh::load()const{
+    // Over budget with evicted meshes that only wait on other threads to move on, give them the chance first
+    for(int wait=0; wait<max_load_waits && memory_used.load() > memory_budget.load() && evicted_bytes.load(); wait++){
+        free_evicted();
+        if(memory_used.load() <= memory_budget.load() || !others_hold_evicted()) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const BVHList* mesh;
+    {
+        std::lock_guard<std::mutex> guard(load_mutex);
+        // Another thread may have loaded it while we were waiting on the lock
+        mesh = loaded.load(std::memory_order_acquire);
+        if(mesh || load_failed) return mesh;
+
+        Mesh model;
+        if(!load_mesh(filename,model)){
+            printf("%s: could not be loaded, it will be left out\n", filename.c_str());
+            load_failed = true;
+            return nullptr;
+        }
+        HittableList list;
+        add_mesh_to_list(model,list,material,scale,center);
+        BBox actual = list.bbox();
+        if(actual.min.x < declared_bbox.min.x || actual.min.y < declared_bbox.min.y || actual.min.z < declared_bbox.min.z ||
+           actual.max.x > declared_bbox.max.x || actual.max.y > declared_bbox.max.y || actual.max.z > declared_bbox.max.z){
+            printf("Warning: %s is bigger than its declared bbox, parts of it will be missed\n", filename.c_str());
+        }
+        // Rough cost: the triangle and its destructor entry in the list's arena (no control block of its own),
+        // the two shared_ptrs to it (list and BVH leaf) and its lane of a TrianglePack. The Mesh buffers are gone
+        // once this returns.
+        size_t triangles = list.objects.size();
+        resident_bytes = triangles * (sizeof(Triangle) + sizeof(std::pair<void*, void(*)(void*)>) + 2*sizeof(std::shared_ptr<Hittable>) + sizeof(TrianglePack)/PACK_WIDTH);
+        owner = std::make_shared<BVHList>(list.objects);
+        mesh = owner.get();
+
+        last_used = load_clock.fetch_add(1) + 1;
+        memory_used += resident_bytes;
+        loaded.store(mesh, std::memory_order_release);
+    }
+    if(resident_memory() > memory_budget.load()) evict_until_under_budget(this);
+    return mesh;
+}
+
+void LazyMesh::evict_until_under_budget(const LazyMesh* keep){
+    std::vector<const LazyMesh*> coldest;
+    std::lock_guard<std::mutex> guard(lazy_meshes_mutex);
+    for(const LazyMesh* proxy : lazy_meshes){
+        if(proxy != keep && proxy->is_loaded()) coldest.push_back(proxy);
+    }
+    std::sort(coldest.begin(), coldest.end(), [](const LazyMesh* a, const LazyMesh* b){
+        return a->last_used.load(std::memory_order_relaxed) < b->last_used.load(std::memory_order_relaxed);
+    });
+    for(const LazyMesh* proxy : coldest){
+        // Meshes already evicted are on their way out, only what is still loaded has to come under the budget
+        if(resident_memory() <= memory_budget.load()) break;
+        // try_lock so an eviction never waits behind a load in progress
+        std::unique_lock<std::mutex> proxy_guard(proxy->load_mutex, std::try_to_lock);
+        if(!proxy_guard.owns_lock() || !proxy->owner) continue;
+        proxy->loaded.store(nullptr, std::memory_order_release);
+        // Ticked after the store, so a thread that has seen the new epoch can only find nullptr from here on
+        unsigned long long epoch = reclaim_epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+        evicted_meshes.push_back({std::move(proxy->owner), proxy->resident_bytes, epoch});
+        evicted_bytes += proxy->resident_bytes;
+        proxy->owner = nullptr;
+    }
+}
+
+void LazyMesh::free_evicted(){
+    std::vector<EvictedMesh> freed; // destroyed after the registry lock is released
+    std::lock_guard<std::mutex> guard(lazy_meshes_mutex);
+    unsigned long long oldest = ULLONG_MAX;
+    for(const std::atomic<unsigned long long>* seen : tracing_threads)
+        oldest = std::min(oldest, seen->load(std::memory_order_acquire));
+    auto still_used = std::stable_partition(evicted_meshes.begin(), evicted_meshes.end(), [&](const EvictedMesh& evicted){
+        return evicted.epoch > oldest;
+    });
+    for(auto it=still_used; it!=evicted_meshes.end(); it++){
+        evicted_bytes -= it->bytes;
+        memory_used -= it->bytes;
+        freed.push_back(std::move(*it));
+    }
+    evicted_meshes.erase(still_used, evicted_meshes.end());
+}
+
+LazyMesh::TracingThread::TracingThread():seen(reclaim_epoch.load(std::memory_order_acquire)){
+    std::lock_guard<std::mutex> guard(lazy_meshes_mutex);
+    tracing_threads.push_back(&seen);
+    this_thread_seen = &seen;
+}
+LazyMesh::TracingThread::~TracingThread(){
+    {
+        std::lock_guard<std::mutex> guard(lazy_meshes_mutex);
+        tracing_threads.erase(std::find(tracing_threads.begin(), tracing_threads.end(), &seen));
+        if(this_thread_seen == &seen) this_thread_seen = nullptr;
+    }
+    if(evicted_bytes.load(std::memory_order_relaxed)) free_evicted();
+}
+
+void LazyMesh::TracingThread::quiescent(){
+    seen.store(reclaim_epoch.load(std::memory_order_acquire), std::memory_order_release);
+    // Nothing evicted is the usual case, and that costs no more than the two atomics
+    if(evicted_bytes.load(std::memory_order_relaxed)) free_evicted();
+}
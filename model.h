@@ -1,3 +1,87 @@
+#pragma once
+#include <mutex>
 #include "scene.h"
 
-extern bool load_ply_file(std::string filename, HittableList& list, std::shared_ptr<Material> material, double scale, Point3 center);
\ No newline at end of file
+// Vertex and triangle index buffers of a loaded model, before it gets turned into Triangles
+struct Mesh{
+    std::vector<Point3> vertices;
+    std::vector<unsigned int> indices; // 3 per triangle
+    // Vertex normals from OBJ files, Triangle still shades with its face normal
+    std::vector<Vector3> normals;
+    std::vector<unsigned int> normal_indices; // matches indices, left empty unless every face corner has a normal
+    // Texture coordinates from OBJ files, handed on to the Triangles
+    std::vector<UV> uvs;
+    std::vector<unsigned int> uv_indices; // matches indices, left empty unless every face corner has texture coordinates
+};
+
+// Reads an ascii, binary_little_endian or binary_big_endian PLY file into the mesh
+// Faces with more than 3 points are fan triangulated
+extern bool load_ply_mesh(const std::string& filename, Mesh& mesh);
+// Streams a Wavefront OBJ file, reading v, vt, vn and f lines (negative indices allowed, polygons fan triangulated)
+extern bool load_obj_mesh(const std::string& filename, Mesh& mesh);
+// Reads a binary STL file, every triangle gets its own 3 points
+extern bool load_stl_mesh(const std::string& filename, Mesh& mesh);
+// Picks one of the loaders above from the file extension
+extern bool load_mesh(const std::string& filename, Mesh& mesh);
+// Scales and moves every vertex and adds a Triangle for each face of the mesh to the list
+extern void add_mesh_to_list(const Mesh& mesh, HittableList& list, std::shared_ptr<Material> material, double scale, const Point3& center);
+
+extern bool load_ply_file(std::string filename, HittableList& list, std::shared_ptr<Material> material, double scale, const Point3& center);
+// Same as load_ply_file for any format load_mesh knows about
+extern bool load_model_file(std::string filename, HittableList& list, std::shared_ptr<Material> material, double scale, const Point3& center);
+
+// Stands in for a model file that does not get read until a ray first reaches the bbox it was declared with,
+// so scenes can reference more geometry than fits in memory. Loaded meshes count against a budget shared
+// by every LazyMesh and the ones that have gone the longest without a hit get dropped again when it is exceeded.
+// Hits on a loaded mesh only read a plain pointer, only rays that need the same mesh loaded wait on each other.
+// A dropped mesh may still have paths inside it (hit records point at its triangles), so it stays counted against
+// the budget until every TracingThread has passed a quiescent point since it was dropped and it gets freed.
+class LazyMesh:public Hittable{
+    std::string filename;
+    std::shared_ptr<Material> material;
+    double scale;
+    Point3 center;
+    BBox declared_bbox;
+
+    mutable std::atomic<const BVHList*> loaded = nullptr; // what rays read, owner's mesh or nullptr
+    mutable std::shared_ptr<BVHList> owner; // guarded by load_mutex
+    mutable std::mutex load_mutex; // only held while loading or evicting this mesh
+    mutable std::atomic<bool> load_failed = false;
+    mutable std::atomic<unsigned long long> last_used = 0; // load_clock value of the most recent hit
+    mutable size_t resident_bytes = 0; // rough size of the loaded mesh, guarded by load_mutex
+
+    const BVHList* load()const;
+    // The loaded mesh if the ray reaches the bbox (loading it if need be), nullptr otherwise
+    const BVHList* mesh_for(const Ray& ray, const RealRange& allowed_distance)const;
+    static void evict_until_under_budget(const LazyMesh* keep);
+
+    public:
+    // The bbox is in scene space, after scale and center are applied
+    LazyMesh(const std::string& filename, std::shared_ptr<Material> material, double scale, const Point3& center, const BBox& bbox);
+    LazyMesh(const LazyMesh& other) = delete;
+    ~LazyMesh();
+    bool hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const;
+    bool occluded(const Ray& ray, RealRange allowed_distance)const;
+    BBox bbox()const;
+    bool is_loaded()const;
+
+    // Every thread that traces rays through a scene with LazyMeshes in it keeps one of these alive while it does
+    class TracingThread{
+        std::atomic<unsigned long long> seen; // the reclaim epoch at the last quiescent point
+        public:
+        TracingThread();
+        TracingThread(const TracingThread& other) = delete;
+        ~TracingThread();
+        // Between paths, when the thread holds no pointers into any mesh - frees the evicted meshes every
+        // tracing thread has moved on from
+        void quiescent();
+    };
+    // Frees the evicted meshes no TracingThread can still be inside of, all of them when none are alive
+    static void free_evicted();
+
+    // Bytes of geometry all LazyMeshes together try to stay under, defaults to half of physical memory
+    static std::atomic<size_t> memory_budget;
+    static std::atomic<size_t> memory_used; // including evicted meshes that are not freed yet
+    static std::atomic<size_t> evicted_bytes; // the part of memory_used that is waiting to be freed
+    static size_t default_memory_budget();
+};
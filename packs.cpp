@@ -0,0 +1,163 @@
+#include "packs.h"
+
+// Masked reduction of the per lane distances down to the nearest valid lane
+DISPATCH_INLINE static int nearest_lane(const PackMask& valid, const PackReal& t, const RealRange& allowed_distance, Real& distance){
+    PackReal no_hit = PackReal{} + Infinity;
+    PackReal masked_t = valid ? t : no_hit;
+    int best_lane = -1;
+    Real best_t = allowed_distance.max;
+    for(int lane=0; lane<PACK_WIDTH; lane++){
+        if(masked_t[lane] < best_t){
+            best_t = masked_t[lane];
+            best_lane = lane;
+        }
+    }
+    distance = best_t;
+    return best_lane;
+}
+
+//===================================================================
+// TrianglePack
+//===================================================================
+TrianglePack::TrianglePack():
+    p1x{0}, p1y{0}, p1z{0},
+    e1x{0}, e1y{0}, e1z{0},
+    e2x{0}, e2y{0}, e2z{0},
+    det_epsilon{0},
+    source{nullptr}, count(0)
+{}
+
+void TrianglePack::add(const Triangle* tri){
+    Vector3 e1 = tri->p2 - tri->p1;
+    Vector3 e2 = tri->p3 - tri->p1;
+    p1x[count] = tri->p1.x; p1y[count] = tri->p1.y; p1z[count] = tri->p1.z;
+    e1x[count] = e1.x;      e1y[count] = e1.y;      e1z[count] = e1.z;
+    e2x[count] = e2.x;      e2y[count] = e2.y;      e2z[count] = e2.z;
+    det_epsilon[count] = std::numeric_limits<Real>::epsilon()*15.0 * e1.cross(e2).length();
+    source[count] = tri;
+    count++;
+}
+
+bool TrianglePack::full()const{
+    return count >= PACK_WIDTH;
+}
+
+DISPATCH_INLINE int TrianglePack::intersect(const Ray& ray, const RealRange& allowed_distance, Real& distance)const{
+    // https://www.graphics.cornell.edu/pubs/1997/MT97.pdf
+    // Every lane runs the same Moller-Trumbore test with the ray broadcast across the pack
+    const Real dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+
+    // pvec = direction x e2
+    PackReal px = dy*e2z - dz*e2y;
+    PackReal py = dz*e2x - dx*e2z;
+    PackReal pz = dx*e2y - dy*e2x;
+    // A determinant near zero means the ray is parallel with the triangle (or it is a padding lane)
+    PackReal det = e1x*px + e1y*py + e1z*pz;
+    PackMask valid = (det > det_epsilon) | (det < -det_epsilon);
+    PackReal inv_det = 1.0 / det;
+
+    // First barycentric coordinate
+    PackReal tx = ray.origin.x - p1x;
+    PackReal ty = ray.origin.y - p1y;
+    PackReal tz = ray.origin.z - p1z;
+    PackReal u = (tx*px + ty*py + tz*pz) * inv_det;
+    valid &= (u >= 0.0) & (u <= 1.0);
+
+    // Second barycentric coordinate
+    PackReal qx = ty*e1z - tz*e1y;
+    PackReal qy = tz*e1x - tx*e1z;
+    PackReal qz = tx*e1y - ty*e1x;
+    PackReal v = (dx*qx + dy*qy + dz*qz) * inv_det;
+    valid &= (v >= 0.0) & ((u+v) <= 1.0);
+
+    // Distance along the ray, which has to be within the range we are still looking in
+    PackReal t = (e2x*qx + e2y*qy + e2z*qz) * inv_det;
+    valid &= (t > allowed_distance.min) & (t < allowed_distance.max);
+
+    return nearest_lane(valid,t,allowed_distance,distance);
+}
+
+CPU_DISPATCH bool hit_triangle_packs(const std::vector<TrianglePack>& packs, const Ray& ray, RealRange& allowed_distance, HitRecord& rec){
+    const Triangle* best = nullptr;
+    for(const TrianglePack& pack : packs){
+        Real distance;
+        int lane = pack.intersect(ray,allowed_distance,distance);
+        if(lane >= 0){
+            // shrink the far plane so the following packs only look for closer hits
+            allowed_distance.max = distance;
+            best = pack.source[lane];
+        }
+    }
+    if(!best) return false;
+    best->fill_hit_record(ray,allowed_distance.max,rec);
+    return true;
+}
+
+//===================================================================
+// SpherePack
+//===================================================================
+SpherePack::SpherePack():
+    cx{0}, cy{0}, cz{0},
+    radius_squared(PackReal{} - 1.0),
+    source{nullptr}, count(0)
+{}
+
+void SpherePack::add(const Sphere* sphere){
+    cx[count] = sphere->center.x;
+    cy[count] = sphere->center.y;
+    cz[count] = sphere->center.z;
+    radius_squared[count] = sphere->radius * sphere->radius;
+    source[count] = sphere;
+    count++;
+}
+
+bool SpherePack::full()const{
+    return count >= PACK_WIDTH;
+}
+
+DISPATCH_INLINE int SpherePack::intersect(const Ray& ray, const RealRange& allowed_distance, Real& distance)const{
+    // Same quadratic as Sphere::hit, just solved for every lane at once
+    // a is shared by every lane since it only depends on the ray
+    const Real a = ray.direction.length_squared();
+    PackReal ocx = cx - ray.origin.x;
+    PackReal ocy = cy - ray.origin.y;
+    PackReal ocz = cz - ray.origin.z;
+    PackReal h = ray.direction.x*ocx + ray.direction.y*ocy + ray.direction.z*ocz;
+    PackReal c = (ocx*ocx + ocy*ocy + ocz*ocz) - radius_squared;
+    PackReal discriminant = h*h - a*c;
+    PackMask valid = discriminant >= 0.0;
+
+    // Zero out the misses so the square root never sees a negative number
+    PackReal zero = {};
+    discriminant = valid ? discriminant : zero;
+    PackReal sqrtd;
+    for(int lane=0; lane<PACK_WIDTH; lane++){
+        sqrtd[lane] = std::sqrt(discriminant[lane]);
+    }
+
+    // Prefer the near root, and fall back to the far root when we are inside the sphere
+    PackReal inv_a = zero + (Real)(1.0/a);
+    PackReal near_root = (h - sqrtd) * inv_a;
+    PackReal far_root = (h + sqrtd) * inv_a;
+    PackMask near_ok = (near_root > allowed_distance.min) & (near_root < allowed_distance.max);
+    PackMask far_ok = (far_root > allowed_distance.min) & (far_root < allowed_distance.max);
+    PackReal t = near_ok ? near_root : far_root;
+    valid &= near_ok | far_ok;
+
+    return nearest_lane(valid,t,allowed_distance,distance);
+}
+
+CPU_DISPATCH bool hit_sphere_packs(const std::vector<SpherePack>& packs, const Ray& ray, RealRange& allowed_distance, HitRecord& rec){
+    const Sphere* best = nullptr;
+    for(const SpherePack& pack : packs){
+        Real distance;
+        int lane = pack.intersect(ray,allowed_distance,distance);
+        if(lane >= 0){
+            allowed_distance.max = distance;
+            best = pack.source[lane];
+        }
+    }
+    if(!best) return false;
+    best->fill_hit_record(ray,allowed_distance.max,rec);
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "vec_utils.h"
+#include "utils.h"
+#include "shapes.h"
+#include <type_traits>
+
+// Number of primitives that get tested side by side against a single ray, a pack is always 256 bits wide
+// 4 doubles or 8 floats (SINGLE_PRECISION) are one AVX2 register, two SSE registers, or half of an AVX-512 register
+constexpr int PACK_WIDTH = sizeof(double)*4 / sizeof(Real);
+// Comparisons on a PackReal give back a lane mask of integers that are the same size as Real
+using RealMaskLane = std::conditional_t<sizeof(Real)==sizeof(int), int, long long>;
+
+// GCC vector extensions let the compiler pick the widest registers the target has
+// so the same kernel source is lowered to SSE2, AVX2 or AVX-512 depending on the -m flags.
+// Aligned to the whole pack by hand, the baseline target caps vector types at 16 bytes while the AVX clones
+// of the kernels load them with aligned 32 byte moves.
+typedef Real PackReal __attribute__((vector_size(sizeof(Real)*PACK_WIDTH), aligned(sizeof(Real)*PACK_WIDTH)));
+typedef RealMaskLane PackMask __attribute__((vector_size(sizeof(RealMaskLane)*PACK_WIDTH), aligned(sizeof(RealMaskLane)*PACK_WIDTH)));
+
+// Structure of arrays copy of up to PACK_WIDTH triangles that a BVH leaf holds
+// Unused lanes are left as degenerate triangles so they can never report a hit
+class TrianglePack{
+    public:
+    // First vertex and the two edges leaving it - exactly what Moller-Trumbore wants
+    PackReal p1x,p1y,p1z;
+    PackReal e1x,e1y,e1z;
+    PackReal e2x,e2y,e2z;
+    // The determinant is the ray direction against the unscaled normal, so the parallel cutoff scales with the
+    // length of it - the same cutoff Triangle::hit puts on the unit normal, 0 for padding lanes
+    PackReal det_epsilon;
+    // The original triangles, used to fill in the hit record for the winning lane
+    const Triangle* source[PACK_WIDTH];
+    int count;
+
+    TrianglePack();
+    void add(const Triangle* tri);
+    bool full()const;
+    // Returns the lane of the nearest hit within allowed_distance, or -1 if nothing was hit
+    // Only called from the hit_*_packs loops in packs.cpp, which each clone inlines for its instruction set
+    int intersect(const Ray& ray, const RealRange& allowed_distance, Real& distance)const;
+};
+
+// Structure of arrays copy of up to PACK_WIDTH spheres that a BVH leaf holds
+// Unused lanes get a negative squared radius so the discriminant can never be positive
+class SpherePack{
+    public:
+    PackReal cx,cy,cz;
+    PackReal radius_squared;
+    // The original spheres, used to fill in the hit record (and material) for the winning lane
+    const Sphere* source[PACK_WIDTH];
+    int count;
+
+    SpherePack();
+    void add(const Sphere* sphere);
+    bool full()const;
+    // Returns the lane of the nearest hit within allowed_distance, or -1 if nothing was hit
+    // Only called from the hit_*_packs loops in packs.cpp, which each clone inlines for its instruction set
+    int intersect(const Ray& ray, const RealRange& allowed_distance, Real& distance)const;
+};
+
+// Test every pack of a leaf and record the closest hit, shrinking allowed_distance like Hittable::hit does
+bool hit_triangle_packs(const std::vector<TrianglePack>& packs, const Ray& ray, RealRange& allowed_distance, HitRecord& rec);
+bool hit_sphere_packs(const std::vector<SpherePack>& packs, const Ray& ray, RealRange& allowed_distance, HitRecord& rec);
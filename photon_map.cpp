@@ -0,0 +1,46 @@
+#include "photon_map.h"
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+// Splits [0,count) into one chunk per core and runs them, returning once all of them are done
+template<typename ChunkFunction>
+static void for_each_chunk(size_t count, ChunkFunction chunk_function){
+    size_t max_threads = std::max(1u,std::thread::hardware_concurrency());
+    size_t chunk = std::max<size_t>(4096, (count + max_threads-1) / max_threads);
+    std::vector<std::jthread> threads;
+    for(size_t first=0; first<count; first+=chunk){
+        threads.emplace_back( std::jthread(chunk_function, first, std::min(first+chunk, count)) );
+    }
+}
+
+void PhotonMap::build(std::vector<Photon>&& unsorted, Real gather_radius){
+    radius = gather_radius;
+    inverse_cell_size = 1 / (2*gather_radius);
+    size_t buckets = 1024;
+    while(buckets < unsorted.size()) buckets *= 2;
+    mask = buckets-1;
+
+    // Which bucket every photon goes in and how many go in each, then where each bucket starts
+    std::vector<uint32_t> bucket_of(unsorted.size());
+    std::vector<std::atomic<uint32_t>> counts(buckets);
+    for_each_chunk(unsorted.size(), [&](size_t first, size_t last){
+        for(size_t i=first; i<last; i++){
+            const float* p = unsorted[i].position;
+            uint64_t bucket = hash_cell((int64_t)std::floor(p[0]*inverse_cell_size), (int64_t)std::floor(p[1]*inverse_cell_size), (int64_t)std::floor(p[2]*inverse_cell_size)) & mask;
+            bucket_of[i] = (uint32_t)bucket;
+            counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+    cell_start.assign(buckets+1, 0);
+    for(size_t b=0; b<buckets; b++) cell_start[b+1] = cell_start[b] + counts[b].load(std::memory_order_relaxed);
+
+    // counts becomes the next free place in each bucket
+    for(size_t b=0; b<buckets; b++) counts[b].store(cell_start[b], std::memory_order_relaxed);
+    photons.resize(unsorted.size());
+    for_each_chunk(unsorted.size(), [&](size_t first, size_t last){
+        for(size_t i=first; i<last; i++)
+            photons[counts[bucket_of[i]].fetch_add(1, std::memory_order_relaxed)] = unsorted[i];
+    });
+    unsorted.clear();
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include "vec_utils.h"
+#include "image.h"
+
+// Light that reached a diffuse surface by way of glass and mirrors only, where it landed
+struct Photon{
+    float position[3];
+    float direction[3]; // back the way it came
+    float power[3]; // already divided by how many photons the pass traced
+};
+
+// The photons of one pass in a hash grid with cells twice the gather radius wide, so everything within the
+// radius of a point is in the 2x2x2 cells nearest to it. Built by a counting sort spread over every core.
+class PhotonMap{
+    std::vector<Photon> photons; // grouped by cell
+    std::vector<uint32_t> cell_start; // the photons of hashed cell h are cell_start[h] up to cell_start[h+1]
+    uint64_t mask = 0;
+    Real inverse_cell_size = 1;
+
+    static inline uint64_t hash_cell(int64_t x, int64_t y, int64_t z){
+        return (uint64_t)x*73856093u ^ (uint64_t)y*19349663u ^ (uint64_t)z*83492791u;
+    }
+
+    public:
+    Real radius = 0;
+
+    void build(std::vector<Photon>&& photons, Real radius);
+    size_t size()const{ return photons.size(); }
+
+    // Calls visit(photon) for every photon within radius of point
+    template<typename Visit>
+    void gather(const Point3& point, Visit visit)const{
+        if(photons.empty()) return;
+        int64_t base[3];
+        for(int a=0; a<3; a++) base[a] = (int64_t)std::floor(point[a]*inverse_cell_size - (Real)0.5);
+        // Two of the cells can hash to the same bucket, which must only be looked through once
+        uint64_t seen[8];
+        int seen_count = 0;
+        float radius_squared = (float)(radius*radius);
+        for(int corner=0; corner<8; corner++){
+            uint64_t bucket = hash_cell(base[0] + (corner&1), base[1] + ((corner>>1)&1), base[2] + (corner>>2)) & mask;
+            bool repeat = false;
+            for(int s=0; s<seen_count; s++) repeat |= seen[s] == bucket;
+            if(repeat) continue;
+            seen[seen_count++] = bucket;
+            for(uint32_t i=cell_start[bucket]; i<cell_start[bucket+1]; i++){
+                const Photon& photon = photons[i];
+                float dx = photon.position[0] - (float)point.x, dy = photon.position[1] - (float)point.y, dz = photon.position[2] - (float)point.z;
+                if(dx*dx + dy*dy + dz*dz < radius_squared) visit(photon);
+            }
+        }
+    }
+};
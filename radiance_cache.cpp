@@ -0,0 +1,96 @@
+#include "radiance_cache.h"
+#include <cmath>
+#include <algorithm>
+
+static constexpr int max_probes = 16; // cells looked at past the hashed one before giving up
+
+static inline uint64_t hash64(uint64_t x){
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+void RadianceCache::reset(const Point3& camera_origin, Real camera_pixel_angle){
+    camera = camera_origin;
+    pixel_angle = camera_pixel_angle;
+    size_t count = size_t(1) << size_bits;
+    if(!cells || mask != count-1){
+        cells.reset(new Cell[count]);
+        mask = count-1;
+    }
+    for(size_t i=0; i<count; i++){
+        cells[i].key.store(0, std::memory_order_relaxed);
+        for(auto& channel : cells[i].radiance) channel.store(0.0f, std::memory_order_relaxed);
+        cells[i].count.store(0, std::memory_order_relaxed);
+    }
+    used = 0;
+}
+
+int RadianceCache::level_for(const Point3& point)const{
+    double distance = std::sqrt((double)(point - camera).length_squared());
+    double size = std::max(1e-6, distance * pixel_angle * cell_pixels);
+    return std::clamp((int)std::ceil(std::log2(size)), -31, 31);
+}
+
+// Position in cells of the level's size, the level itself, and which way the surface faces (by its largest
+// axis) so the two sides of a thin wall do not share a cell
+uint64_t RadianceCache::key_for(const Point3& point, const Vector3& normal, int level)const{
+    double inverse_size = std::ldexp(1.0, -level);
+    auto cell_coordinate = [&](Real value){ return (uint64_t)(int64_t)std::floor(value*inverse_size) & 0x1ffff; };
+
+    int axis = 0;
+    if(std::fabs(normal.y) > std::fabs(normal[axis])) axis = 1;
+    if(std::fabs(normal.z) > std::fabs(normal[axis])) axis = 2;
+    uint64_t facing = axis*2 + (normal[axis] < 0 ? 1 : 0);
+
+    uint64_t key = cell_coordinate(point.x) | (cell_coordinate(point.y) << 17) | (cell_coordinate(point.z) << 34);
+    key |= (uint64_t)(level + 32) << 51;
+    key |= facing << 57;
+    return key | (1ull << 63); // never 0, which marks a free cell
+}
+
+RadianceCache::Cell* RadianceCache::insert(const Point3& point, const Vector3& normal){
+    uint64_t key = key_for(point,normal,level_for(point));
+    uint64_t slot = hash64(key);
+    for(int probe=0; probe<max_probes; probe++){
+        Cell& cell = cells[(slot + probe) & mask];
+        uint64_t found = cell.key.load(std::memory_order_acquire);
+        if(found == key) return &cell;
+        if(found == 0){
+            // Another thread may claim it first, which is only a problem if it was for a different cell
+            if(cell.key.compare_exchange_strong(found, key, std::memory_order_acq_rel)){
+                used.fetch_add(1, std::memory_order_relaxed);
+                return &cell;
+            }
+            if(found == key) return &cell;
+        }
+    }
+    return nullptr;
+}
+
+bool RadianceCache::lookup(const Point3& point, const Vector3& normal, Real footprint, Color& radiance)const{
+    int level = level_for(point);
+    if(footprint < std::ldexp(1.0, level)) return false;
+    uint64_t key = key_for(point,normal,level);
+    uint64_t slot = hash64(key);
+    for(int probe=0; probe<max_probes; probe++){
+        const Cell& cell = cells[(slot + probe) & mask];
+        uint64_t found = cell.key.load(std::memory_order_acquire);
+        if(found == 0) return false;
+        if(found != key) continue;
+        uint32_t count = cell.count.load(std::memory_order_relaxed);
+        if(count < (uint32_t)min_samples) return false;
+        radiance = Color{cell.radiance[0].load(std::memory_order_relaxed), cell.radiance[1].load(std::memory_order_relaxed), cell.radiance[2].load(std::memory_order_relaxed)} / (Real)count;
+        return true;
+    }
+    return false;
+}
+
+void RadianceCache::add(Cell* cell, const Color& radiance){
+    for(int c=0; c<3; c++) cell->radiance[c].fetch_add((float)radiance[c], std::memory_order_relaxed);
+    cell->count.fetch_add(1, std::memory_order_relaxed);
+}
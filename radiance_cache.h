@@ -0,0 +1,51 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include "vec_utils.h"
+#include "image.h"
+
+// Light leaving surfaces (everything but their own emission), averaged over cells of a hash grid in world space.
+// A few cheap passes of full paths fill it in before the frame, then the frame's paths stop at the first diffuse
+// bounce past a given depth and take the cell's average instead of tracing on. Cells grow with the distance
+// from the camera so they always cover about the same number of pixels, and a path only stops at one when its
+// own cone is already wider than the cell there, so the blur of the cell stays under the blur of the bounce.
+// Cells are claimed with a compare and swap and added to with atomic adds, so filling it never locks.
+class RadianceCache{
+    public:
+    struct Cell{
+        std::atomic<uint64_t> key; // 0 for a free cell
+        std::atomic<float> radiance[3]; // sums, divided by count when read
+        std::atomic<uint32_t> count;
+    };
+
+    // Bias against speed: larger cells and fewer samples per cell are quicker to fill but blurrier
+    double cell_pixels = 8.0; // how many pixels wide a cell is at its distance from the camera
+    int min_samples = 4; // a cell with fewer than this is passed over and the path traces on as usual
+    int fill_passes = 2; // of one sample per pixel each
+    // Cells hold the light leaving a surface whichever way it is seen from, which only holds for rough ones,
+    // glossy surfaces below this roughness are never filled in or stopped at
+    double min_roughness = 0.5;
+    unsigned int size_bits = 20; // 2^20 cells
+
+    private:
+    std::unique_ptr<Cell[]> cells;
+    uint64_t mask = 0;
+    std::atomic<uint32_t> used = 0;
+    Point3 camera;
+    Real pixel_angle = 0;
+
+    int level_for(const Point3& point)const; // cells are 2^level wide
+    uint64_t key_for(const Point3& point, const Vector3& normal, int level)const;
+
+    public:
+    // Empties the cache for a frame seen from camera, allocating it the first time
+    void reset(const Point3& camera, Real pixel_angle);
+    // The cell for a point (claiming a free one), nullptr when its neighbourhood of the table is full
+    Cell* insert(const Point3& point, const Vector3& normal);
+    // Average light leaving the point, false when its cell is missing, has too few samples yet or is wider
+    // than the footprint of the path arriving there
+    bool lookup(const Point3& point, const Vector3& normal, Real footprint, Color& radiance)const;
+    static void add(Cell* cell, const Color& radiance);
+    uint32_t cells_used()const{ return used.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,253 @@
+#include "sampler.h"
+#include <vector>
+#include <random>
+
+thread_local Sampler* current_sampler = nullptr;
+
+//===================================================================
+// Hashing and Sobol points
+//===================================================================
+static inline uint32_t hash32(uint32_t x){
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+static inline uint32_t hash_combine(uint32_t seed, uint32_t value){
+    return hash32(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+static inline uint32_t reverse_bits(uint32_t x){
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Burley 2020 "Practical Hash-based Owen Scrambling" - the Laine-Karras hash flips each bit depending only on
+// the bits below it, which done on the reversed bits is an Owen scramble: a random but still stratified shuffle
+static inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed){
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+static inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed){
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// The first two Sobol dimensions, which together are stratified in every power of two sized block of points
+static inline uint32_t sobol_first(uint32_t index){
+    return reverse_bits(index);
+}
+static inline uint32_t sobol_second(uint32_t index){
+    uint32_t result = 0, direction = 0x80000000u;
+    for(; index; index >>= 1){
+        if(index & 1) result ^= direction;
+        direction ^= direction >> 1;
+    }
+    return result;
+}
+
+// Top 24 bits so it stays below 1 in float too
+static inline Real to_unit(uint32_t x){
+    return Real(x >> 8) * Real(1.0/(1u << 24));
+}
+
+// Sobol points in 1 or 2 dimensions with both the order of the points and the points themselves scrambled by seed.
+// Shuffling the order per seed is what keeps one dimension from lining up with the next.
+static inline uint32_t scrambled_sobol_1d(uint32_t index, uint32_t seed){
+    index = nested_uniform_scramble(index, seed);
+    return nested_uniform_scramble(sobol_first(index), hash_combine(seed,0));
+}
+static inline void scrambled_sobol_2d(uint32_t index, uint32_t seed, uint32_t& x, uint32_t& y){
+    index = nested_uniform_scramble(index, seed);
+    x = nested_uniform_scramble(sobol_first(index), hash_combine(seed,0));
+    y = nested_uniform_scramble(sobol_second(index), hash_combine(seed,1));
+}
+
+//===================================================================
+// Independent
+//===================================================================
+class IndependentSampler:public Sampler{
+    public:
+    Real get_1d()override{ return random_percentage_distribution(gen); }
+    void get_2d(Real& u, Real& v)override{
+        u = random_percentage_distribution(gen);
+        v = random_percentage_distribution(gen);
+    }
+};
+
+//===================================================================
+// Sobol
+//===================================================================
+// Every pair of dimensions uses the same two Sobol dimensions with a scramble of its own (padding), since past
+// the first few the higher Sobol dimensions have poor 2D projections. The pixel is part of the seed so
+// neighbouring pixels do not share their noise.
+class SobolSampler:public Sampler{
+    uint32_t pixel_seed = 0;
+
+    uint32_t next_seed(uint32_t count){
+        uint32_t seed = hash_combine(hash_combine(pixel_seed, dimension), stream);
+        dimension += count;
+        return seed;
+    }
+
+    protected:
+    void start_pixel()override{
+        pixel_seed = hash_combine(hash32(pixel_x), pixel_y);
+    }
+
+    public:
+    Real get_1d()override{
+        return to_unit(scrambled_sobol_1d(index, next_seed(1)));
+    }
+    void get_2d(Real& u, Real& v)override{
+        uint32_t x,y;
+        scrambled_sobol_2d(index, next_seed(2), x, y);
+        u = to_unit(x);
+        v = to_unit(y);
+    }
+};
+
+//===================================================================
+// Blue noise
+//===================================================================
+static constexpr int blue_noise_size = 64; // power of two
+
+// Ulichney's void and cluster method - each pixel ranked by when it got filled in, always the one furthest away
+// from everything filled before it. Thresholding at any rank leaves evenly spread pixels with no low frequencies.
+static std::vector<uint16_t> make_blue_noise_mask(){
+    constexpr int size = blue_noise_size, count = size*size, wrap = size-1;
+    constexpr double sigma = 1.5;
+    // How much a filled pixel crowds every other one, wrapping around the edges so the mask tiles
+    std::vector<double> kernel(count);
+    for(int y=0; y<size; y++){
+        for(int x=0; x<size; x++){
+            int dx = std::min(x, size-x), dy = std::min(y, size-y);
+            kernel[y*size + x] = std::exp(-(dx*dx + dy*dy) / (2.0*sigma*sigma));
+        }
+    }
+    std::vector<double> energy(count, 0.0);
+    std::vector<char> filled(count, 0);
+    auto set = [&](int pixel, bool fill){
+        int px = pixel % size, py = pixel / size;
+        double sign = fill ? 1.0 : -1.0;
+        for(int y=0; y<size; y++)
+            for(int x=0; x<size; x++)
+                energy[y*size + x] += sign * kernel[((y-py) & wrap)*size + ((x-px) & wrap)];
+        filled[pixel] = fill;
+    };
+    auto tightest_cluster = [&](){
+        int best = -1;
+        for(int p=0; p<count; p++) if(filled[p] && (best < 0 || energy[p] > energy[best])) best = p;
+        return best;
+    };
+    auto largest_void = [&](){
+        int best = -1;
+        for(int p=0; p<count; p++) if(!filled[p] && (best < 0 || energy[p] < energy[best])) best = p;
+        return best;
+    };
+
+    // A tenth of the pixels at random, then the most crowded one moved to the emptiest spot until it settles
+    std::mt19937 random(blue_noise_size);
+    int initial = count / 10;
+    for(int placed=0; placed<initial;){
+        int pixel = random() % count;
+        if(filled[pixel]) continue;
+        set(pixel,true);
+        placed++;
+    }
+    for(int moves=0; moves<count; moves++){
+        int cluster = tightest_cluster();
+        set(cluster,false);
+        int hole = largest_void();
+        set(hole,true);
+        if(hole == cluster) break;
+    }
+
+    std::vector<uint16_t> rank(count);
+    std::vector<double> initial_energy = energy;
+    std::vector<char> initial_filled = filled;
+    // Ranks below the starting pattern by taking its clusters away, then the rest by filling voids
+    for(int r=initial-1; r>=0; r--){
+        int cluster = tightest_cluster();
+        set(cluster,false);
+        rank[cluster] = r;
+    }
+    energy = initial_energy;
+    filled = initial_filled;
+    for(int r=initial; r<count; r++){
+        int hole = largest_void();
+        set(hole,true);
+        rank[hole] = r;
+    }
+    return rank;
+}
+
+// The same Sobol points in every pixel (scrambled per dimension only), each pixel shifting them around the unit
+// square by its value in the mask (Cranley-Patterson rotation). A pixel's samples stay just as well spread,
+// while neighbouring pixels get shifts far apart from each other so their errors cancel out when seen together.
+class BlueNoiseSampler:public Sampler{
+    const std::vector<uint16_t>& mask;
+
+    Real mask_value(uint32_t seed, int offset)const{
+        uint32_t shift = hash_combine(seed, offset);
+        int x = (pixel_x + (shift & 0xffff)) & (blue_noise_size-1);
+        int y = (pixel_y + (shift >> 16)) & (blue_noise_size-1);
+        return (mask[y*blue_noise_size + x] + Real(0.5)) / (blue_noise_size*blue_noise_size);
+    }
+    static Real rotate(Real value, Real shift){
+        value += shift;
+        return value >= 1 ? value - 1 : value;
+    }
+    uint32_t next_seed(uint32_t count){
+        uint32_t seed = hash_combine(hash32(dimension), stream);
+        dimension += count;
+        return seed;
+    }
+
+    public:
+    BlueNoiseSampler():mask(blue_noise_mask()){}
+    static const std::vector<uint16_t>& blue_noise_mask(){
+        static const std::vector<uint16_t> mask = make_blue_noise_mask();
+        return mask;
+    }
+
+    Real get_1d()override{
+        uint32_t seed = next_seed(1);
+        return rotate(to_unit(scrambled_sobol_1d(index, seed)), mask_value(seed,0));
+    }
+    void get_2d(Real& u, Real& v)override{
+        uint32_t seed = next_seed(2);
+        uint32_t x,y;
+        scrambled_sobol_2d(index, seed, x, y);
+        u = rotate(to_unit(x), mask_value(seed,0));
+        v = rotate(to_unit(y), mask_value(seed,1));
+    }
+};
+
+//===================================================================
+// Choosing one
+//===================================================================
+std::unique_ptr<Sampler> make_sampler(SamplerType type){
+    switch(type){
+        case SamplerType::Independent: return std::make_unique<IndependentSampler>();
+        case SamplerType::Sobol: return std::make_unique<SobolSampler>();
+        case SamplerType::BlueNoise: return std::make_unique<BlueNoiseSampler>();
+    }
+    return nullptr;
+}
+
+bool parse_sampler_type(const std::string& name, SamplerType& type){
+    if(name == "independent") type = SamplerType::Independent;
+    else if(name == "sobol") type = SamplerType::Sobol;
+    else if(name == "blue_noise") type = SamplerType::BlueNoise;
+    else return false;
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "utils.h"
+
+// Where the random numbers of a render come from. Every sample of a pixel asks for the same dimensions in the
+// same order (the camera sets the dimension at the start of each bounce), so samplers that spread their points
+// out evenly per dimension give the pixel fewer clumps and gaps, and it converges with fewer samples than
+// independent random numbers would take.
+class Sampler{
+    protected:
+    int pixel_x = 0, pixel_y = 0;
+    uint32_t index = 0; // of the sample within the pixel
+    uint32_t dimension = 0;
+    uint32_t stream = 0; // paths split off from the first one draw from streams of their own
+
+    public:
+    virtual ~Sampler() = default;
+    void start_pixel_sample(int x, int y, int sample_index){
+        pixel_x = x;
+        pixel_y = y;
+        index = sample_index;
+        dimension = 0;
+        stream = 0;
+        start_pixel();
+    }
+    void start_dimension(uint32_t first_dimension, uint32_t path_stream){
+        dimension = first_dimension;
+        stream = path_stream;
+    }
+    virtual Real get_1d() = 0;
+    virtual void get_2d(Real& u, Real& v) = 0;
+
+    protected:
+    virtual void start_pixel(){}
+};
+
+enum class SamplerType{
+    Independent, // the global generator, same as before there were samplers
+    Sobol, // Owen scrambled Sobol points, padded two dimensions at a time
+    BlueNoise, // the same Sobol points for every pixel, shifted by a blue noise mask so the error left over looks like fine grain
+};
+std::unique_ptr<Sampler> make_sampler(SamplerType type);
+// "independent", "sobol" or "blue_noise", false for anything else
+bool parse_sampler_type(const std::string& name, SamplerType& type);
+
+// The sampler the render running on this thread draws from, nullptr outside of a render
+extern thread_local Sampler* current_sampler;
+
+// Every sampling decision of a path goes through these, falling back on the global generator outside of a render
+inline Real sample_1d(){
+    if(current_sampler) return current_sampler->get_1d();
+    return random_percentage_distribution(gen);
+}
+inline void sample_2d(Real& u, Real& v){
+    if(current_sampler) return current_sampler->get_2d(u,v);
+    u = random_percentage_distribution(gen);
+    v = random_percentage_distribution(gen);
+}
+inline void sample_dimension(uint32_t first_dimension, uint32_t path_stream = 0){
+    if(current_sampler) current_sampler->start_dimension(first_dimension,path_stream);
+}
@@ -1,5 +1,7 @@
 #include "scene.h"
 #include <utility>
+#include <algorithm>
+#include <atomic>
 
 using std::shared_ptr;
 using std::make_shared;
@@ -11,12 +13,23 @@ bool HittableList::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& r
     }
     return found_hit;
 }
+bool HittableList::occluded(const Ray& ray, RealRange allowed_distance)const{
+    for(const auto& obj : objects){
+        if(obj->occluded(ray,allowed_distance)) return true;
+    }
+    return false;
+}
 
 void HittableList::add(shared_ptr<Hittable> object){
     objects.push_back(object);
 }
 void HittableList::clear(){
     objects.clear();
+    arena = nullptr; // objects still referenced elsewhere keep the old arena alive
+}
+SceneArena& HittableList::storage(){
+    if(!arena) arena = SceneArena::create();
+    return *arena;
 }
 
 BBox HittableList::bbox()const{
@@ -38,8 +51,27 @@ BBox HittableList::bbox()const{
 //===================================================================
 // BVHList
 //===================================================================
+#ifdef BVH_STATS
+std::atomic<unsigned long long> BVHList::nodes_visited = 0;
+std::atomic<unsigned long long> BVHList::rays_traversed = 0;
+#endif
+
 BVHList::BVHList(ObjList& world_objects,int max_depth)
 : max_depth_allowed(max_depth), objects(world_objects) {
+    // Unbounded objects like infinite planes would blow the bounds of every node up to infinity
+    // Only the root ever sees them - it keeps them to the side and checks them before walking the tree
+    auto unbounded_begin = std::stable_partition(objects.begin(), objects.end(), [](const std::shared_ptr<Hittable>& obj){ return obj->bbox().is_finite(); });
+    unbounded_objects.assign(unbounded_begin, objects.end());
+    objects.erase(unbounded_begin, objects.end());
+    build();
+}
+
+BVHList::BVHList(int max_depth, ObjList&& bounded_objects)
+: max_depth_allowed(max_depth), objects(std::move(bounded_objects)) {
+    build();
+}
+
+void BVHList::build(){
     if(max_depth_allowed<=0 || objects.size() <= 1){
         // Recursion end case of max depth or only a single object
         // this should be the only case where left or right are null
@@ -52,6 +84,7 @@ BVHList::BVHList(ObjList& world_objects,int max_depth)
             if(objects.size()>4) {
                 printf("BVH: Warning: Leaf made with %lu objects\n    consider increasing max depth\n", objects.size());
             }
+            pack_leaf_objects();
         } else {
             // Make sure the bounding box is zero size to try to never have it get hit when we have no objects to hold
             memoized_bbox.max = memoized_bbox.min = {0.0,0.0,0.0};
@@ -89,22 +122,53 @@ BVHList::BVHList(ObjList& world_objects,int max_depth)
         // Check if we have something that doesn't make sense to break up or if we should continue recursing down
         if (left_objects.size() == 0 || right_objects.size() == 0 || split_size >= (objects.size()/4.0) * memoized_bbox.half_surface_area()) {
             // No subdivision happened or the split cost is more than not splitting at all so we are a leaf
-            // The objects are already assigned to our object so nothing left to do for it
+            // The objects are already assigned to our object so we only need to pack them up
             left = right = nullptr;
+            pack_leaf_objects();
         } else {
             objects.clear(); // no reason to hold onto the objects list since we will never check them
-            left = new BVHList(left_objects,max_depth-1);
-            right = new BVHList(right_objects,max_depth-1);
+            left = new BVHList(max_depth_allowed-1,std::move(left_objects));
+            right = new BVHList(max_depth_allowed-1,std::move(right_objects));
         }
     }
 }
 
+// Copy a run of objects that are all of the same shape into as few packs as possible
+template<typename Shape, typename Pack>
+static void fill_packs(ObjList::const_iterator begin, ObjList::const_iterator end, std::vector<Pack>& packs){
+    packs.clear();
+    packs.reserve(((end - begin) + PACK_WIDTH - 1) / PACK_WIDTH);
+    for(auto it=begin; it!=end; it++){
+        if(packs.empty() || packs.back().full()){
+            packs.emplace_back();
+        }
+        packs.back().add(static_cast<const Shape*>(it->get()));
+    }
+}
+
+void BVHList::pack_leaf_objects(){
+    // Move every triangle and then every sphere to the front of the list and copy them into packs
+    // Anything else stays behind first_unpacked and goes through its own virtual hit()
+    auto is_triangle = [](const std::shared_ptr<Hittable>& obj){ return dynamic_cast<const Triangle*>(obj.get()) != nullptr; };
+    auto is_sphere = [](const std::shared_ptr<Hittable>& obj){ return dynamic_cast<const Sphere*>(obj.get()) != nullptr; };
+    auto spheres_begin = std::stable_partition(objects.begin(), objects.end(), is_triangle);
+    auto unpacked_begin = std::stable_partition(spheres_begin, objects.end(), is_sphere);
+    first_unpacked = unpacked_begin - objects.begin();
+
+    fill_packs<Triangle>(objects.begin(), spheres_begin, triangle_packs);
+    fill_packs<Sphere>(spheres_begin, unpacked_begin, sphere_packs);
+}
+
 BVHList::~BVHList(){
     if(left) delete left;
     if(right) delete right;
 }
 
 BBox BVHList::bbox()const{
+    if(!unbounded_objects.empty()) return {{-Infinity,-Infinity,-Infinity}, {Infinity,Infinity,Infinity}};
+    return memoized_bbox;
+}
+BBox BVHList::bounded_bbox()const{
     return memoized_bbox;
 }
 
@@ -151,8 +215,13 @@ std::pair<ObjList, ObjList> BVHList::minimal_surface_area_split(ObjList& dividin
 
 
 bool BVHList::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const{
+    // Virtual functions cannot be cloned per instruction set, so hand off to the static kernel that is
+    return traverse(*this,ray,allowed_distance,rec);
+}
+
+CPU_DISPATCH bool BVHList::traverse(const BVHList& root, const Ray& ray, RealRange& allowed_distance, HitRecord& rec){
     std::vector<std::pair<const BVHList*,RealRange>> stack;
-    stack.reserve(this->max_depth_allowed *2 +2);
+    stack.reserve(root.max_depth_allowed *2 +2);
     // Convenient lambda to check if a given intersection distance range is actaully a hit (as a bool)
     // Captures the allowed_distance which is modified in place by per-object hits
     auto hits_aabb_dists = [&allowed_distance](RealRange& int_dists){
@@ -162,13 +231,22 @@ bool BVHList::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)co
             int_dists.min < allowed_distance.max;
     };
 
+    // The unbounded objects go first - a ground plane hit shrinks allowed_distance which then
+    // lets us skip every node that is behind it
+    bool found_hit = false;
+    for(const auto& obj : root.unbounded_objects){
+        found_hit |= obj->hit(ray,allowed_distance,rec);
+    }
+
     // lets get the stack set up by adding in ourselves and then start walking down the tree
     stack.push_back({
-        this,
-        memoized_bbox.intersection_distance(ray),
+        &root,
+        root.memoized_bbox.intersection_distance(ray),
     });
 
-    bool found_hit = false;
+#ifdef BVH_STATS
+    unsigned long long visited = 0;
+#endif
     while(!stack.empty()) {
         const BVHList* next_to_check;
         RealRange int_dists;
@@ -179,10 +257,15 @@ bool BVHList::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)co
             //missed the box - try the next in the stack
             continue;
         }
+#ifdef BVH_STATS
+        visited++;
+#endif
 
         // Check if it is a leaf node and search its objects
         if (next_to_check->isLeaf()) {
-            for(int x = 0; x < next_to_check->objects.size(); x++){
+            found_hit |= hit_triangle_packs(next_to_check->triangle_packs,ray,allowed_distance,rec);
+            found_hit |= hit_sphere_packs(next_to_check->sphere_packs,ray,allowed_distance,rec);
+            for(size_t x = next_to_check->first_unpacked; x < next_to_check->objects.size(); x++){
                 found_hit |= next_to_check->objects[x]->hit(ray,allowed_distance,rec);
             }
             // Go to the next item in the stack - this leaf has no children to add to the stack
@@ -211,9 +294,59 @@ bool BVHList::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)co
             }
         }
     }
+#ifdef BVH_STATS
+    nodes_visited.fetch_add(visited,std::memory_order_relaxed);
+    rays_traversed.fetch_add(1,std::memory_order_relaxed);
+#endif
     return found_hit;
 }
 
+bool BVHList::occluded(const Ray& ray, RealRange allowed_distance)const{
+    return traverse_occluded(*this,ray,allowed_distance);
+}
+
+// Same walk as traverse, but any hit at all is the answer so it returns as soon as it finds one
+// instead of narrowing allowed_distance down to the closest
+CPU_DISPATCH bool BVHList::traverse_occluded(const BVHList& root, const Ray& ray, RealRange allowed_distance){
+    for(const auto& obj : root.unbounded_objects){
+        if(obj->occluded(ray,allowed_distance)) return true;
+    }
+
+    std::vector<const BVHList*> stack;
+    stack.reserve(root.max_depth_allowed *2 +2);
+    auto hits_aabb = [&allowed_distance,&ray](const BVHList* node){
+        RealRange int_dists = node->memoized_bbox.intersection_distance(ray);
+        return
+            int_dists.max >= int_dists.min &&
+            int_dists.max > allowed_distance.min &&
+            int_dists.min < allowed_distance.max;
+    };
+    if(hits_aabb(&root)) stack.push_back(&root);
+
+    // The pack kernels want a record to fill in, it just gets thrown away
+    HitRecord scratch;
+    while(!stack.empty()) {
+        const BVHList* next_to_check = stack.back();
+        stack.pop_back();
+
+        if (next_to_check->isLeaf()) {
+            // The pack kernels shrink the range they are given, so each gets its own copy
+            RealRange triangle_range = allowed_distance;
+            if(hit_triangle_packs(next_to_check->triangle_packs,ray,triangle_range,scratch)) return true;
+            RealRange sphere_range = allowed_distance;
+            if(hit_sphere_packs(next_to_check->sphere_packs,ray,sphere_range,scratch)) return true;
+            for(size_t x = next_to_check->first_unpacked; x < next_to_check->objects.size(); x++){
+                if(next_to_check->objects[x]->occluded(ray,allowed_distance)) return true;
+            }
+            continue;
+        }
+        // No point ordering the children by distance, any blocker will do
+        if(hits_aabb(next_to_check->right)) stack.push_back(next_to_check->right);
+        if(hits_aabb(next_to_check->left)) stack.push_back(next_to_check->left);
+    }
+    return false;
+}
+
 bool BVHList::isLeaf()const{
     // We can assume that leaf nodes will have no neighbor in left or right, and non-leaf nodes will have
     // both left and right due to how the constructor works.
@@ -1,7 +1,10 @@
 #pragma once
 #include <vector>
 #include <memory>
+#include <atomic>
 #include "shapes.h"
+#include "packs.h"
+#include "arena.h"
 #include "utils.h"
 
 using ObjList = std::vector<std::shared_ptr<Hittable>>;
@@ -9,26 +12,61 @@ using ObjList = std::vector<std::shared_ptr<Hittable>>;
 class HittableList:public Hittable{
     public:
     ObjList objects;
+    // Where emplace puts objects, made on first use. Anything else that should live as long as the scene can be
+    // made from storage() too, as long as no object in it keeps a shared_ptr to it (see SceneArena)
+    std::shared_ptr<SceneArena> arena;
     bool hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const;
+    bool occluded(const Ray& ray, RealRange allowed_distance)const;
     void add(std::shared_ptr<Hittable> object);
     void clear();
     BBox bbox()const;
+
+    SceneArena& storage();
+    // Builds the object in the arena and adds it
+    template<typename T, typename... Args>
+    std::shared_ptr<T> emplace(Args&&... args){
+        std::shared_ptr<T> object = storage().make<T>(std::forward<Args>(args)...);
+        objects.push_back(object);
+        return object;
+    }
 };
 
 class BVHList:public Hittable{
     protected:
     BVHList *left, *right;
     ObjList objects;
+    // Leaf triangles and spheres get copied into SIMD packs and moved to the front of objects
+    // objects still owns them, but only the ones from first_unpacked onwards get tested one at a time
+    std::vector<TrianglePack> triangle_packs;
+    std::vector<SpherePack> sphere_packs;
+    size_t first_unpacked = 0;
+    // Objects with an infinite bbox (only ever filled in on the root node)
+    ObjList unbounded_objects;
     int max_depth_allowed; // how much more depth is allowed
     BBox memoized_bbox;
 
     std::pair<ObjList, ObjList> minimal_surface_area_split(ObjList& dividing_objects, BBox& left, BBox& right);
+    void pack_leaf_objects();
+    // Children, which only ever get the bounded objects the root kept
+    BVHList(int max_depth, ObjList&& bounded_objects);
+    void build(); // splits objects down into children, or packs them up as a leaf
+    static bool traverse(const BVHList& root, const Ray& ray, RealRange& allowed_distance, HitRecord& rec);
+    static bool traverse_occluded(const BVHList& root, const Ray& ray, RealRange allowed_distance);
 
     public:
     BVHList(const BVHList& other) = delete;
     BVHList(ObjList& world_objects,int max_depth = 25);
     ~BVHList();
     bool hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const;
+    bool occluded(const Ray& ray, RealRange allowed_distance)const;
+    // Infinite when the root keeps unbounded objects, which a BVH holding this one as an object relies on
     BBox bbox()const;
+    // Only the objects in the tree, still finite with infinite planes beside it
+    BBox bounded_bbox()const;
     bool isLeaf()const;
+
+#ifdef BVH_STATS
+    // Totals across every thread, build with -DBVH_STATS to get them
+    static std::atomic<unsigned long long> nodes_visited, rays_traversed;
+#endif
 };
\ No newline at end of file
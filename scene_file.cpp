@@ -0,0 +1,379 @@
+#include "scene_file.h"
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include "camera.h"
+
+//===================================================================
+// RenderJob
+//===================================================================
+void RenderJob::camera_at(int frame, Point3& origin, Point3& look_at)const{
+    // keyframes are sorted by frame when the file is loaded
+    const CameraKeyframe* before = &keyframes.front();
+    const CameraKeyframe* after = &keyframes.back();
+    for(const CameraKeyframe& key : keyframes){
+        if(key.frame <= frame) before = &key;
+        if(key.frame >= frame){ after = &key; break; }
+    }
+    if(after->frame <= before->frame){
+        origin = before->origin;
+        look_at = before->look_at;
+        return;
+    }
+    Real t = (frame - before->frame) / Real(after->frame - before->frame);
+    origin = before->origin + (after->origin - before->origin) * t;
+    look_at = before->look_at + (after->look_at - before->look_at) * t;
+}
+
+//===================================================================
+// AssetCache
+//===================================================================
+static bool read_vector(std::istream& words, Vector3& v){
+    Real x,y,z;
+    if(!(words >> x >> y >> z)) return false;
+    v = Vector3{x,y,z};
+    return true;
+}
+
+std::shared_ptr<Material> AssetCache::material(const std::string& definition){
+    auto cached = materials.find(definition);
+    if(cached != materials.end()) return cached->second;
+
+    std::istringstream words(definition);
+    std::string type;
+    words >> type;
+    std::shared_ptr<Material> created;
+    if(type == "brd"){
+        Color diffuse, specular, emissive;
+        double specular_tightness, roughness;
+        if(read_vector(words,diffuse) && read_vector(words,specular) && read_vector(words,emissive) && (words >> specular_tightness >> roughness)){
+            // optionally followed by: texture <image file>
+            std::string keyword, texture_file;
+            TextureId texture = 0;
+            if(words >> keyword){
+                if(keyword != "texture" || !(words >> texture_file)) return nullptr;
+                texture = texture_table.add(texture_file);
+                if(!texture) return nullptr;
+            }
+            created = std::make_shared<BRDMaterial>(diffuse,specular,emissive,specular_tightness,roughness,texture);
+        }
+    } else if(type == "glass"){
+        double refractive_index;
+        if(words >> refractive_index)
+            created = std::make_shared<PureTransparentMaterial>(refractive_index);
+    }
+    if(created) materials[definition] = created;
+    return created;
+}
+
+std::shared_ptr<Mesh> AssetCache::mesh(const std::string& filename){
+    auto cached = meshes.find(filename);
+    if(cached != meshes.end()) return cached->second;
+    auto loaded = std::make_shared<Mesh>();
+    if(!load_mesh(filename,*loaded)) loaded = nullptr;
+    meshes[filename] = loaded; // failures are remembered too so they are only reported once
+    return loaded;
+}
+
+static std::string placement_key(const std::string& kind, const std::string& filename, const std::shared_ptr<Material>& material, double scale, const Point3& center){
+    std::ostringstream key;
+    key << kind << ' ' << filename << ' ' << material_id(material) << ' ' << scale << ' ' << center.x << ' ' << center.y << ' ' << center.z;
+    return key.str();
+}
+
+std::shared_ptr<Hittable> AssetCache::placed_mesh(const std::string& filename, std::shared_ptr<Material> material, double scale, const Point3& center){
+    std::string key = placement_key("mesh",filename,material,scale,center);
+    auto cached = placed_meshes.find(key);
+    if(cached != placed_meshes.end()) return cached->second;
+
+    std::shared_ptr<Mesh> model = mesh(filename);
+    if(!model) return nullptr;
+    // The mesh gets a BVH of its own which then sits in the world BVH as a single object,
+    // so the next job with a different world around it can reuse it as is
+    HittableList list;
+    add_mesh_to_list(*model,list,material,scale,center);
+    Stopwatch timer;
+    auto built = std::make_shared<BVHList>(list.objects);
+    print("BVH Creation Time  {} ({})\n",timer.duration(),filename);
+    placed_meshes[key] = built;
+    return built;
+}
+
+std::shared_ptr<Hittable> AssetCache::lazy_mesh(const std::string& filename, std::shared_ptr<Material> material, double scale, const Point3& center, const BBox& bbox){
+    std::string key = placement_key("lazy_mesh",filename,material,scale,center);
+    auto cached = placed_meshes.find(key);
+    if(cached != placed_meshes.end()) return cached->second;
+    auto proxy = std::make_shared<LazyMesh>(filename,material,scale,center,bbox);
+    placed_meshes[key] = proxy;
+    return proxy;
+}
+
+const CachedWorld& AssetCache::world(RenderJob& job){
+    auto cached = worlds.find(job.scene_key);
+    if(cached != worlds.end()) return cached->second;
+    Stopwatch timer;
+    ObjList objects = job.scene.objects;
+    CachedWorld& built = worlds[job.scene_key];
+    built.bvh = std::make_shared<BVHList>(objects);
+    print("BVH Creation Time  {}\n",timer.duration());
+    built.lights = LightList(job.scene.objects);
+    return built;
+}
+
+//===================================================================
+// Scene files
+//===================================================================
+// Reads a value that may be left off the end of the line, false only when something is there but does not parse
+template<typename T> static bool read_optional(std::istream& words, T& value, const T& fallback){
+    if(!(words >> std::ws) || words.eof()){
+        value = fallback;
+        return true;
+    }
+    return (bool)(words >> value);
+}
+
+// Output filenames are std::format patterns given the frame number, checked up front so a typo fails
+// the job while it loads instead of throwing halfway through rendering the batch
+static bool is_frame_pattern(const std::string& pattern){
+    try{
+        int frame = 0;
+        (void)std::vformat(pattern,std::make_format_args(frame));
+        return true;
+    } catch(const std::format_error&){
+        return false;
+    }
+}
+
+extern bool load_render_job(const std::string& filename, AssetCache& cache, RenderJob& job){
+    std::ifstream file(filename);
+    if(!file.is_open()){
+        print("Unable to open scene file {}\n",filename);
+        return false;
+    }
+    job.filename = filename;
+    std::map<std::string, std::shared_ptr<Material>> named_materials;
+
+    std::string line;
+    int line_number = 0;
+    while(std::getline(file,line)){
+        line_number++;
+        line = line.substr(0,line.find('#'));
+        std::istringstream words(line);
+        std::string keyword;
+        if(!(words >> keyword)) continue; // blank or comment
+
+        auto fail = [&](const std::string& message){
+            print("{}:{}: {}\n",filename,line_number,message);
+            return false;
+        };
+        // Material and object lines make up the scene key, with the spacing normalized
+        auto add_to_scene_key = [&](){
+            std::istringstream tokens(line);
+            std::string token;
+            while(tokens >> token) job.scene_key += token + ' ';
+            job.scene_key += '\n';
+        };
+        auto read_material = [&](std::shared_ptr<Material>& material){
+            std::string name;
+            if(!(words >> name)) return false;
+            auto found = named_materials.find(name);
+            if(found == named_materials.end()) return false;
+            material = found->second;
+            return true;
+        };
+
+        std::shared_ptr<Material> material;
+        Vector3 a,b,c;
+        Real radius;
+        if(keyword == "material"){
+            std::string name, token, definition;
+            words >> name;
+            while(words >> token) definition += (definition.empty() ? "" : " ") + token;
+            material = cache.material(definition);
+            if(name.empty() || !material) return fail("expected: material <name> brd <diffuse rgb> <specular rgb> <emissive rgb> <specular tightness> <roughness> [texture <png or pfm>]  or  material <name> glass <refractive index>");
+            named_materials[name] = material;
+            add_to_scene_key();
+        } else if(keyword == "sphere"){
+            if(!read_vector(words,a) || !(words >> radius) || !read_material(material)) return fail("expected: sphere <center xyz> <radius> <material>");
+            job.scene.emplace<Sphere>(a,radius,material);
+            add_to_scene_key();
+        } else if(keyword == "plane"){
+            if(!read_vector(words,a) || !read_vector(words,b) || !read_material(material)) return fail("expected: plane <point xyz> <normal xyz> <material>");
+            job.scene.emplace<Plane>(a,b,material);
+            add_to_scene_key();
+        } else if(keyword == "disk"){
+            if(!read_vector(words,a) || !read_vector(words,b) || !(words >> radius) || !read_material(material)) return fail("expected: disk <center xyz> <normal xyz> <radius> <material>");
+            job.scene.emplace<Disk>(a,b,radius,material);
+            add_to_scene_key();
+        } else if(keyword == "box"){
+            if(!read_vector(words,a) || !read_vector(words,b) || !read_material(material)) return fail("expected: box <min xyz> <max xyz> <material>");
+            job.scene.emplace<AABox>(a,b,material);
+            add_to_scene_key();
+        } else if(keyword == "triangle"){
+            if(!read_vector(words,a) || !read_vector(words,b) || !read_vector(words,c) || !read_material(material)) return fail("expected: triangle <p1 xyz> <p2 xyz> <p3 xyz> <material>");
+            job.scene.emplace<Triangle>(a,b,c,material);
+            add_to_scene_key();
+        } else if(keyword == "mesh" || keyword == "lazy_mesh"){
+            std::string mesh_file;
+            double scale;
+            BBox bbox;
+            bool is_lazy = keyword == "lazy_mesh";
+            if(!(words >> mesh_file) || !read_material(material) || !(words >> scale) || !read_vector(words,a) ||
+               (is_lazy && (!read_vector(words,bbox.min) || !read_vector(words,bbox.max)))){
+                return fail(is_lazy ?
+                    "expected: lazy_mesh <file> <material> <scale> <center xyz> <bbox min xyz> <bbox max xyz>" :
+                    "expected: mesh <file> <material> <scale> <center xyz>");
+            }
+            std::shared_ptr<Hittable> object = is_lazy ?
+                cache.lazy_mesh(mesh_file,material,scale,a,bbox) :
+                cache.placed_mesh(mesh_file,material,scale,a);
+            if(!object) return fail("unable to load " + mesh_file);
+            job.scene.add(object);
+            add_to_scene_key();
+        } else if(keyword == "lazy_mesh_budget"){
+            if(!(words >> job.lazy_mesh_budget) || job.lazy_mesh_budget <= 0.0) return fail("expected: lazy_mesh_budget <megabytes>");
+        } else if(keyword == "resolution"){
+            if(!(words >> job.width >> job.height) || job.width < 2 || job.height < 2) return fail("expected: resolution <width> <height>");
+        } else if(keyword == "samples"){
+            if(!(words >> job.sampling_per_pixel) || job.sampling_per_pixel < 1) return fail("expected: samples <per pixel>");
+        } else if(keyword == "max_depth"){
+            if(!(words >> job.max_trace_depth)) return fail("expected: max_depth <bounces>");
+        } else if(keyword == "roulette"){
+            if(!(words >> job.roulette_min_depth >> job.roulette_throughput >> job.max_splits) || job.roulette_throughput <= 0.0 || job.max_splits < 1)
+                return fail("expected: roulette <min depth> <throughput> <max splits>");
+        } else if(keyword == "denoise"){
+            if(!(words >> job.denoise_iterations) || job.denoise_iterations < 0) return fail("expected: denoise <passes>");
+        } else if(keyword == "radiance_cache"){
+            if(!(words >> job.radiance_cache_depth) || job.radiance_cache_depth < 1)
+                return fail("expected: radiance_cache <depth> [cell pixels] [min samples] [fill passes] [min roughness]");
+            if(!read_optional(words,job.radiance_cache_cell_pixels,8.0) || !read_optional(words,job.radiance_cache_min_samples,4) ||
+               !read_optional(words,job.radiance_cache_fill_passes,2) || !read_optional(words,job.radiance_cache_min_roughness,0.5) ||
+               job.radiance_cache_cell_pixels <= 0.0 || job.radiance_cache_fill_passes < 1)
+                return fail("expected: radiance_cache <depth> [cell pixels] [min samples] [fill passes] [min roughness]");
+        } else if(keyword == "photons"){
+            if(!(words >> job.photon_passes) || job.photon_passes < 1)
+                return fail("expected: photons <passes> [per pass] [radius]");
+            if(!read_optional(words,job.photons_per_pass,200000) || !read_optional(words,job.photon_radius,0.0) ||
+               job.photons_per_pass < 1 || job.photon_radius < 0.0)
+                return fail("expected: photons <passes> [per pass] [radius]");
+        } else if(keyword == "aovs"){
+            if(!(words >> job.aov_output) || !is_frame_pattern(job.aov_output)) return fail("expected: aovs <pfm filename prefix with {} for the frame number>");
+        } else if(keyword == "sampler"){
+            std::string name;
+            if(!(words >> name) || !parse_sampler_type(name,job.sampler_type)) return fail("expected: sampler <independent, sobol or blue_noise>");
+        } else if(keyword == "environment"){
+            if(!(words >> job.environment_file) || !read_optional(words,job.environment_intensity,1.0))
+                return fail("expected: environment <pfm or hdr file> [intensity]");
+            if(!load_environment(job.environment_file)) return fail("unable to load " + job.environment_file);
+        } else if(keyword == "camera"){
+            CameraKeyframe key;
+            if(!(words >> key.frame) || !read_vector(words,key.origin) || !read_vector(words,key.look_at)) return fail("expected: camera <frame> <origin xyz> <look at xyz>");
+            job.keyframes.push_back(key);
+        } else if(keyword == "frames"){
+            if(!(words >> job.first_frame >> job.last_frame) || job.last_frame < job.first_frame) return fail("expected: frames <first> <last>");
+        } else if(keyword == "output"){
+            if(!(words >> job.png_output) || !is_frame_pattern(job.png_output))
+                return fail("expected: output <png filename with {} for the frame number> [compression level]");
+            if(!read_optional(words,job.png_compression_level,2) || job.png_compression_level < 0 || job.png_compression_level > 9)
+                return fail("expected: output <png filename with {} for the frame number> [compression level 0 to 9]");
+            if(job.png_output == "none") job.png_output.clear();
+        } else if(keyword == "pfm"){
+            if(!(words >> job.pfm_output) || !is_frame_pattern(job.pfm_output)) return fail("expected: pfm <pfm filename with {} for the frame number>");
+        } else if(keyword == "raw"){
+            if(!(words >> job.raw_output) || !is_frame_pattern(job.raw_output)) return fail("expected: raw <rgb filename with {} for the frame number>");
+        } else if(keyword == "exr"){
+            if(!(words >> job.exr_output) || !is_frame_pattern(job.exr_output)) return fail("expected: exr <exr filename with {} for the frame number>");
+        } else if(keyword == "pipe"){
+            std::string format;
+            if(!(words >> format) || (format != "rgb24" && format != "float") ||
+               !std::getline(words >> std::ws, job.pipe_command) || job.pipe_command.empty())
+                return fail("expected: pipe <rgb24 or float> <command>");
+            job.pipe_format = format == "rgb24" ? VideoPipe::Format::RGB24 : VideoPipe::Format::Float;
+        } else {
+            return fail("unknown keyword " + keyword);
+        }
+    }
+
+    if(job.scene.objects.empty()){
+        print("{}: has nothing in it to render\n",filename);
+        return false;
+    }
+    if(job.keyframes.empty()){
+        print("{}: needs at least one camera line\n",filename);
+        return false;
+    }
+    std::stable_sort(job.keyframes.begin(), job.keyframes.end(), [](const CameraKeyframe& a, const CameraKeyframe& b){ return a.frame < b.frame; });
+    return true;
+}
+
+extern void render_job(RenderJob& job, AssetCache& cache){
+    print("Job: {}\n",job.filename);
+    const CachedWorld& world = cache.world(job);
+    LazyMesh::memory_budget = job.lazy_mesh_budget > 0.0 ? size_t(job.lazy_mesh_budget * 1024*1024) : LazyMesh::default_memory_budget();
+
+    Camera viewport(job.width,job.height);
+    viewport.sampling_per_pixel = job.sampling_per_pixel;
+    viewport.max_trace_depth = job.max_trace_depth;
+    viewport.roulette_min_depth = job.roulette_min_depth;
+    viewport.roulette_throughput = job.roulette_throughput;
+    viewport.max_splits = job.max_splits;
+    viewport.sampler_type = job.sampler_type;
+    viewport.denoise_iterations = job.denoise_iterations;
+    viewport.capture_aovs = !job.aov_output.empty();
+    viewport.radiance_cache_depth = job.radiance_cache_depth;
+    viewport.radiance_cache.cell_pixels = job.radiance_cache_cell_pixels;
+    viewport.radiance_cache.min_samples = job.radiance_cache_min_samples;
+    viewport.radiance_cache.fill_passes = job.radiance_cache_fill_passes;
+    viewport.radiance_cache.min_roughness = job.radiance_cache_min_roughness;
+    viewport.photon_passes = job.photon_passes;
+    viewport.photons_per_pass = job.photons_per_pass;
+    viewport.photon_radius = job.photon_radius;
+    viewport.png_compression_level = job.png_compression_level;
+    viewport.lights = world.lights;
+    if(!job.environment_file.empty())
+        viewport.lights.set_environment(load_environment(job.environment_file),job.environment_intensity);
+    VideoPipe video;
+    if(!job.pipe_command.empty()){
+        // {width} and {height} in the command are the size of the frames
+        std::string command = job.pipe_command;
+        for(auto [name,value] : {std::pair{"{width}",job.width}, std::pair{"{height}",job.height}}){
+            for(size_t at; (at = command.find(name)) != std::string::npos; )
+                command.replace(at, strlen(name), std::to_string(value));
+        }
+        if(!video.open(command,job.pipe_format)) print("{}: unable to start {}\n",job.filename,command);
+    }
+    Stopwatch timer;
+    for(int frame=job.first_frame; frame<=job.last_frame; frame++){
+        Point3 look_at;
+        job.camera_at(frame,viewport.origin,look_at);
+        viewport.look_at(look_at);
+        timer.reset();
+        viewport.render(*world.bvh);
+        LazyMesh::free_evicted(); // no rays are left in any mesh evicted during the frame
+        print("Frame: {} - {}\n",frame,ms_to_human(timer.duration()));
+        if(viewport.denoise_iterations)
+            print("Denoise Time {}\n",ms_to_human(viewport.denoise_time));
+        if(viewport.photon_passes){
+            size_t stored = 0;
+            for(const PhotonMap& map : viewport.photon_maps) stored += map.size();
+            print("Photon Time {}  ({} caustic photons)\n",ms_to_human(viewport.photon_time),stored);
+        }
+        if(viewport.radiance_cache_depth)
+            print("Radiance Cache Fill {}  ({} cells)\n",ms_to_human(viewport.radiance_cache_time),viewport.radiance_cache.cells_used());
+        if(!job.aov_output.empty())
+            viewport.aovs->write_to_pfm(std::vformat(job.aov_output,std::make_format_args(frame)));
+        if(!job.pfm_output.empty())
+            viewport.pixels->write_to_pfm(std::vformat(job.pfm_output,std::make_format_args(frame)));
+        if(!job.raw_output.empty())
+            viewport.pixels->write_to_raw(std::vformat(job.raw_output,std::make_format_args(frame)));
+        if(!job.exr_output.empty())
+            viewport.pixels->write_to_exr(std::vformat(job.exr_output,std::make_format_args(frame)));
+        if(video.is_open())
+            video.write(*viewport.pixels);
+        if(!job.png_output.empty())
+            viewport.threaded_write_to_png(std::vformat(job.png_output,std::make_format_args(frame)));
+    }
+    if(video.is_open() && !video.close())
+        print("{}: {} failed or stopped reading frames\n",job.filename,job.pipe_command);
+}
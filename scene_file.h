@@ -0,0 +1,85 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+#include "scene.h"
+#include "model.h"
+#include "materials.h"
+#include "sampler.h"
+#include "video_pipe.h"
+#include "lights.h"
+
+// Where the camera is on a given frame, frames between two keyframes are interpolated
+struct CameraKeyframe{
+    int frame;
+    Point3 origin;
+    Point3 look_at;
+};
+
+// One scene file - the objects to render, how to render them and which frames
+struct RenderJob{
+    std::string filename;
+    HittableList scene; // objects are made in its arena
+    // The material and object lines of the file, jobs with the same scene_key render the same world
+    std::string scene_key;
+    double lazy_mesh_budget = 0.0; // megabytes, 0 for half of physical memory
+
+    int width = 1920, height = 1080;
+    int sampling_per_pixel = 100;
+    int max_trace_depth = 10;
+    int roulette_min_depth = 3;
+    double roulette_throughput = 1.0;
+    int max_splits = 1;
+    SamplerType sampler_type = SamplerType::Sobol;
+    int denoise_iterations = 0;
+    int radiance_cache_depth = 0; // off
+    double radiance_cache_cell_pixels = 8.0;
+    int radiance_cache_min_samples = 4;
+    int radiance_cache_fill_passes = 2;
+    double radiance_cache_min_roughness = 0.5;
+    int photon_passes = 0; // off
+    int photons_per_pass = 200000;
+    double photon_radius = 0.0; // automatic
+    std::string environment_file; // none for the simulated sky
+    double environment_intensity = 1.0;
+    std::vector<CameraKeyframe> keyframes;
+    int first_frame = 0, last_frame = 0;
+    std::string png_output = "video/{}.png"; // {} is replaced by the frame number, empty for no pngs
+    int png_compression_level = 2;
+    std::string pfm_output; // no pfm unless asked for
+    std::string raw_output, exr_output; // float RGB for compositing, none unless asked for
+    std::string pipe_command; // gets every frame in order on its standard input, none unless asked for
+    VideoPipe::Format pipe_format = VideoPipe::Format::RGB24;
+    std::string aov_output; // prefix of the albedo, normal and depth pfms, none unless asked for
+
+    void camera_at(int frame, Point3& origin, Point3& look_at)const;
+};
+
+// A built world BVH and the lights of the same objects - a job that reuses the world has to sample
+// the instances the BVH hits, or light picking would not recognize them when a bounce finds them
+struct CachedWorld{
+    std::shared_ptr<BVHList> bvh;
+    LightList lights;
+};
+
+// Materials, meshes and BVHs that stay loaded across every job in a batch
+// so jobs that use the same assets only pay for loading and building them once
+class AssetCache{
+    std::map<std::string, std::shared_ptr<Material>> materials; // keyed by the definition, not the name
+    std::map<std::string, std::shared_ptr<Mesh>> meshes; // keyed by filename
+    std::map<std::string, std::shared_ptr<Hittable>> placed_meshes; // BVHs of a placed mesh, or its LazyMesh
+    std::map<std::string, CachedWorld> worlds; // keyed by RenderJob::scene_key
+
+    public:
+    // definition is everything after the material name, ie "glass 1.5", nullptr if it does not parse
+    std::shared_ptr<Material> material(const std::string& definition);
+    std::shared_ptr<Mesh> mesh(const std::string& filename);
+    std::shared_ptr<Hittable> placed_mesh(const std::string& filename, std::shared_ptr<Material> material, double scale, const Point3& center);
+    std::shared_ptr<Hittable> lazy_mesh(const std::string& filename, std::shared_ptr<Material> material, double scale, const Point3& center, const BBox& bbox);
+    const CachedWorld& world(RenderJob& job);
+};
+
+// Reads a scene file (see the README for the format), printing file:line for anything it cannot understand
+extern bool load_render_job(const std::string& filename, AssetCache& cache, RenderJob& job);
+// Renders every frame of the job and saves them
+extern void render_job(RenderJob& job, AssetCache& cache);
@@ -2,15 +2,34 @@
 #include <cmath>
 using std::sqrt;
 
+//===================================================================
+// Hittable
+//===================================================================
+bool Hittable::occluded(const Ray& ray, RealRange allowed_distance)const{
+    HitRecord scratch;
+    return hit(ray,allowed_distance,scratch);
+}
+
+BBox Hittable::bounded_bbox()const{
+    return bbox();
+}
+
+void Hittable::texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const{
+    u = v = uv_scale = 0;
+}
+
 //===================================================================
 // Triangle
 //===================================================================
 Triangle::Triangle(const Point3& p1, const Point3& p2, const Point3& p3):
-    p1(p1), p2(p2), p3(p3), material(AluminiumDull)
+    p1(p1), p2(p2), p3(p3), material(AluminiumDull->id)
 {
     normal = (p2-p1).cross(p3-p1).normalize();
 }
 Triangle::Triangle(const Point3& p1, const Point3& p2, const Point3& p3, std::shared_ptr<Material> mat):
+    Triangle(p1,p2,p3,material_id(mat))
+{}
+Triangle::Triangle(const Point3& p1, const Point3& p2, const Point3& p3, MaterialId mat):
     p1(p1), p2(p2), p3(p3), material(mat)
 {
     normal = (p2-p1).cross(p3-p1).normalize();
@@ -38,7 +57,7 @@ bool Triangle::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)c
     // 2) Determine if that point is inside the triangle
 
     auto normal_direction_dot = this->normal.dot(ray.direction);
-    if (normal_direction_dot <= std::numeric_limits<double>::epsilon()*15.0 && normal_direction_dot >= std::numeric_limits<double>::epsilon()*-15.0) {
+    if (normal_direction_dot <= std::numeric_limits<Real>::epsilon()*15.0 && normal_direction_dot >= std::numeric_limits<Real>::epsilon()*-15.0) {
         // The direction is effectivly parrellel with our triangle so consider it a miss
         return false;
     }
@@ -64,19 +83,24 @@ bool Triangle::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)c
     bool outside_side_c = (p1-p3).cross(ray_intersection_point-p3).dot(normal) < 0;
     if (outside_side_a || outside_side_b || outside_side_c) return false;
 
-    // todo - barycentric coords to do texture mapping with
     // todo - per-vertex normals that get interpolated with the barycentric coords
 
     // We have passed all the tests for if the point is inside the triangle, so lets do some bookkeeping
     // Shrink the far plane for finding more hits that are only closer
     allowed_distance.max = ray_intersection_distance;
+    fill_hit_record(ray,ray_intersection_distance,rec);
+    return true;
+}
+
+void Triangle::fill_hit_record(const Ray& ray, Real distance, HitRecord& rec)const{
     // Add the hit information to the hit record
-    rec.intersection_point = ray_intersection_point;
-    rec.distanceScale = ray_intersection_distance;
+    rec.intersection_point = ray.at(distance);
+    rec.distanceScale = distance;
     rec.material = this->material;
+    rec.object = this;
     // We want to know if we hit the front or back face of the triangle, which is just comparing if the
     // direction the ray is traveling is the same or opposite direction of the normal
-    if (normal_direction_dot < 0.0) {
+    if (this->normal.dot(ray.direction) < 0.0) {
         rec.normal = this->normal;
         rec.front_face = true;
     } else {
@@ -84,17 +108,40 @@ bool Triangle::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)c
         rec.front_face = false;
         // rec.material = ErrorMaterialRed;
     }
+}
 
-    return true;
+void Triangle::barycentric(const Point3& point, Real& b1, Real& b2, Real& b3)const{
+    // The areas of the triangles the point makes with each side, over the whole area
+    // The cross products point along the normal, so dotting with it gets their signed lengths
+    Vector3 edge_a = p2-p1;
+    Vector3 edge_b = p3-p1;
+    Vector3 to_point = point-p1;
+    Real double_area = edge_a.cross(edge_b).dot(normal);
+    b2 = to_point.cross(edge_b).dot(normal) / double_area;
+    b3 = edge_a.cross(to_point).dot(normal) / double_area;
+    b1 = 1 - b2 - b3;
+}
+
+void Triangle::texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const{
+    Real b1, b2, b3;
+    barycentric(rec.intersection_point,b1,b2,b3);
+    u = b1*uv[0].u + b2*uv[1].u + b3*uv[2].u;
+    v = b1*uv[0].v + b2*uv[1].v + b3*uv[2].v;
+    Real double_area = (p2-p1).cross(p3-p1).length();
+    Real uv_double_area = std::fabs((uv[1].u-uv[0].u)*(uv[2].v-uv[0].v) - (uv[2].u-uv[0].u)*(uv[1].v-uv[0].v));
+    uv_scale = std::sqrt(uv_double_area / double_area);
 }
 
 //===================================================================
 // Sphere
 //===================================================================
-Sphere::Sphere(const Point3& center, double radius):
-    center(center),radius(radius),material(AluminiumDull)
+Sphere::Sphere(const Point3& center, Real radius):
+    center(center),radius(radius),material(AluminiumDull->id)
+{}
+Sphere::Sphere(const Point3& center, Real radius,std::shared_ptr<Material> mat):
+    center(center),radius(radius),material(material_id(mat))
 {}
-Sphere::Sphere(const Point3& center, double radius,std::shared_ptr<Material> mat):
+Sphere::Sphere(const Point3& center, Real radius,MaterialId mat):
     center(center),radius(radius),material(mat)
 {}
 
@@ -114,11 +161,8 @@ BBox Sphere::bbox()const{
 }
 
 bool Sphere::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const{
-    // Cheaper bounding box check to weed out any misses early
-    auto t = this->bbox().intersection_distance(ray);
-    if(t.min > t.max || t.min > allowed_distance.max || t.max < allowed_distance.min)
-        return false;
-
+    // No bounding box check up front - the BVH already did one for us, and the
+    // quadratic below is not much more expensive than building the box and running the slab test
     Vector3 oc = center - ray.origin;
     auto a = ray.direction.length_squared();
     auto h = ray.direction.dot(oc);
@@ -139,10 +183,15 @@ bool Sphere::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)con
 
     // shrink the far plane to keep ensuring we only get closer hits for any further entities found
     allowed_distance.max = root;
+    fill_hit_record(ray,root,rec);
+    return true;
+}
 
-    rec.distanceScale = root;
-    rec.intersection_point = ray.at(root);
+void Sphere::fill_hit_record(const Ray& ray, Real distance, HitRecord& rec)const{
+    rec.distanceScale = distance;
+    rec.intersection_point = ray.at(distance);
     rec.material = material;
+    rec.object = this;
     rec.normal = (rec.intersection_point - center) / radius;
     if(ray.direction.dot(rec.normal)>0.0){
         rec.front_face = false;
@@ -150,14 +199,195 @@ bool Sphere::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)con
     }else{
         rec.front_face = true;
     }
+}
+
+
+void Sphere::texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const{
+    // Longitude and latitude, with v going up from the bottom pole
+    Vector3 outward = (rec.intersection_point - center) / radius;
+    u = std::atan2(-outward.z, outward.x) / (2*PI) + 0.5;
+    v = std::acos(std::clamp(-outward.y, (Real)-1.0, (Real)1.0)) / PI;
+    uv_scale = 1 / (PI*radius);
+}
+
+//===================================================================
+// Plane
+//===================================================================
+Plane::Plane(const Point3& point, const Vector3& normal):
+    point(point), normal(normal.normalize()), material(AluminiumDull->id)
+{}
+Plane::Plane(const Point3& point, const Vector3& normal, std::shared_ptr<Material> mat):
+    point(point), normal(normal.normalize()), material(material_id(mat))
+{}
+Plane::Plane(const Point3& point, const Vector3& normal, MaterialId mat):
+    point(point), normal(normal.normalize()), material(mat)
+{}
+
+BBox Plane::bbox()const{
+    return {
+        {-Infinity,-Infinity,-Infinity},
+        {Infinity,Infinity,Infinity}
+    };
+}
+
+// Shared by the plane and the disk - where the ray crosses the plane, if it does within the allowed range
+static inline bool ray_plane_distance(const Ray& ray, const Point3& point, const Vector3& normal, const RealRange& allowed_distance, Real& distance){
+    auto normal_direction_dot = normal.dot(ray.direction);
+    if (std::fabs(normal_direction_dot) <= std::numeric_limits<Real>::epsilon()*15.0) {
+        // The direction is effectivly parrellel with the plane so consider it a miss
+        return false;
+    }
+    distance = (point - ray.origin).dot(normal) / normal_direction_dot;
+    return allowed_distance.surrounds(distance);
+}
+
+// Shared by the plane and the disk - texture coordinates are distances from origin along the surface,
+// so a texture repeats every unit
+static inline void flat_texture_coordinates(const Point3& point, const Point3& origin, const Vector3& normal, Real& u, Real& v, Real& uv_scale){
+    Vector3 tangent, bitangent;
+    Vector3::orthonormal_basis(normal,tangent,bitangent);
+    Vector3 from_origin = point - origin;
+    u = from_origin.dot(tangent);
+    v = from_origin.dot(bitangent);
+    uv_scale = 1;
+}
+
+// Shared by the plane and the disk - a flat surface can be hit from either side
+static inline void fill_flat_hit_record(const Ray& ray, Real distance, const Vector3& normal, MaterialId material, HitRecord& rec){
+    rec.distanceScale = distance;
+    rec.intersection_point = ray.at(distance);
+    rec.material = material;
+    if (normal.dot(ray.direction) < 0.0) {
+        rec.normal = normal;
+        rec.front_face = true;
+    } else {
+        rec.normal = normal.reverse();
+        rec.front_face = false;
+    }
+}
+
+bool Plane::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const{
+    Real distance;
+    if(!ray_plane_distance(ray,point,normal,allowed_distance,distance))
+        return false;
+    allowed_distance.max = distance;
+    fill_flat_hit_record(ray,distance,normal,material,rec);
+    rec.object = this;
+    return true;
+}
+
+void Plane::texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const{
+    flat_texture_coordinates(rec.intersection_point,point,normal,u,v,uv_scale);
+}
+
+//===================================================================
+// Disk
+//===================================================================
+Disk::Disk(const Point3& center, const Vector3& normal, Real radius):
+    center(center), normal(normal.normalize()), radius(radius), material(AluminiumDull->id)
+{}
+Disk::Disk(const Point3& center, const Vector3& normal, Real radius, std::shared_ptr<Material> mat):
+    center(center), normal(normal.normalize()), radius(radius), material(material_id(mat))
+{}
+Disk::Disk(const Point3& center, const Vector3& normal, Real radius, MaterialId mat):
+    center(center), normal(normal.normalize()), radius(radius), material(mat)
+{}
+
+BBox Disk::bbox()const{
+    // The extent of a tilted disk along each axis is radius * sin(angle between the axis and the normal)
+    Vector3 extent = {
+        radius * std::sqrt(std::max((Real)0.0, 1 - normal.x*normal.x)),
+        radius * std::sqrt(std::max((Real)0.0, 1 - normal.y*normal.y)),
+        radius * std::sqrt(std::max((Real)0.0, 1 - normal.z*normal.z))
+    };
+    return {center - extent, center + extent};
+}
+
+bool Disk::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const{
+    Real distance;
+    if(!ray_plane_distance(ray,center,normal,allowed_distance,distance))
+        return false;
+    if((ray.at(distance) - center).length_squared() > radius*radius)
+        return false;
+    allowed_distance.max = distance;
+    fill_flat_hit_record(ray,distance,normal,material,rec);
+    rec.object = this;
+    return true;
+}
+
+void Disk::texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const{
+    flat_texture_coordinates(rec.intersection_point,center,normal,u,v,uv_scale);
+}
+
+//===================================================================
+// AABox
+//===================================================================
+AABox::AABox(const Point3& min, const Point3& max):
+    box{min,max}, material(AluminiumDull->id)
+{}
+AABox::AABox(const Point3& min, const Point3& max, std::shared_ptr<Material> mat):
+    box{min,max}, material(material_id(mat))
+{}
+AABox::AABox(const Point3& min, const Point3& max, MaterialId mat):
+    box{min,max}, material(mat)
+{}
+
+BBox AABox::bbox()const{
+    return box;
+}
+
+bool AABox::hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const{
+    auto t = box.intersection_distance(ray);
+    if(t.min > t.max)
+        return false;
+    // Entering the box from outside, or leaving it when the ray starts inside
+    Real distance = t.min;
+    if(!allowed_distance.surrounds(distance)){
+        distance = t.max;
+        if(!allowed_distance.surrounds(distance))
+            return false;
+    }
+    allowed_distance.max = distance;
+
+    rec.distanceScale = distance;
+    rec.intersection_point = ray.at(distance);
+    rec.material = material;
+    rec.object = this;
+    // The face that was hit is the axis where the point is furthest out relative to the box size
+    Point3 center = box.center();
+    Vector3 half_size = (box.max - box.min) * (Real)0.5;
+    Vector3 local = (rec.intersection_point - center) / half_size;
+    int axis = 0;
+    if(std::fabs(local.y) > std::fabs(local[axis])) axis = 1;
+    if(std::fabs(local.z) > std::fabs(local[axis])) axis = 2;
+    Vector3 outward = {0.0,0.0,0.0};
+    outward[axis] = local[axis] < 0.0 ? -1.0 : 1.0;
+    if(outward.dot(ray.direction) < 0.0){
+        rec.normal = outward;
+        rec.front_face = true;
+    } else {
+        rec.normal = outward.reverse();
+        rec.front_face = false;
+    }
     return true;
 }
 
+void AABox::texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const{
+    // Distances from the min corner along the two axes the hit face lies in
+    Vector3 local = (rec.intersection_point - box.center()) / ((box.max - box.min) * (Real)0.5);
+    int axis = 0;
+    if(std::fabs(local.y) > std::fabs(local[axis])) axis = 1;
+    if(std::fabs(local.z) > std::fabs(local[axis])) axis = 2;
+    Vector3 from_min = rec.intersection_point - box.min;
+    u = from_min[(axis+1)%3];
+    v = from_min[(axis+2)%3];
+    uv_scale = 1;
+}
 
 //===================================================================
 //  Utilities
 //===================================================================
-std::vector<std::shared_ptr<Triangle>> make_cube(double radius, const Point3& center, std::shared_ptr<Material> material) {
+std::vector<std::shared_ptr<Triangle>> make_cube(Real radius, const Point3& center, std::shared_ptr<Material> material) {
     /*
     We want counter-clockwise on every face
     --,+-,++,-+ if thinking abount the corners
@@ -3,16 +3,24 @@
 #include "utils.h"
 #include "materials.h"
 
-class Material;
+class Hittable;
 
 struct HitRecord{
     Point3 intersection_point;
     //a scale of how far against the direction of the ray for the hit
     // ie the direction of a ray may not have been normalized and this is a scale factor on that length of the direction vector
-    double distanceScale;
+    Real distanceScale;
     Vector3 normal;
     bool front_face;
-    std::shared_ptr<Material> material;
+    MaterialId material;
+    const Hittable* object; // the shape that was hit, so light sampling can tell when a bounce lands on a light
+    // Width of the cone of rays around this one where it hit, filled in by the camera for picking the mip level of textures
+    Real footprint;
+};
+
+// Texture coordinates at a corner of a triangle
+struct UV{
+    float u, v;
 };
 
 
@@ -21,30 +29,96 @@ class Hittable{
     virtual ~Hittable() = default;
     virtual bool hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const = 0;
     virtual BBox bbox() const = 0;
+    // The finite part of bbox(), for things that only care where the bounded objects are. The same as bbox()
+    // for everything but a BVH with unbounded objects kept next to its tree.
+    virtual BBox bounded_bbox()const;
+    // Whether anything at all is in the way within allowed_distance, for shadow rays
+    // It does not need the closest hit, so lists and BVHs stop at the first one they find
+    virtual bool occluded(const Ray& ray, RealRange allowed_distance)const;
+    // Texture coordinates of a hit on this shape, and how fast they change per unit of distance along the surface
+    // Only worked out when a textured material asks, most hits never need them. 0 for shapes without any.
+    virtual void texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const;
 };
 
 class Triangle:public Hittable{
     public:
     Point3 p1,p2,p3;
     Vector3 normal;
-    std::shared_ptr<Material> material;
+    MaterialId material;
+    // Without texture coordinates of its own, u and v of a hit are its barycentric coordinates
+    UV uv[3] = {{0,0},{1,0},{0,1}};
     Triangle(const Point3& p1, const Point3& p2, const Point3& p3);
     Triangle(const Point3& p1, const Point3& p2, const Point3& p3, std::shared_ptr<Material> mat);
+    Triangle(const Point3& p1, const Point3& p2, const Point3& p3, MaterialId mat);
 
     bool hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const;
     BBox bbox()const;
+    void texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const;
+    // Bookkeeping for a ray that is already known to hit this triangle at the given distance
+    void fill_hit_record(const Ray& ray, Real distance, HitRecord& rec)const;
+    // Weights of p1, p2 and p3 for a point on the triangle
+    void barycentric(const Point3& point, Real& b1, Real& b2, Real& b3)const;
 };
 
 class Sphere:public Hittable{
     public:
     Point3 center;
-    double radius;
-    std::shared_ptr<Material> material;
-    Sphere(const Point3& center, double radius);
-    Sphere(const Point3& center, double radius, std::shared_ptr<Material> mat);
+    Real radius;
+    MaterialId material;
+    Sphere(const Point3& center, Real radius);
+    Sphere(const Point3& center, Real radius, std::shared_ptr<Material> mat);
+    Sphere(const Point3& center, Real radius, MaterialId mat);
+
+    bool hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const;
+    BBox bbox()const;
+    void texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const;
+    // Bookkeeping for a ray that is already known to hit this sphere at the given distance
+    void fill_hit_record(const Ray& ray, Real distance, HitRecord& rec)const;
+};
+
+// Infinite plane through a point - its bbox is infinite so BVHList keeps it out of the tree
+class Plane:public Hittable{
+    public:
+    Point3 point;
+    Vector3 normal;
+    MaterialId material;
+    Plane(const Point3& point, const Vector3& normal);
+    Plane(const Point3& point, const Vector3& normal, std::shared_ptr<Material> mat);
+    Plane(const Point3& point, const Vector3& normal, MaterialId mat);
+
+    bool hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const;
+    BBox bbox()const;
+    void texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const;
+};
+
+// Flat circle facing along its normal
+class Disk:public Hittable{
+    public:
+    Point3 center;
+    Vector3 normal;
+    Real radius;
+    MaterialId material;
+    Disk(const Point3& center, const Vector3& normal, Real radius);
+    Disk(const Point3& center, const Vector3& normal, Real radius, std::shared_ptr<Material> mat);
+    Disk(const Point3& center, const Vector3& normal, Real radius, MaterialId mat);
+
+    bool hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const;
+    BBox bbox()const;
+    void texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const;
+};
+
+// Solid axis aligned box - a single slab test instead of the 12 triangles from make_cube
+class AABox:public Hittable{
+    public:
+    BBox box;
+    MaterialId material;
+    AABox(const Point3& min, const Point3& max);
+    AABox(const Point3& min, const Point3& max, std::shared_ptr<Material> mat);
+    AABox(const Point3& min, const Point3& max, MaterialId mat);
 
     bool hit(const Ray& ray, RealRange& allowed_distance, HitRecord& rec)const;
     BBox bbox()const;
+    void texture_coordinates(const HitRecord& rec, Real& u, Real& v, Real& uv_scale)const;
 };
 
-std::vector<std::shared_ptr<Triangle>> make_cube(double radius, const Point3& center, std::shared_ptr<Material> material);
\ No newline at end of file
+std::vector<std::shared_ptr<Triangle>> make_cube(Real radius, const Point3& center, std::shared_ptr<Material> material);
\ No newline at end of file
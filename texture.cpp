@@ -0,0 +1,337 @@
+#include "texture.h"
+#include <png.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cmath>
+#include <filesystem>
+
+std::atomic<size_t> Texture::cache_bytes_per_thread = 32ull<<20;
+TextureTable texture_table;
+
+//===================================================================
+// Tile cache
+//===================================================================
+// Least recently used tiles of any texture, one of these per thread so lookups never wait on each other
+class TileCache{
+    struct Slot{
+        uint64_t key;
+        int newer, older; // neighbours in the recently used list, -1 at the ends
+    };
+    std::vector<float> storage; // the texels of every slot back to back
+    std::vector<Slot> slots;
+    std::unordered_map<uint64_t, int> where;
+    int newest = -1, oldest = -1;
+    size_t capacity = 0;
+    // Neighbouring lookups nearly always land on the same tile, so that skips the hash map
+    uint64_t last_key = ~0ull;
+    const float* last_tile = nullptr;
+
+    void unlink(int slot){
+        Slot& s = slots[slot];
+        if(s.newer >= 0) slots[s.newer].older = s.older; else newest = s.older;
+        if(s.older >= 0) slots[s.older].newer = s.newer; else oldest = s.newer;
+    }
+    void make_newest(int slot){
+        slots[slot].newer = -1;
+        slots[slot].older = newest;
+        if(newest >= 0) slots[newest].newer = slot;
+        newest = slot;
+        if(oldest < 0) oldest = slot;
+    }
+
+    public:
+    const float* tile(const Texture& texture, TextureId id, int level, int tile_index){
+        uint64_t key = ((uint64_t)id<<40) | ((uint64_t)level<<32) | (uint32_t)tile_index;
+        if(key == last_key) return last_tile;
+        if(!capacity) capacity = std::max<size_t>(1, Texture::cache_bytes_per_thread / Texture::tile_bytes);
+        constexpr size_t tile_floats = Texture::tile_bytes/sizeof(float);
+
+        int slot;
+        auto found = where.find(key);
+        if(found != where.end()){
+            slot = found->second;
+            unlink(slot);
+        } else {
+            if(slots.size() < capacity){
+                slot = slots.size();
+                slots.push_back({});
+                storage.resize(slots.size()*tile_floats);
+            } else {
+                slot = oldest;
+                unlink(slot);
+                where.erase(slots[slot].key);
+            }
+            slots[slot].key = key;
+            where[key] = slot;
+            if(!texture.read_tile(level, tile_index, &storage[slot*tile_floats])){
+                std::fill_n(&storage[slot*tile_floats], tile_floats, 0.0f);
+            }
+        }
+        make_newest(slot);
+        last_key = key;
+        last_tile = &storage[slot*tile_floats];
+        return last_tile;
+    }
+};
+static thread_local TileCache tile_cache;
+
+//===================================================================
+// Texture
+//===================================================================
+Texture::~Texture(){
+    if(fd >= 0) close(fd);
+}
+
+// Decodes the source image into linear RGB, top row first
+static bool read_source_image(const std::string& filename, int& width, int& height, std::vector<float>& texels){
+    std::string extension = filename.substr(std::min(filename.size(), filename.rfind('.')+1));
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c){ return std::tolower(c); });
+    if(extension == "pfm"){
+        Image image(1,1);
+        if(!image.read_from_pfm(filename)) return false;
+        width = image.width();
+        height = image.height();
+        texels.resize((size_t)width*height*3);
+        for(size_t i=0; i<image.size(); i++){
+            texels[i*3 + 0] = image[i].red;
+            texels[i*3 + 1] = image[i].green;
+            texels[i*3 + 2] = image[i].blue;
+        }
+        return true;
+    }
+
+    png_image png;
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    if(!png_image_begin_read_from_file(&png, filename.c_str())) return false;
+    png.format = PNG_FORMAT_RGB;
+    std::vector<png_byte> bytes(PNG_IMAGE_SIZE(png));
+    if(!png_image_finish_read(&png, nullptr, bytes.data(), 0, nullptr)){
+        png_image_free(&png);
+        return false;
+    }
+    width = png.width;
+    height = png.height;
+    texels.resize(bytes.size());
+    // The inverse of Image::linear_to_gamma, so a texture saved by write_to_png reads back the same
+    for(size_t i=0; i<bytes.size(); i++){
+        float value = bytes[i] / 255.0f;
+        texels[i] = value*value;
+    }
+    return true;
+}
+
+static constexpr char tile_file_magic[8] = {'R','T','T','I','L','E','S','1'};
+struct TileFileHeader{
+    char magic[8];
+    int32_t width, height;
+};
+
+// Level sizes and where each level's tiles start in the tile file, the same for any image of that size
+static std::vector<Texture::Level> plan_levels(int width, int height){
+    std::vector<Texture::Level> levels;
+    uint64_t offset = sizeof(TileFileHeader);
+    while(true){
+        Texture::Level level;
+        level.width = width;
+        level.height = height;
+        level.tiles_x = (width + Texture::tile_size-1) / Texture::tile_size;
+        level.tiles_y = (height + Texture::tile_size-1) / Texture::tile_size;
+        level.offset = offset;
+        offset += (uint64_t)level.tiles_x*level.tiles_y*Texture::tile_bytes;
+        levels.push_back(level);
+        if(width == 1 && height == 1) break;
+        width = std::max(1, width/2);
+        height = std::max(1, height/2);
+    }
+    return levels;
+}
+
+bool Texture::make_tile_file(const std::string& tile_filename)const{
+    int width = 0, height = 0;
+    std::vector<float> texels;
+    if(!read_source_image(source, width, height, texels) || width <= 0 || height <= 0){
+        printf("%s: unable to read texture\n", source.c_str());
+        return false;
+    }
+
+    // Written to a temporary name and then renamed, so another process never sees half a file
+    std::string partial = tile_filename + "." + std::to_string(getpid());
+    FILE* fp = fopen(partial.c_str(), "wb");
+    if(!fp){
+        printf("%s: unable to write %s\n", source.c_str(), partial.c_str());
+        return false;
+    }
+    TileFileHeader header;
+    memcpy(header.magic, tile_file_magic, sizeof(header.magic));
+    header.width = width;
+    header.height = height;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    std::vector<float> tile(tile_bytes/sizeof(float));
+    std::vector<float> smaller;
+    std::vector<Level> planned = plan_levels(width, height);
+    for(size_t l=0; ok && l<planned.size(); l++){
+        const Level& level = planned[l];
+        if(l > 0){
+            // Each level averages 2x2 texels of the one above, an odd last row or column folds into its neighbour
+            const Level& above = planned[l-1];
+            smaller.assign((size_t)level.width*level.height*3, 0.0f);
+            for(int y=0; y<above.height; y++){
+                int sy = std::min(y/2, level.height-1);
+                for(int x=0; x<above.width; x++){
+                    int sx = std::min(x/2, level.width-1);
+                    for(int c=0; c<3; c++) smaller[((size_t)sy*level.width + sx)*3 + c] += texels[((size_t)y*above.width + x)*3 + c];
+                }
+            }
+            for(int y=0; y<level.height; y++){
+                int rows = (y == level.height-1) ? above.height - 2*y : 2;
+                for(int x=0; x<level.width; x++){
+                    int columns = (x == level.width-1) ? above.width - 2*x : 2;
+                    for(int c=0; c<3; c++) smaller[((size_t)y*level.width + x)*3 + c] /= rows*columns;
+                }
+            }
+            texels.swap(smaller);
+        }
+        // Edge tiles are padded out to the full size so every tile is at offset + index * tile_bytes
+        for(int ty=0; ok && ty<level.tiles_y; ty++){
+            for(int tx=0; ok && tx<level.tiles_x; tx++){
+                std::fill(tile.begin(), tile.end(), 0.0f);
+                for(int y=0; y<tile_size && ty*tile_size+y < level.height; y++){
+                    int columns = std::min(tile_size, level.width - tx*tile_size);
+                    memcpy(&tile[(size_t)y*tile_size*3], &texels[(((size_t)ty*tile_size+y)*level.width + tx*tile_size)*3], columns*3*sizeof(float));
+                }
+                ok = fwrite(tile.data(), tile_bytes, 1, fp) == 1;
+            }
+        }
+    }
+    ok &= fclose(fp) == 0;
+    if(!ok || rename(partial.c_str(), tile_filename.c_str()) != 0){
+        printf("%s: unable to write %s\n", source.c_str(), tile_filename.c_str());
+        unlink(partial.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Texture::open_tile_file(const std::string& tile_filename){
+    int file = open(tile_filename.c_str(), O_RDONLY);
+    if(file < 0) return false;
+    TileFileHeader header;
+    struct stat info;
+    if(pread(file, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, tile_file_magic, sizeof(header.magic)) ||
+       header.width <= 0 || header.height <= 0 || fstat(file, &info) != 0){
+        close(file);
+        return false;
+    }
+    std::vector<Level> planned = plan_levels(header.width, header.height);
+    const Level& last = planned.back();
+    if((uint64_t)info.st_size != last.offset + (uint64_t)last.tiles_x*last.tiles_y*tile_bytes){
+        close(file);
+        return false;
+    }
+    fd = file;
+    levels = std::move(planned);
+    return true;
+}
+
+bool Texture::load(const std::string& filename){
+    source = filename;
+    std::error_code error;
+    auto modified = std::filesystem::last_write_time(filename, error);
+    auto size = std::filesystem::file_size(filename, error);
+    if(error){
+        printf("%s: unable to open texture\n", filename.c_str());
+        return false;
+    }
+    // Named after the source and its size and modification time, so an edited image gets a new tile file
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(filename, error);
+    size_t key = std::hash<std::string>()(canonical.string());
+    key ^= std::hash<uint64_t>()(size) + 0x9e3779b97f4a7c15ull + (key<<6) + (key>>2);
+    key ^= std::hash<int64_t>()(modified.time_since_epoch().count()) + 0x9e3779b97f4a7c15ull + (key<<6) + (key>>2);
+    std::filesystem::path directory = std::filesystem::temp_directory_path(error) / "raytrace_tiles";
+    std::filesystem::create_directories(directory, error);
+    char name[32];
+    snprintf(name, sizeof(name), "%016zx.tiles", key);
+    std::string tile_filename = (directory / name).string();
+
+    if(open_tile_file(tile_filename)) return true;
+    return make_tile_file(tile_filename) && open_tile_file(tile_filename);
+}
+
+bool Texture::read_tile(int level, int tile, float* tile_texels)const{
+    uint64_t offset = levels[level].offset + (uint64_t)tile*tile_bytes;
+    size_t done = 0;
+    while(done < tile_bytes){
+        ssize_t bytes = pread(fd, (char*)tile_texels + done, tile_bytes - done, offset + done);
+        if(bytes <= 0) return false;
+        done += bytes;
+    }
+    return true;
+}
+
+Color Texture::texel(TextureId id, int level, int x, int y)const{
+    const Level& size = levels[level];
+    // repeat
+    x %= size.width; if(x < 0) x += size.width;
+    y %= size.height; if(y < 0) y += size.height;
+    const float* tile = tile_cache.tile(*this, id, level, (y/tile_size)*size.tiles_x + x/tile_size);
+    const float* rgb = tile + ((y%tile_size)*tile_size + x%tile_size)*3;
+    return Color{rgb[0], rgb[1], rgb[2]};
+}
+
+Color Texture::bilinear(TextureId id, int level, Real u, Real v)const{
+    const Level& size = levels[level];
+    // Texel centers are at half steps, and images are stored top row first
+    double x = u*size.width - 0.5;
+    double y = (1.0 - v)*size.height - 0.5;
+    double fx = std::floor(x), fy = std::floor(y);
+    int x0 = (int)fx, y0 = (int)fy;
+    Real tx = x - fx, ty = y - fy;
+    Color top = Vector3::lerp(texel(id,level,x0,y0), texel(id,level,x0+1,y0), tx);
+    Color bottom = Vector3::lerp(texel(id,level,x0,y0+1), texel(id,level,x0+1,y0+1), tx);
+    return Vector3::lerp(top, bottom, ty);
+}
+
+Color Texture::sample(TextureId id, Real u, Real v, Real width)const{
+    // Keep the coordinates small so the texel math stays precise far from the origin
+    u -= std::floor(u);
+    v -= std::floor(v);
+    // The level where the lookup spans about one texel, blended with the next smaller one
+    double texels_across = width * std::max(levels.front().width, levels.front().height);
+    double lod = texels_across > 1.0 ? std::log2(texels_across) : 0.0;
+    int last = levels.size()-1;
+    if(lod >= last) return bilinear(id, last, u, v);
+    int level = (int)lod;
+    Real blend = lod - level;
+    Color finer = bilinear(id, level, u, v);
+    if(blend <= 0) return finer;
+    return Vector3::lerp(finer, bilinear(id, level+1, u, v), blend);
+}
+
+//===================================================================
+// TextureTable
+//===================================================================
+TextureId TextureTable::add(const std::string& filename){
+    std::lock_guard<std::mutex> guard(add_mutex);
+    auto found = by_filename.find(filename);
+    if(found != by_filename.end()) return found->second;
+
+    TextureId id = count.load(std::memory_order_relaxed);
+    if(id >= max_textures){
+        printf("Texture table is full, %s is left untextured\n", filename.c_str());
+        return 0;
+    }
+    // Loading while holding the lock also means only one source image is ever decoded in memory at a time
+    auto texture = std::make_unique<Texture>();
+    if(!texture->load(filename)){
+        by_filename[filename] = 0; // only reported once
+        return 0;
+    }
+    textures[id] = std::move(texture);
+    by_filename[filename] = id;
+    count.store(id+1, std::memory_order_release);
+    return id;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include "image.h"
+
+// Index of a texture in texture_table, 0 being no texture at all
+using TextureId = uint32_t;
+
+// An image kept on disk as a pyramid of mip levels cut into square tiles. Only the tiles that lookups touch
+// get read back in, into a cache of fixed size per thread, so the memory textures take stays the same no
+// matter how many a scene uses or how large they are.
+// The tile file is made once per source image and kept in the temp directory for the next run.
+class Texture{
+    public:
+    static constexpr int tile_size = 64; // texels along each side of a tile
+    static constexpr size_t tile_bytes = tile_size*tile_size*3*sizeof(float); // linear RGB floats
+    struct Level{
+        int width, height;
+        int tiles_x, tiles_y;
+        uint64_t offset; // of its first tile in the tile file
+    };
+
+    private:
+    std::string source;
+    int fd = -1; // of the tile file, only ever read with pread so every thread can share it
+    std::vector<Level> levels;
+
+    bool make_tile_file(const std::string& tile_filename)const;
+    bool open_tile_file(const std::string& tile_filename);
+    Color texel(TextureId id, int level, int x, int y)const;
+    Color bilinear(TextureId id, int level, Real u, Real v)const;
+
+    public:
+    Texture() = default;
+    Texture(const Texture& other) = delete;
+    ~Texture();
+    // PNG or PFM, false if it could not be read
+    bool load(const std::string& filename);
+    const std::string& filename()const{ return source; }
+    int width()const{ return levels.front().width; }
+    int height()const{ return levels.front().height; }
+    size_t level_count()const{ return levels.size(); }
+    // Reads one tile of a level into tile (tile_bytes), false if the read failed
+    bool read_tile(int level, int tile, float* tile_texels)const;
+
+    // Filtered color at u,v (repeating outside of 0-1, v going up from the bottom of the image) for a lookup
+    // spread over width in texture coordinates - wider lookups read from smaller mip levels
+    // id is this texture's own id, the tile caches key on it
+    Color sample(TextureId id, Real u, Real v, Real width)const;
+
+    // Bytes of tiles every render thread keeps in memory at most, only read when a thread first looks something up
+    static std::atomic<size_t> cache_bytes_per_thread;
+};
+
+// Append only table of every texture, textures from the same file share one entry.
+// Same layout as MaterialTable so lookups never lock, only add() does.
+class TextureTable{
+    static constexpr unsigned int max_textures = 1u<<16;
+
+    std::unique_ptr<Texture> textures[max_textures]; // slot 0 stays empty for "no texture"
+    std::atomic<TextureId> count = 1;
+    std::mutex add_mutex;
+    std::unordered_map<std::string, TextureId> by_filename; // failed loads are remembered as 0
+
+    public:
+    // Loads the texture the first time the file is asked for, 0 if it cannot be loaded
+    TextureId add(const std::string& filename);
+    const Texture& operator[](TextureId id)const{ return *textures[id]; }
+    TextureId size()const{ return count.load(std::memory_order_acquire); }
+};
+extern TextureTable texture_table;
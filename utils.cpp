@@ -6,51 +6,44 @@ std::random_device random_seed_device; // used for seeding
 thread_local std::default_random_engine gen(random_seed_device());
 // thread_local std::mt19937 gen(random_seed_device());
 // thread_local pcg32 gen(random_seed_device());
-std::uniform_real_distribution<double> random_percentage_distribution(0.0,1.0);
-std::uniform_real_distribution<double> random_neg_pos_one(-1.0,1.0); // range from -1 - 1
+std::uniform_real_distribution<Real> random_percentage_distribution(0.0,1.0);
+std::uniform_real_distribution<Real> random_neg_pos_one(-1.0,1.0); // range from -1 - 1
 #else
 std::random_device random_seed_device; // used for seeding
-double pcg(){
+Real pcg(){
     thread_local static unsigned int seed = random_seed_device();
     unsigned int state = seed * 747796405 + 2891336453;
     unsigned int word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737;
     seed = (word >> 22) ^ word;
-    return seed / (double) std::numeric_limits<unsigned int>::max();
+    return seed / (Real) std::numeric_limits<unsigned int>::max();
 }
-double (*gen)() = pcg;
-double random_percentage_distribution(double(*seeder)()){
+Real (*gen)() = pcg;
+Real random_percentage_distribution(Real(*seeder)()){
     return seeder();
 }
-double random_neg_pos_one(double(*seeder)()){
+Real random_neg_pos_one(Real(*seeder)()){
     return seeder()*2.0 - 1.0;
 }
-double random_range(double(*seeder)(),const double min,const double max){
+Real random_range(Real(*seeder)(),const Real min,const Real max){
     return seeder()*(max-min) + min;
 }
 #endif
 
 
-RealRange::RealRange():min(Infinity),max(-Infinity){}
-RealRange::RealRange(double min, double max):min(min),max(max){}
-double RealRange::size()const{
-    return max-min;
-}
-// x within range - includes end ranges as valid
-bool RealRange::contains(double x)const{
-    return min <= x && x <= max;
-}
-// x within range - excludes end ranges as valid
-bool RealRange::surrounds(double x)const{
-    return min < x && x < max;
-}
-double RealRange::clamp(double x)const{
-    if (x<min) return min;
-    if (x>max) return max;
-    return x;
-}
 const RealRange RealRange::empty = RealRange(+Infinity,-Infinity);
 const RealRange RealRange::universe = RealRange(-Infinity,+Infinity);
 
+const char* cpu_dispatch_level(){
+#if defined(__x86_64__) && !defined(NO_CPU_DISPATCH)
+    // Same order that the target_clones resolver checks them in
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("x86-64-v4")) return "x86-64-v4 (AVX-512)";
+    if(__builtin_cpu_supports("x86-64-v3")) return "x86-64-v3 (AVX2)";
+    if(__builtin_cpu_supports("x86-64-v2")) return "x86-64-v2 (SSE4.2)";
+#endif
+    return "default";
+}
+
 
 Stopwatch::Stopwatch():startTime(Clock::now()){}
 void Stopwatch::reset(){
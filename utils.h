@@ -7,7 +7,16 @@
 #include <random>
 #include <chrono>
 
-const double Infinity = std::numeric_limits<double>::infinity();
+// Scalar type used for geometry, traversal and colors
+// Building with -DSINGLE_PRECISION halves the memory bandwidth of every vector, box, ray and pixel
+// and packs 8 lanes into the same 256 bits that hold 4 doubles (see PACK_WIDTH)
+#ifdef SINGLE_PRECISION
+using Real = float;
+#else
+using Real = double;
+#endif
+
+const Real Infinity = std::numeric_limits<Real>::infinity();
 const double PI = 3.1415926535897932385;
 
 #ifdef stl_random
@@ -15,15 +24,15 @@ extern std::random_device random_seed_device; // used for seeding
 extern thread_local std::default_random_engine gen; // common generator to pass into distributions
 // extern thread_local std::mt19937 gen;
 // extern thread_local pcg32 gen;
-extern std::uniform_real_distribution<double> random_percentage_distribution; // range from 0 - 1
-extern std::uniform_real_distribution<double> random_neg_pos_one; // range from -1 - 1
+extern std::uniform_real_distribution<Real> random_percentage_distribution; // range from 0 - 1
+extern std::uniform_real_distribution<Real> random_neg_pos_one; // range from -1 - 1
 #else
 extern std::random_device random_seed_device; // used for seeding
-extern double pcg();
-extern double (*gen)();
-extern double random_percentage_distribution(double(*seeder)()); // range from 0 - 1
-extern double random_neg_pos_one(double(*seeder)()); // range from -1 - 1
-extern double random_range(double(*seeder)(),const double min,const double max);
+extern Real pcg();
+extern Real (*gen)();
+extern Real random_percentage_distribution(Real(*seeder)()); // range from 0 - 1
+extern Real random_neg_pos_one(Real(*seeder)()); // range from -1 - 1
+extern Real random_range(Real(*seeder)(),const Real min,const Real max);
 #endif
 
 template<typename... Args>
@@ -37,16 +46,52 @@ void print(const char* fmnt, Args... args){
 
 class RealRange{
     public:
-    double min,max;
+    Real min,max;
     RealRange();
-    RealRange(double min, double max);
-    double size()const; // max - min
-    bool contains(double x)const; // x within range - includes end ranges as valid
-    bool surrounds(double x)const; // x within range - excludes end ranges as valid
-    double clamp(double x)const; // return a value that is clamped to within this range
+    RealRange(Real min, Real max);
+    Real size()const; // max - min
+    bool contains(Real x)const; // x within range - includes end ranges as valid
+    bool surrounds(Real x)const; // x within range - excludes end ranges as valid
+    Real clamp(Real x)const; // return a value that is clamped to within this range
     static const RealRange empty, universe;
 };
 
+inline RealRange::RealRange():min(Infinity),max(-Infinity){}
+inline RealRange::RealRange(Real min, Real max):min(min),max(max){}
+inline Real RealRange::size()const{
+    return max-min;
+}
+// x within range - includes end ranges as valid
+inline bool RealRange::contains(Real x)const{
+    return min <= x && x <= max;
+}
+// x within range - excludes end ranges as valid
+inline bool RealRange::surrounds(Real x)const{
+    return min < x && x < max;
+}
+inline Real RealRange::clamp(Real x)const{
+    if (x<min) return min;
+    if (x>max) return max;
+    return x;
+}
+
+// The hot kernels get compiled once per instruction set and the loader picks the best one
+// that the running CPU supports, so a single binary gets AVX2/AVX-512 where it can and
+// still runs on a plain x86-64 machine. Build with -DNO_CPU_DISPATCH to only get the default.
+// These are the psABI levels rather than single features - v2 is SSE4.2, v3 is AVX2+FMA and
+// v4 is AVX-512 F/BW/DQ/VL. Plain "avx512f" without VL ends up using zmm registers for
+// 128 bit math which then stalls the SSE code around it.
+#if defined(__x86_64__) && !defined(NO_CPU_DISPATCH)
+#define CPU_DISPATCH __attribute__((target_clones("arch=x86-64-v4","arch=x86-64-v3","arch=x86-64-v2","default")))
+#else
+#define CPU_DISPATCH
+#endif
+// For the kernels a CPU_DISPATCH function calls, which otherwise get built once for the default target
+// and called from every clone. Forced inline each clone compiles its own copy for its instruction set.
+#define DISPATCH_INLINE inline __attribute__((always_inline))
+// Name of the best instruction set the dispatched kernels will use on this CPU
+const char* cpu_dispatch_level();
+
 class Stopwatch{
     typedef std::chrono::steady_clock Clock;
     protected:
@@ -1,6 +1,9 @@
 #include "vec_utils.h"
 #include <utility>
 #include <cmath>
+#include <bit>
+#include <type_traits>
+#include "sampler.h"
 
 using std::sqrt;
 
@@ -15,116 +18,6 @@ const Vector3 z_neg={0.0,0.0,-1.0};
 //===================================================================
 // Vector3
 //===================================================================
-Vector3 Vector3::operator+(const Vector3 &other)const{
-    return {
-        this->x + other.x,
-        this->y + other.y,
-        this->z + other.z
-        };
-}
-Vector3 Vector3::operator-(const Vector3 &other)const{
-    return {
-        this->x - other.x,
-        this->y - other.y,
-        this->z - other.z
-        };
-}
-Vector3 Vector3::operator*(const Vector3& other)const{
-    return {
-        this->x * other.x,
-        this->y * other.y,
-        this->z * other.z
-        };
-}
-Vector3 Vector3::operator/(const Vector3& other)const{
-    return {
-        this->x / other.x,
-        this->y / other.y,
-        this->z / other.z
-        };
-}
-Vector3 Vector3::operator*(double scale)const{
-    return {
-        this->x * scale,
-        this->y * scale,
-        this->z * scale
-        };
-}
-Vector3 Vector3::operator/(double scale)const{
-    return {
-        this->x / scale,
-        this->y / scale,
-        this->z / scale
-        };
-}
-
-Vector3& Vector3::operator+=(const Vector3 &other){
-    this->x += other.x;
-    this->y += other.y;
-    this->z += other.z;
-    return *this;
-}
-Vector3& Vector3::operator-=(const Vector3 &other){
-    this->x -= other.x;
-    this->y -= other.y;
-    this->z -= other.z;
-    return *this;
-}
-Vector3& Vector3::operator*=(double scale){
-    this->x *= scale;
-    this->y *= scale;
-    this->z *= scale;
-    return *this;
-}
-Vector3& Vector3::operator/=(double scale){
-    this->x /= scale;
-    this->y /= scale;
-    this->z /= scale;
-    return *this;
-}
-double Vector3::operator[](const int idx)const{
-    return data[idx];
-}
-double& Vector3::operator[](const int idx){
-    return data[idx];
-}
-double Vector3::dot(const Vector3& other)const{
-    return (this->x * other.x)
-        + (this->y * other.y)
-        + (this->z * other.z)
-        ;
-}
-Vector3 Vector3::cross(const Vector3& other)const{
-    Vector3 comb = {
-        (this->y * other.z) - (this->z * other.y),
-        (this->z * other.x) - (this->x * other.z),
-        (this->x * other.y) - (this->y * other.x)
-    };
-    return std::move(comb);
-}
-double Vector3::length()const{
-    return sqrt(length_squared());
-}
-double Vector3::length_squared()const{
-    return (x*x)+(y*y)+(z*z);
-}
-Vector3 Vector3::normalize()const{
-    double&& len = this->length();
-    return {
-        x / len,
-        y / len,
-        z / len
-    };
-}
-Vector3 Vector3::unit_length()const{
-    return std::move(this->operator/(this->length()));
-}
-Vector3 Vector3::reverse()const{
-    return {
-        -x,-y,-z
-    };
-}
-
 Vector3 Vector3::random(){
     return {
         random_percentage_distribution(gen),
@@ -132,8 +25,8 @@ Vector3 Vector3::random(){
         random_percentage_distribution(gen)
     };
 }
-Vector3 Vector3::random(double min, double max){
-    double range = max-min;
+Vector3 Vector3::random(Real min, Real max){
+    Real range = max-min;
     return {
         random_percentage_distribution(gen)*range + min,
         random_percentage_distribution(gen)*range + min,
@@ -158,9 +51,9 @@ Vector3 Vector3::random_unit_vector(){
     // z = z*cosy - x*siny = x*siny => -sinx*siny
     // so just due arbitrary personal preference, I like the second rotation to be around the x axis
 
-    // double rotx = random_percentage_distribution(gen)*2.0*PI;
-    // double roty = random_percentage_distribution(gen)*2.0*PI;
-    // double siny,sinx,cosy,cosx;
+    // Real rotx = random_percentage_distribution(gen)*2.0*PI;
+    // Real roty = random_percentage_distribution(gen)*2.0*PI;
+    // Real siny,sinx,cosy,cosx;
     // sincos(rotx,&sinx,&cosx);
     // sincos(roty,&siny,&cosy);
     // return {
@@ -173,18 +66,27 @@ Vector3 Vector3::random_unit_vector(){
     // It is slightly faster than the above - on 10 million runs, ~477ms versus ~484ms
     // while(true){
     //     Vector3 v = Vector3::random(-1,1);
-    //     double len_sq = v.length_squared();
+    //     Real len_sq = v.length_squared();
     //     if(len_sq<1.0){
     //         return v / sqrt(len_sq);
     //     }
     // }
 
-    // Using tan as a correction factor for picking a random point within a box should make it an even distribution
-    return Vector3{
-        tan(random_neg_pos_one(gen)),
-        tan(random_neg_pos_one(gen)),
-        tan(random_neg_pos_one(gen))
-    }.normalize();
+    // Using tan as a correction factor for picking a random point within a box gets close to even, but not quite
+    // return Vector3{
+    //     std::tan(random_neg_pos_one(gen)),
+    //     std::tan(random_neg_pos_one(gen)),
+    //     std::tan(random_neg_pos_one(gen))
+    // }.normalize();
+
+    // Exactly uniform - a uniform height on the sphere has uniform area above it (Archimedes' hat box)
+    // Light sampling needs the exact density of the bounces built from this, so close enough is not enough
+    Real u,v;
+    sample_2d(u,v);
+    Real z = 1 - 2*u;
+    Real angle = v * Real(2.0*PI);
+    Real ring = std::sqrt(std::max((Real)0.0, 1 - z*z));
+    return Vector3{ring*std::cos(angle), ring*std::sin(angle), z};
 }
 
 Vector3 Vector3::random_vector_on_hemisphere(const Vector3& normal){
@@ -194,31 +96,16 @@ Vector3 Vector3::random_vector_on_hemisphere(const Vector3& normal){
     return std::move(v);
 }
 
-Vector3 Vector3::lerp(const Vector3& first, const Vector3& second, double scale){
-    return (first* (1.0-scale) ) + second*scale;
-}
-
-void Vector3::min_accum(Vector3& accum, const Vector3& val){
-    if(val.x<accum.x) accum.x = val.x;
-    if(val.y<accum.y) accum.y = val.y;
-    if(val.z<accum.z) accum.z = val.z;
-}
-void Vector3::max_accum(Vector3& accum, const Vector3& val){
-    if(val.x>accum.x) accum.x = val.x;
-    if(val.y>accum.y) accum.y = val.y;
-    if(val.z>accum.z) accum.z = val.z;
+void Vector3::orthonormal_basis(const Vector3& normal, Vector3& tangent, Vector3& bitangent){
+    // Branchless version from Duff et al. "Building an Orthonormal Basis, Revisited"
+    Real sign = std::copysign((Real)1.0, normal.z);
+    Real a = -1 / (sign + normal.z);
+    Real b = normal.x * normal.y * a;
+    tangent = Vector3{1 + sign*normal.x*normal.x*a, sign*b, -sign*normal.x};
+    bitangent = Vector3{b, sign + normal.y*normal.y*a, -normal.y};
 }
 
-Vector3 Vector3::reflect_around_normal(const Vector3& normal, const Vector3& incoming){
-    // https://math.stackexchange.com/questions/13261/how-to-get-a-reflection-vector
-    double projection = 2 * incoming.dot(normal);
-    return incoming - (normal * projection);
-}
-Vector3 Vector3::reflect(const Vector3& incoming)const{
-    return reflect_around_normal(*this,incoming);
-}
-
-Vector3 Vector3::refract_around_normal(const Vector3& normal, const Vector3& incoming, const double& refractive_index_ratio){
+Vector3 Vector3::refract_around_normal(const Vector3& normal, const Vector3& incoming, const Real& refractive_index_ratio){
     auto cos_theta = fmin(1.0, incoming.reverse().dot(normal));
     Vector3 r_out_perp =  (incoming + (normal*cos_theta)) * refractive_index_ratio;
     Vector3 r_out_parallel = normal * -sqrt(fabs(1.0 - r_out_perp.length_squared()));
@@ -231,14 +118,13 @@ Vector3 Vector3::refract_around_normal(const Vector3& normal, const Vector3& inc
     // auto rot_axis = normal.cross(incoming);
     // return rot_axis.rotate(incoming,diff_theta);
 }
-Vector3 Vector3::refract(const Vector3& incoming, const double& refractive_index_ratio)const{
+Vector3 Vector3::refract(const Vector3& incoming, const Real& refractive_index_ratio)const{
     return refract_around_normal(*this,incoming,refractive_index_ratio);
 }
 
-Vector3 Vector3::rotate(const Vector3& point, double radians)const{
+Vector3 Vector3::rotate(const Vector3& point, Real radians)const{
     // https://suricrasia.online/blog/shader-functions/
-    double sinrot,cosrot;
-    sincos(radians,&sinrot,&cosrot);
+    Real sinrot = std::sin(radians), cosrot = std::cos(radians);
 
     Vector3 projection = operator*( dot(point) );
     return lerp(projection, point, cosrot) + (cross(point) * sinrot);
@@ -246,68 +132,37 @@ Vector3 Vector3::rotate(const Vector3& point, double radians)const{
 
 bool Vector3::near_zero()const{
     return
-        std::fabs(x) < std::numeric_limits<double>::epsilon()*15.0 &&
-        std::fabs(y) < std::numeric_limits<double>::epsilon()*15.0 &&
-        std::fabs(z) < std::numeric_limits<double>::epsilon()*15.0;
+        std::fabs(x) < std::numeric_limits<Real>::epsilon()*15.0 &&
+        std::fabs(y) < std::numeric_limits<Real>::epsilon()*15.0 &&
+        std::fabs(z) < std::numeric_limits<Real>::epsilon()*15.0;
 }
 
 //===================================================================
 // Ray
 //===================================================================
-Vector3 Ray::at(double distanceScale)const{
-    return this->direction * distanceScale + this->origin;
-}
 void Ray::debug_print()const{
     print("{:.2f} {:.2f} {:.2f}->",origin.x,origin.y,origin.z);
     print("{:.2f} {:.2f} {:.2f}  ",direction.x,direction.y,direction.z);
 }
 
+Point3 offset_ray_origin(const Point3& point, const Vector3& normal, const Vector3& outgoing_direction){
+    // "A Fast and Robust Method for Avoiding Self-Intersection" - Ray Tracing Gems chapter 6
+    // A fixed epsilon is either too big near the origin or too small far away from it, which
+    // is especially bad once the math is done in floats. So instead we step a fixed number of
+    // ulps away from the surface, and only fall back to a tiny fixed offset close to the origin
+    // where the ulps themselves get absurdly small.
+    using Bits = std::conditional_t<sizeof(Real)==sizeof(int), int, long long>;
+    const Real origin_threshold = 1.0/32.0;
+    const Real float_scale = sizeof(Real)==sizeof(float) ? 1.0/65536.0 : 1.0/4294967296.0;
+    const Real int_scale = 256.0;
 
-//===================================================================
-// BBox
-//===================================================================
-
-double BBox::half_surface_area()const{
-    Vector3 dv = max-min;
-    return (dv.x*(dv.z+dv.y))+(dv.z*dv.y);
-}
-RealRange BBox::intersection_distance(const Ray& ray)const{
-    // Taken from https://tavianator.com/2011/ray_box.html
-    // It is a specific impl of the SLAB method which bounds the direction in
-    // for every plane, and then finds the farthest/nearest intersections for the planes
-
-    // MAX and MIN start at the top here meaning absolute distance from the origin for the corners of the AABB
-    // dsmin and dsmax are then sorting the near/far for time-of-flight distances
-    auto dmin = (min - ray.origin)/ray.direction;
-    auto dmax = (max - ray.origin)/ray.direction;
-
-    Vector3 dsmin,dsmax; // sorted versions ie min is the min of both axes
+    Vector3 n = normal.dot(outgoing_direction) < 0.0 ? normal.reverse() : normal;
+    Point3 offset = point;
     for(int i=0; i<3; i++){
-        dsmin[i] = std::min(dmin[i],dmax[i]);
-        dsmax[i] = std::max(dmin[i],dmax[i]);
+        Bits of_i = (Bits)(int_scale * n[i]);
+        Real p_i = std::bit_cast<Real>( std::bit_cast<Bits>(point[i]) + (point[i]<0 ? -of_i : of_i) );
+        offset[i] = std::fabs(point[i]) < origin_threshold ? point[i] + float_scale*n[i] : p_i;
     }
-
-    // Now that we know the distances for intersections for x/y/z, we can tell if the
-    // intersections on each plane makes sense for our ray
-    return {
-        std::max(std::max(dsmin[0],dsmin[1]),dsmin[2]),
-        std::min(std::min(dsmax[0],dsmax[1]),dsmax[2]),
-    };
-}
-
-void BBox::absorb(const BBox& other) {
-    Vector3::min_accum(this->min,other.min);
-    Vector3::max_accum(this->max,other.max);
-}
-void BBox::absorb(const Point3& point) {
-    Vector3::min_accum(this->min,point);
-    Vector3::max_accum(this->max,point);
+    return offset;
 }
 
-Point3 BBox::center()const{
-    return {
-        (min.x + max.x) / 2.0,
-        (min.y + max.y) / 2.0,
-        (min.z + max.z) / 2.0,
-    };
-}
\ No newline at end of file
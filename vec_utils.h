@@ -1,53 +1,68 @@
 #pragma once
 #include <utility>
+#include <algorithm>
+#include <cmath>
 #include "utils.h"
 
-class Vector3{
+// Four lanes of Real - the SIMD view of a Vector3
+typedef Real Real4 __attribute__((vector_size(sizeof(Real)*4), __may_alias__));
+
+// Padded out to 4 lanes and aligned to the full width so every element-wise operator is a
+// single SIMD instruction, 4 doubles being one AVX register or 4 floats being one SSE register
+// The padding lane is zeroed by the brace initializers and otherwise never read by the math
+class alignas(sizeof(Real4)) Vector3{
     public:
     union{
         struct{
-            double x,y,z;
+            Real x,y,z,padding;
         };
         struct{
-            double red,green,blue;
+            Real red,green,blue;
         };
-        double data[3];
+        Real data[4];
     };
-    
+
+    // The vector type is only ever handed around by reference, since passing it by value
+    // across a call would change ABI between the per-ISA clones of the hot kernels
+    const Real4& lanes()const;
+    static Vector3 from_lanes(const Real4& lanes);
+
     Vector3 operator+(const Vector3& other)const;
     Vector3 operator-(const Vector3& other)const;
     Vector3 operator*(const Vector3& other)const;
     Vector3 operator/(const Vector3& other)const;
-    Vector3 operator*(double scale)const;
-    Vector3 operator/(double scale)const;
+    Vector3 operator*(Real scale)const;
+    Vector3 operator/(Real scale)const;
     Vector3& operator+=(const Vector3& other);
     Vector3& operator-=(const Vector3& other);
-    Vector3& operator*=(double);
-    Vector3& operator/=(double);
-    double operator[](const int idx)const;
-    double& operator[](const int idx);
-    double dot(const Vector3& other)const;
+    Vector3& operator*=(Real);
+    Vector3& operator/=(Real);
+    Real operator[](const int idx)const;
+    Real& operator[](const int idx);
+    Real dot(const Vector3& other)const;
     Vector3 cross(const Vector3& other)const;
-    double length()const;
-    double length_squared()const;
+    Real length()const;
+    Real length_squared()const;
     Vector3 normalize()const;
     Vector3 unit_length()const;
     Vector3 reverse()const;
 
     static Vector3 random();
-    static Vector3 random(double min, double max);
+    static Vector3 random(Real min, Real max);
     static Vector3 random_unit_vector();
     static Vector3 random_vector_on_hemisphere(const Vector3& normal);
-    static Vector3 lerp(const Vector3& first, const Vector3& second, double scale);
+    static Vector3 lerp(const Vector3& first, const Vector3& second, Real scale);
     static void min_accum(Vector3& accum, const Vector3& val);
     static void max_accum(Vector3& accum, const Vector3& val);
 
+    // Two unit vectors that make a right handed frame with the (unit) normal, for working in the normal's space
+    static void orthonormal_basis(const Vector3& normal, Vector3& tangent, Vector3& bitangent);
     static Vector3 reflect_around_normal(const Vector3& normal, const Vector3& incoming);
     Vector3 reflect(const Vector3& incoming)const;
-    static Vector3 refract_around_normal(const Vector3& normal, const Vector3& incoming, const double& refractive_index_ratio);
-    Vector3 refract(const Vector3& incoming, const double& refractive_index_ratio)const;
+    static Vector3 refract_around_normal(const Vector3& normal, const Vector3& incoming, const Real& refractive_index_ratio);
+    Vector3 refract(const Vector3& incoming, const Real& refractive_index_ratio)const;
     // rotate a point around this vector as the rotation axis
-    Vector3 rotate(const Vector3& point, double radians)const;
+    Vector3 rotate(const Vector3& point, Real radians)const;
 
     bool near_zero()const;
 };
@@ -57,19 +72,174 @@ class Ray{
     public:
     Point3 origin;
     Vector3 direction;
-    Vector3 at(double distanceScale)const;
+    Vector3 at(Real distanceScale)const;
     void debug_print()const;
 };
 
 class BBox{
     public:
     Point3 min,max;
-    double half_surface_area()const;
+    Real half_surface_area()const;
     RealRange intersection_distance(const Ray& ray)const;
     void absorb(const BBox& other);
     void absorb(const Point3& point);
     Point3 center()const;
+    bool is_finite()const; // false for things like infinite planes that cannot go into a BVH
 };
 
+// Nudge a surface point off of the surface so the next ray does not hit the surface it just left
+// The normal can face either way, the point is pushed to the same side as the outgoing direction
+Point3 offset_ray_origin(const Point3& point, const Vector3& normal, const Vector3& outgoing_direction);
+
 extern const Vector3 x_pos,y_pos,z_pos;
-extern const Vector3 x_neg,y_neg,z_neg;
\ No newline at end of file
+extern const Vector3 x_neg,y_neg,z_neg;
+
+//===================================================================
+// Inline implementations
+// These are the hot paths of every kernel, so they live in the header to get inlined
+// into each caller (and each per-ISA clone of it) without needing LTO to do it
+//===================================================================
+inline const Real4& Vector3::lanes()const{
+    return *reinterpret_cast<const Real4*>(data);
+}
+inline Vector3 Vector3::from_lanes(const Real4& lanes){
+    Vector3 v;
+    __builtin_memcpy(v.data,&lanes,sizeof(lanes));
+    return v;
+}
+
+inline Vector3 Vector3::operator+(const Vector3 &other)const{
+    return from_lanes(lanes() + other.lanes());
+}
+inline Vector3 Vector3::operator-(const Vector3 &other)const{
+    return from_lanes(lanes() - other.lanes());
+}
+inline Vector3 Vector3::operator*(const Vector3& other)const{
+    return from_lanes(lanes() * other.lanes());
+}
+inline Vector3 Vector3::operator/(const Vector3& other)const{
+    // The padding lane would be 0/0 - keep it a clean zero instead of a NaN
+    Vector3 v = from_lanes(lanes() / other.lanes());
+    v.padding = 0.0;
+    return v;
+}
+inline Vector3 Vector3::operator*(Real scale)const{
+    return from_lanes(lanes() * scale);
+}
+inline Vector3 Vector3::operator/(Real scale)const{
+    return from_lanes(lanes() * (1/scale));
+}
+
+inline Vector3& Vector3::operator+=(const Vector3 &other){
+    return *this = *this + other;
+}
+inline Vector3& Vector3::operator-=(const Vector3 &other){
+    return *this = *this - other;
+}
+inline Vector3& Vector3::operator*=(Real scale){
+    return *this = *this * scale;
+}
+inline Vector3& Vector3::operator/=(Real scale){
+    return *this = *this / scale;
+}
+inline Real Vector3::operator[](const int idx)const{
+    return data[idx];
+}
+inline Real& Vector3::operator[](const int idx){
+    return data[idx];
+}
+inline Real Vector3::dot(const Vector3& other)const{
+    Real4 m = lanes() * other.lanes();
+    return m[0] + m[1] + m[2];
+}
+inline Vector3 Vector3::cross(const Vector3& other)const{
+    return {
+        (this->y * other.z) - (this->z * other.y),
+        (this->z * other.x) - (this->x * other.z),
+        (this->x * other.y) - (this->y * other.x)
+    };
+}
+inline Real Vector3::length()const{
+    return std::sqrt(length_squared());
+}
+inline Real Vector3::length_squared()const{
+    return dot(*this);
+}
+inline Vector3 Vector3::normalize()const{
+    return *this / length();
+}
+inline Vector3 Vector3::unit_length()const{
+    return *this / length();
+}
+inline Vector3 Vector3::reverse()const{
+    return from_lanes(-lanes());
+}
+inline Vector3 Vector3::lerp(const Vector3& first, const Vector3& second, Real scale){
+    return (first* (1.0-scale) ) + second*scale;
+}
+inline void Vector3::min_accum(Vector3& accum, const Vector3& val){
+    const Real4& a = accum.lanes();
+    const Real4& v = val.lanes();
+    accum = from_lanes(v < a ? v : a);
+}
+inline void Vector3::max_accum(Vector3& accum, const Vector3& val){
+    const Real4& a = accum.lanes();
+    const Real4& v = val.lanes();
+    accum = from_lanes(v > a ? v : a);
+}
+inline Vector3 Vector3::reflect_around_normal(const Vector3& normal, const Vector3& incoming){
+    // https://math.stackexchange.com/questions/13261/how-to-get-a-reflection-vector
+    Real projection = 2 * incoming.dot(normal);
+    return incoming - (normal * projection);
+}
+inline Vector3 Vector3::reflect(const Vector3& incoming)const{
+    return reflect_around_normal(*this,incoming);
+}
+
+inline Vector3 Ray::at(Real distanceScale)const{
+    return this->direction * distanceScale + this->origin;
+}
+
+inline Real BBox::half_surface_area()const{
+    Vector3 dv = max-min;
+    return (dv.x*(dv.z+dv.y))+(dv.z*dv.y);
+}
+inline RealRange BBox::intersection_distance(const Ray& ray)const{
+    // Taken from https://tavianator.com/2011/ray_box.html
+    // It is a specific impl of the SLAB method which bounds the direction in
+    // for every plane, and then finds the farthest/nearest intersections for the planes
+
+    // MAX and MIN start at the top here meaning absolute distance from the origin for the corners of the AABB
+    // dsmin and dsmax are then sorting the near/far for time-of-flight distances
+    const Real4& origin = ray.origin.lanes();
+    const Real4& direction = ray.direction.lanes();
+    Real4 dmin = (min.lanes() - origin) / direction;
+    Real4 dmax = (max.lanes() - origin) / direction;
+
+    // sorted versions ie min is the min of both axes - the padding lane is never looked at
+    Real4 dsmin = dmin < dmax ? dmin : dmax;
+    Real4 dsmax = dmin < dmax ? dmax : dmin;
+
+    // Now that we know the distances for intersections for x/y/z, we can tell if the
+    // intersections on each plane makes sense for our ray
+    return {
+        std::max(std::max(dsmin[0],dsmin[1]),dsmin[2]),
+        std::min(std::min(dsmax[0],dsmax[1]),dsmax[2]),
+    };
+}
+inline void BBox::absorb(const BBox& other) {
+    Vector3::min_accum(this->min,other.min);
+    Vector3::max_accum(this->max,other.max);
+}
+inline void BBox::absorb(const Point3& point) {
+    Vector3::min_accum(this->min,point);
+    Vector3::max_accum(this->max,point);
+}
+inline Point3 BBox::center()const{
+    return (min + max) * (Real)0.5;
+}
+inline bool BBox::is_finite()const{
+    return
+        std::isfinite(min.x) && std::isfinite(min.y) && std::isfinite(min.z) &&
+        std::isfinite(max.x) && std::isfinite(max.y) && std::isfinite(max.z);
+}
\ No newline at end of file
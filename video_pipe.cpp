@@ -0,0 +1,62 @@
+#include "video_pipe.h"
+#include <csignal>
+#include <cstring>
+
+bool VideoPipe::open(const std::string& command, Format pipe_format){
+    close();
+    // A command that quits early should fail the writes rather than kill the renderer
+    std::signal(SIGPIPE, SIG_IGN);
+    pipe = popen(command.c_str(), "w");
+    if(!pipe) return false;
+    format = pipe_format;
+    closing = failed = false;
+    writer = std::jthread([this]{ write_queued(); });
+    return true;
+}
+
+void VideoPipe::write_queued(){
+    while(true){
+        std::vector<uint8_t> frame;
+        {
+            std::unique_lock lock(mutex);
+            frame_queued.wait(lock, [this]{ return !queue.empty() || closing; });
+            if(queue.empty()) return;
+            frame = std::move(queue.front());
+            queue.pop_front();
+        }
+        frame_taken.notify_one();
+        if(!failed && fwrite(frame.data(),1,frame.size(),pipe) != frame.size()) failed = true;
+    }
+}
+
+void VideoPipe::write(const Image& frame){
+    if(!pipe) return;
+    std::vector<uint8_t> bytes;
+    if(format == Format::RGB24){
+        frame.to_rgb24(bytes);
+    } else {
+        std::vector<float> floats;
+        frame.to_rgb_float(floats);
+        bytes.resize(floats.size()*sizeof(float));
+        memcpy(bytes.data(), floats.data(), bytes.size());
+    }
+    {
+        std::unique_lock lock(mutex);
+        frame_taken.wait(lock, [this]{ return queue.size() < max_queued; });
+        queue.push_back(std::move(bytes));
+    }
+    frame_queued.notify_one();
+}
+
+bool VideoPipe::close(){
+    if(!pipe) return true;
+    {
+        std::lock_guard lock(mutex);
+        closing = true;
+    }
+    frame_queued.notify_one();
+    writer.join();
+    int status = pclose(pipe);
+    pipe = nullptr;
+    return status == 0 && !failed;
+}
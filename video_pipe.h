@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#include "image.h"
+
+// Frames streamed in order to the standard input of a command, like ffmpeg reading rawvideo, so a video needs
+// no image files in between. A thread feeds the pipe while the next frame renders, but only max_queued frames
+// wait for it - past that write() blocks until the command has caught up.
+class VideoPipe{
+    public:
+    enum class Format{
+        RGB24, // tonemapped the same as the PNGs
+        Float, // the float RGB of the render, ffmpeg's rgbf32le
+    };
+    static constexpr size_t max_queued = 2;
+
+    private:
+    FILE* pipe = nullptr;
+    Format format = Format::RGB24;
+    std::deque<std::vector<uint8_t>> queue;
+    std::mutex mutex;
+    std::condition_variable frame_queued, frame_taken;
+    bool closing = false;
+    bool failed = false; // the command stopped reading
+    std::jthread writer;
+
+    void write_queued();
+
+    public:
+    VideoPipe() = default;
+    VideoPipe(const VideoPipe&) = delete;
+    VideoPipe& operator=(const VideoPipe&) = delete;
+    ~VideoPipe(){ close(); }
+
+    // Starts command through the shell, false if it could not be
+    bool open(const std::string& command, Format format);
+    bool is_open()const{ return pipe != nullptr; }
+    void write(const Image& frame);
+    // Sends everything still queued and waits for the command to finish, false if it failed or stopped early
+    bool close();
+};